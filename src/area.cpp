@@ -0,0 +1,327 @@
+#include "area.hpp"
+
+#include <curl/curl.h>
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
+
+#include "download.hpp"
+#include "extract.hpp"
+#include "metrics.hpp"
+
+#define METERS_PER_LAT_DEGREE 111320.0
+#define DEG_RAD 0.0174533
+// A dense cell is split into 4 at most this many times
+#define MAX_CELL_DEPTH 8
+
+// Sign of the turn from a to b to c, 0 if they are on one line
+static int orientation(
+	std::pair<double, double> a, std::pair<double, double> b, std::pair<double, double> c) {
+	double cross = (b.first - a.first) * (c.second - a.second)
+				   - (b.second - a.second) * (c.first - a.first);
+	return (cross > 0) - (cross < 0);
+}
+
+// Also true when they only touch
+static bool segments_intersect(std::pair<double, double> a, std::pair<double, double> b,
+	std::pair<double, double> c, std::pair<double, double> d) {
+	int o1 = orientation(a, b, c);
+	int o2 = orientation(a, b, d);
+	int o3 = orientation(c, d, a);
+	int o4 = orientation(c, d, b);
+	if(o1 != o2 && o3 != o4) {
+		return true;
+	}
+	// Collinear, overlapping if their bounding boxes do
+	return o1 == 0 && o2 == 0 && std::max(a.first, b.first) >= std::min(c.first, d.first)
+		   && std::max(c.first, d.first) >= std::min(a.first, b.first)
+		   && std::max(a.second, b.second) >= std::min(c.second, d.second)
+		   && std::max(c.second, d.second) >= std::min(a.second, b.second);
+}
+
+bool Area::Contains(double lat, double lng) {
+	if(lat < min_lat || lat > max_lat || lng < min_lng || lng > max_lng) {
+		return false;
+	}
+	if(polygon.empty()) {
+		return true;
+	}
+
+	// Ray casting
+	bool inside = false;
+	for(int i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++) {
+		auto [lat_i, lng_i] = polygon[i];
+		auto [lat_j, lng_j] = polygon[j];
+		if((lat_i > lat) != (lat_j > lat)
+			&& lng < (lng_j - lng_i) * (lat - lat_i) / (lat_j - lat_i) + lng_i) {
+			inside = !inside;
+		}
+	}
+	return inside;
+}
+
+bool Area::IntersectsCell(
+	double cell_min_lat, double cell_min_lng, double cell_max_lat, double cell_max_lng) {
+	if(cell_max_lat < min_lat || cell_min_lat > max_lat || cell_max_lng < min_lng
+		|| cell_min_lng > max_lng) {
+		return false;
+	}
+	if(polygon.empty()) {
+		return true;
+	}
+
+	// A cell is kept if it has a corner in the polygon, the polygon has a vertex in the cell or
+	// a polygon edge crosses a cell edge, like a thin corridor along a street
+	std::pair<double, double> corners[] = {
+		{ cell_min_lat, cell_min_lng },
+		{ cell_min_lat, cell_max_lng },
+		{ cell_max_lat, cell_max_lng },
+		{ cell_max_lat, cell_min_lng },
+	};
+	for(auto [lat, lng] : corners) {
+		if(Contains(lat, lng)) {
+			return true;
+		}
+	}
+	for(auto [lat, lng] : polygon) {
+		if(lat >= cell_min_lat && lat <= cell_max_lat && lng >= cell_min_lng
+			&& lng <= cell_max_lng) {
+			return true;
+		}
+	}
+	for(int i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++) {
+		for(int c = 0; c < 4; c++) {
+			if(segments_intersect(polygon[j], polygon[i], corners[c], corners[(c + 1) % 4])) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static bool valid_coordinate(double lat, double lng) {
+	return std::isfinite(lat) && std::isfinite(lng) && std::abs(lat) <= 90.0
+		   && std::abs(lng) <= 180.0;
+}
+
+// lat,lng with nothing else around it
+static bool parse_coordinate(std::stringstream& stream, double& lat, double& lng) {
+	char comma = 0;
+	return (stream >> lat >> comma >> lng) && comma == ',' && valid_coordinate(lat, lng);
+}
+
+std::optional<Area> parse_bbox(std::string bbox) {
+	// min_lat,min_lng,max_lat,max_lng
+	Area area;
+	char comma = 0;
+	std::stringstream bbox_stream(bbox);
+	if(!parse_coordinate(bbox_stream, area.min_lat, area.min_lng) || !(bbox_stream >> comma)
+		|| comma != ',' || !parse_coordinate(bbox_stream, area.max_lat, area.max_lng)
+		|| !(bbox_stream >> std::ws).eof()) {
+		return std::nullopt;
+	}
+	if(area.min_lat > area.max_lat) {
+		std::swap(area.min_lat, area.max_lat);
+	}
+	if(area.min_lng > area.max_lng) {
+		std::swap(area.min_lng, area.max_lng);
+	}
+	return area;
+}
+
+std::optional<Area> parse_polygon(std::string polygon) {
+	// lat,lng;lat,lng;...
+	Area area;
+	std::stringstream polygon_stream(polygon);
+	std::string vertex;
+	while(std::getline(polygon_stream, vertex, ';')) {
+		double lat;
+		double lng;
+		std::stringstream vertex_stream(vertex);
+		if(!parse_coordinate(vertex_stream, lat, lng) || !(vertex_stream >> std::ws).eof()) {
+			return std::nullopt;
+		}
+		area.polygon.push_back(std::make_pair(lat, lng));
+	}
+	if(area.polygon.size() < 3) {
+		return std::nullopt;
+	}
+
+	area.min_lat = area.max_lat = area.polygon[0].first;
+	area.min_lng = area.max_lng = area.polygon[0].second;
+	for(auto [lat, lng] : area.polygon) {
+		area.min_lat = std::min(area.min_lat, lat);
+		area.max_lat = std::max(area.max_lat, lat);
+		area.min_lng = std::min(area.min_lng, lng);
+		area.max_lng = std::max(area.max_lng, lng);
+	}
+	return area;
+}
+
+std::string format_area(Area& area) {
+	if(area.polygon.empty()) {
+		return fmt::format(
+			"BBOX {},{},{},{}", area.min_lat, area.min_lng, area.max_lat, area.max_lng);
+	}
+	std::string polygon;
+	for(auto [lat, lng] : area.polygon) {
+		polygon += fmt::format("{}{},{}", polygon.empty() ? "" : ";", lat, lng);
+	}
+	return "POLYGON " + polygon;
+}
+
+std::optional<Area> parse_area(std::string area) {
+	if(area.rfind("BBOX ", 0) == 0) {
+		return parse_bbox(area.substr(5));
+	} else if(area.rfind("POLYGON ", 0) == 0) {
+		return parse_polygon(area.substr(8));
+	}
+	return std::nullopt;
+}
+
+// Preview range that covers a whole cell from its center, assuming the range is in meters
+static int cell_range(AreaCell cell) {
+	double center_lat = (cell.min_lat + cell.max_lat) / 2;
+	double height     = (cell.max_lat - cell.min_lat) * METERS_PER_LAT_DEGREE;
+	double width
+		= (cell.max_lng - cell.min_lng) * METERS_PER_LAT_DEGREE * std::cos(center_lat * DEG_RAD);
+	return std::ceil(std::sqrt(height * height + width * width) / 2);
+}
+
+int area_range(Area& area) {
+	return cell_range(AreaCell {
+		.min_lat = area.min_lat,
+		.min_lng = area.min_lng,
+		.max_lat = area.max_lat,
+		.max_lng = area.max_lng,
+	});
+}
+
+std::vector<AreaCell> split_area(Area& area, double range) {
+	if(range <= 0) {
+		return {};
+	}
+	// Square cells whose circumscribed circle has radius range
+	double side       = range * std::sqrt(2.0);
+	double center_lat = (area.min_lat + area.max_lat) / 2;
+	double lat_step   = side / METERS_PER_LAT_DEGREE;
+	double lng_step
+		= side / (METERS_PER_LAT_DEGREE * std::max(0.01, std::cos(center_lat * DEG_RAD)));
+
+	std::vector<AreaCell> cells;
+	for(double lat = area.min_lat; lat < area.max_lat; lat += lat_step) {
+		for(double lng = area.min_lng; lng < area.max_lng; lng += lng_step) {
+			AreaCell cell {
+				.min_lat = lat,
+				.min_lng = lng,
+				.max_lat = std::min(lat + lat_step, area.max_lat),
+				.max_lng = std::min(lng + lng_step, area.max_lng),
+			};
+			if(area.IntersectsCell(cell.min_lat, cell.min_lng, cell.max_lat, cell.max_lng)) {
+				cells.push_back(cell);
+			}
+		}
+	}
+	return cells;
+}
+
+std::vector<std::string> sweep_area(
+	std::string client_id, Area& area, int range, int num_previews, int num_threads) {
+	std::deque<AreaCell> queued_cells;
+	for(auto& cell : split_area(area, range)) {
+		queued_cells.push_back(cell);
+	}
+	int cells_in_progress = 0;
+	int cells_done        = 0;
+	std::mutex cells_m;
+	std::condition_variable cells_cv;
+
+	std::vector<std::string> ids;
+	std::unordered_set<std::string> seen_ids;
+
+	auto sweep_thread = [&]() {
+		CURL* curl_handle = curl_easy_init();
+		std::unique_lock lock { cells_m };
+		while(true) {
+			if(queued_cells.empty()) {
+				if(cells_in_progress == 0) {
+					// Nothing left and nobody can subdivide anymore
+					break;
+				}
+				cells_cv.wait(lock);
+				continue;
+			}
+
+			auto cell = queued_cells.front();
+			queued_cells.pop_front();
+			cells_in_progress++;
+			lock.unlock();
+
+			auto preview_document = download_preview_document(curl_handle, client_id,
+				num_previews, (cell.min_lat + cell.max_lat) / 2, (cell.min_lng + cell.max_lng) / 2,
+				cell_range(cell));
+			std::vector<std::string> cell_ids;
+			if(preview_document.IsArray() && preview_document.Size() > 0
+				&& preview_document[0].IsArray()) {
+				cell_ids = extract_panorama_ids(preview_document);
+			}
+
+			lock.lock();
+			int num_new = 0;
+			for(auto& id : cell_ids) {
+				if(seen_ids.emplace(id).second) {
+					ids.push_back(id);
+					num_new++;
+				}
+			}
+
+			// The endpoint caps results, a full cell probably has more to find
+			if(cell_ids.size() >= num_previews && cell.depth < MAX_CELL_DEPTH) {
+				double mid_lat = (cell.min_lat + cell.max_lat) / 2;
+				double mid_lng = (cell.min_lng + cell.max_lng) / 2;
+				for(auto [min_lat, max_lat] :
+					{ std::make_pair(cell.min_lat, mid_lat), std::make_pair(mid_lat, cell.max_lat) }) {
+					for(auto [min_lng, max_lng] : { std::make_pair(cell.min_lng, mid_lng),
+							std::make_pair(mid_lng, cell.max_lng) }) {
+						if(area.IntersectsCell(min_lat, min_lng, max_lat, max_lng)) {
+							queued_cells.push_back(AreaCell {
+								.min_lat = min_lat,
+								.min_lng = min_lng,
+								.max_lat = max_lat,
+								.max_lng = max_lng,
+								.depth   = cell.depth + 1,
+							});
+						}
+					}
+				}
+			}
+
+			cells_in_progress--;
+			cells_done++;
+			get_metrics().Gauge("area_cells_queued").Set(queued_cells.size());
+			fmt::print("Cells swept: {} Queued: {} Panoramas: {} (+{})\n", cells_done,
+				queued_cells.size(), ids.size(), num_new);
+			cells_cv.notify_all();
+		}
+		lock.unlock();
+		curl_easy_cleanup(curl_handle);
+	};
+
+	std::vector<std::thread> threads;
+	for(int i = 0; i < num_threads; i++) {
+		threads.push_back(std::thread(sweep_thread));
+	}
+	for(auto& thread : threads) {
+		thread.join();
+	}
+
+	return ids;
+}
\ No newline at end of file
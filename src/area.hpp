@@ -0,0 +1,39 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Bounding box or polygon to sweep, corners and vertices are (lat, lng)
+struct Area {
+	double min_lat;
+	double min_lng;
+	double max_lat;
+	double max_lng;
+	std::vector<std::pair<double, double>> polygon;
+
+	bool Contains(double lat, double lng);
+	bool IntersectsCell(double cell_min_lat, double cell_min_lng, double cell_max_lat,
+		double cell_max_lng);
+};
+
+struct AreaCell {
+	double min_lat;
+	double min_lng;
+	double max_lat;
+	double max_lng;
+	int depth = 0;
+};
+
+// Empty if malformed, out of range or a polygon of less than 3 vertices
+std::optional<Area> parse_bbox(std::string bbox);
+std::optional<Area> parse_polygon(std::string polygon);
+// BBOX <bbox> or POLYGON <polygon>, in the formats parse_bbox and parse_polygon read
+std::string format_area(Area& area);
+std::optional<Area> parse_area(std::string area);
+int area_range(Area& area);
+// Empty if range is not positive
+std::vector<AreaCell> split_area(Area& area, double range);
+std::vector<std::string> sweep_area(
+	std::string client_id, Area& area, int range, int num_previews, int num_threads);
\ No newline at end of file
@@ -0,0 +1,649 @@
+#include "async.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "budget.hpp"
+#include "headers.hpp"
+#include "metrics.hpp"
+#include "rate.hpp"
+#include "trace.hpp"
+
+#define MAX_EVENTS 64
+// Upper bound on a single wait, nothing should depend on it
+#define MAX_WAIT_MS 1000
+// How often a panorama waiting for the memory budget checks again
+#define MEMORY_RETRY_MS 20
+
+static thread_local bool on_cpu_pool = false;
+
+static int abort_cancelled(void* clientp, curl_off_t dltotal, curl_off_t dlnow,
+	curl_off_t ultotal, curl_off_t ulnow) {
+	return *static_cast<const bool*>(clientp) ? 1 : 0;
+}
+
+static size_t append_callback(void* contents, size_t size, size_t nmemb, void* userp) {
+	size_t realsize = size * nmemb;
+	static_cast<std::string*>(userp)->append(static_cast<char*>(contents), realsize);
+	return realsize;
+}
+
+AsyncRuntime::AsyncRuntime(int num_cpu_threads) {
+	multi_handle = curl_multi_init();
+	curl_multi_setopt(multi_handle, CURLMOPT_SOCKETFUNCTION, SocketCallback);
+	curl_multi_setopt(multi_handle, CURLMOPT_SOCKETDATA, this);
+	curl_multi_setopt(multi_handle, CURLMOPT_TIMERFUNCTION, TimerCallback);
+	curl_multi_setopt(multi_handle, CURLMOPT_TIMERDATA, this);
+	// Every request to a host shares a few HTTP/2 connections
+	curl_multi_setopt(multi_handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+	pipe(wake_pipe);
+	fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+#ifdef __linux__
+	epoll_fd = epoll_create1(0);
+	epoll_event event {};
+	event.events  = EPOLLIN;
+	event.data.fd = wake_pipe[0];
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_pipe[0], &event);
+#endif
+
+	for(int i = 0; i < num_cpu_threads; i++) {
+		cpu_threads.push_back(std::thread(&AsyncRuntime::CpuThread, this));
+	}
+}
+
+AsyncRuntime::~AsyncRuntime() {
+	{
+		std::scoped_lock lock { cpu_m };
+		cpu_running = false;
+	}
+	cpu_cv.notify_all();
+	for(auto& thread : cpu_threads) {
+		thread.join();
+	}
+
+	for(auto handle : free_handles) {
+		curl_easy_cleanup(handle);
+	}
+	curl_multi_cleanup(multi_handle);
+#ifdef __linux__
+	close(epoll_fd);
+#endif
+	close(wake_pipe[0]);
+	close(wake_pipe[1]);
+}
+
+AsyncRuntime::DetachedTask AsyncRuntime::RunDetached(Task<void> task) {
+	live_tasks++;
+	co_await task;
+	live_tasks--;
+}
+
+void AsyncRuntime::Spawn(Task<void> task) {
+	RunDetached(std::move(task));
+}
+
+void AsyncRuntime::Schedule(std::coroutine_handle<> handle) {
+	ready.push_back(handle);
+}
+
+void AsyncRuntime::Run() {
+	while(live_tasks > 0) {
+		auto now        = std::chrono::steady_clock::now();
+		auto next_event = now + std::chrono::milliseconds(MAX_WAIT_MS);
+		if(curl_deadline) {
+			next_event = std::min(next_event, *curl_deadline);
+		}
+		if(!sleeping.empty()) {
+			next_event = std::min(next_event, sleeping.begin()->first);
+		}
+		int timeout_ms = ready.empty()
+							 ? std::max<long>(0, std::chrono::ceil<std::chrono::milliseconds>(
+													 next_event - now)
+													 .count())
+							 : 0;
+		WaitForEvents(timeout_ms);
+
+		now = std::chrono::steady_clock::now();
+		if(curl_deadline && *curl_deadline <= now) {
+			curl_deadline.reset();
+			SocketAction(CURL_SOCKET_TIMEOUT, 0);
+		}
+		CheckFinished();
+
+		while(!sleeping.empty() && sleeping.begin()->first <= now) {
+			ready.push_back(sleeping.begin()->second);
+			sleeping.erase(sleeping.begin());
+		}
+		{
+			std::scoped_lock lock { cpu_m };
+			ready.insert(ready.end(), cpu_finished.begin(), cpu_finished.end());
+			cpu_finished.clear();
+		}
+
+		// Only what is ready now, anything scheduled while resuming waits for the next iteration
+		auto num_ready = ready.size();
+		for(size_t i = 0; i < num_ready; i++) {
+			auto handle = ready.front();
+			ready.pop_front();
+			handle.resume();
+		}
+	}
+}
+
+void AsyncRuntime::WaitForEvents(int timeout_ms) {
+#ifdef __linux__
+	epoll_event events[MAX_EVENTS];
+	int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+	for(int i = 0; i < num_events; i++) {
+		if(events[i].data.fd == wake_pipe[0]) {
+			char buffer[64];
+			while(read(wake_pipe[0], buffer, sizeof(buffer)) > 0) { }
+			continue;
+		}
+
+		int flags = 0;
+		if(events[i].events & EPOLLIN) {
+			flags |= CURL_CSELECT_IN;
+		}
+		if(events[i].events & EPOLLOUT) {
+			flags |= CURL_CSELECT_OUT;
+		}
+		if(events[i].events & (EPOLLERR | EPOLLHUP)) {
+			flags |= CURL_CSELECT_ERR;
+		}
+		SocketAction(events[i].data.fd, flags);
+	}
+#else
+	std::vector<pollfd> fds;
+	fds.push_back(pollfd { .fd = wake_pipe[0], .events = POLLIN });
+	for(auto [socket, what] : poll_sockets) {
+		short events = 0;
+		if(what & CURL_POLL_IN) {
+			events |= POLLIN;
+		}
+		if(what & CURL_POLL_OUT) {
+			events |= POLLOUT;
+		}
+		fds.push_back(pollfd { .fd = socket, .events = events });
+	}
+
+	if(poll(fds.data(), fds.size(), timeout_ms) <= 0) {
+		return;
+	}
+	if(fds[0].revents & POLLIN) {
+		char buffer[64];
+		while(read(wake_pipe[0], buffer, sizeof(buffer)) > 0) { }
+	}
+	for(size_t i = 1; i < fds.size(); i++) {
+		int flags = 0;
+		if(fds[i].revents & POLLIN) {
+			flags |= CURL_CSELECT_IN;
+		}
+		if(fds[i].revents & POLLOUT) {
+			flags |= CURL_CSELECT_OUT;
+		}
+		if(fds[i].revents & (POLLERR | POLLHUP)) {
+			flags |= CURL_CSELECT_ERR;
+		}
+		if(flags) {
+			SocketAction(fds[i].fd, flags);
+		}
+	}
+#endif
+}
+
+void AsyncRuntime::SocketAction(curl_socket_t socket, int flags) {
+	int running_handles;
+	curl_multi_socket_action(multi_handle, socket, flags, &running_handles);
+}
+
+void AsyncRuntime::CheckFinished() {
+	int messages_left;
+	while(CURLMsg* message = curl_multi_info_read(multi_handle, &messages_left)) {
+		if(message->msg != CURLMSG_DONE) {
+			continue;
+		}
+
+		CURL* easy_handle = message->easy_handle;
+		PerformAwaitable* request;
+		curl_easy_getinfo(easy_handle, CURLINFO_PRIVATE, &request);
+		request->result.res = message->data.result;
+		if(request->result.res == CURLE_OK) {
+			curl_easy_getinfo(easy_handle, CURLINFO_RESPONSE_CODE, &request->result.http_code);
+			curl_easy_getinfo(easy_handle, CURLINFO_RETRY_AFTER, &request->result.retry_after);
+		}
+
+		curl_multi_remove_handle(multi_handle, easy_handle);
+		curl_easy_reset(easy_handle);
+		free_handles.push_back(easy_handle);
+		ready.push_back(request->waiting);
+	}
+}
+
+int AsyncRuntime::SocketCallback(
+	CURL* easy_handle, curl_socket_t socket, int what, void* userp, void* socketp) {
+	auto& runtime = *static_cast<AsyncRuntime*>(userp);
+#ifdef __linux__
+	if(what == CURL_POLL_REMOVE) {
+		epoll_ctl(runtime.epoll_fd, EPOLL_CTL_DEL, socket, nullptr);
+		return 0;
+	}
+
+	epoll_event event {};
+	event.data.fd = socket;
+	if(what & CURL_POLL_IN) {
+		event.events |= EPOLLIN;
+	}
+	if(what & CURL_POLL_OUT) {
+		event.events |= EPOLLOUT;
+	}
+	if(epoll_ctl(runtime.epoll_fd, EPOLL_CTL_MOD, socket, &event) != 0) {
+		epoll_ctl(runtime.epoll_fd, EPOLL_CTL_ADD, socket, &event);
+	}
+#else
+	if(what == CURL_POLL_REMOVE) {
+		runtime.poll_sockets.erase(socket);
+	} else {
+		runtime.poll_sockets[socket] = what;
+	}
+#endif
+	return 0;
+}
+
+int AsyncRuntime::TimerCallback(CURLM* multi_handle, long timeout_ms, void* userp) {
+	auto& runtime = *static_cast<AsyncRuntime*>(userp);
+	if(timeout_ms < 0) {
+		runtime.curl_deadline.reset();
+	} else {
+		runtime.curl_deadline
+			= std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	}
+	return 0;
+}
+
+void AsyncRuntime::Wake() {
+	char byte = 0;
+	write(wake_pipe[1], &byte, 1);
+}
+
+bool AsyncRuntime::OnCpuPool() {
+	return on_cpu_pool;
+}
+
+void AsyncRuntime::CpuThread() {
+	on_cpu_pool = true;
+	std::unique_lock lock { cpu_m };
+	while(true) {
+		cpu_cv.wait(lock, [&] { return !cpu_queue.empty() || !cpu_running; });
+		if(cpu_queue.empty()) {
+			return;
+		}
+
+		auto [work, handle] = std::move(cpu_queue.front());
+		cpu_queue.pop_front();
+		lock.unlock();
+		work();
+		lock.lock();
+		cpu_finished.push_back(handle);
+		Wake();
+	}
+}
+
+AsyncRuntime::PerformAwaitable AsyncRuntime::Perform(
+	std::string url, curl_slist* headers, const bool* cancel) {
+	return PerformAwaitable { .runtime = *this, .url = url, .headers = headers, .cancel = cancel };
+}
+
+void AsyncRuntime::PerformAwaitable::await_suspend(std::coroutine_handle<> handle) {
+	waiting = handle;
+	if(runtime.free_handles.empty()) {
+		easy_handle = curl_easy_init();
+	} else {
+		easy_handle = runtime.free_handles.back();
+		runtime.free_handles.pop_back();
+	}
+
+	curl_easy_setopt(easy_handle, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(easy_handle, CURLOPT_WRITEFUNCTION, append_callback);
+	curl_easy_setopt(easy_handle, CURLOPT_WRITEDATA, &result.data);
+	curl_easy_setopt(easy_handle, CURLOPT_PRIVATE, this);
+	curl_easy_setopt(easy_handle, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(easy_handle, CURLOPT_HTTPPROXYTUNNEL, 1L);
+	if(headers) {
+		curl_easy_setopt(easy_handle, CURLOPT_HTTPHEADER, headers);
+	}
+	if(cancel) {
+		// Reset with the handle once finished
+		curl_easy_setopt(easy_handle, CURLOPT_NOPROGRESS, 0L);
+		curl_easy_setopt(easy_handle, CURLOPT_XFERINFOFUNCTION, abort_cancelled);
+		curl_easy_setopt(easy_handle, CURLOPT_XFERINFODATA, cancel);
+	}
+	curl_multi_add_handle(runtime.multi_handle, easy_handle);
+}
+
+AsyncRuntime::SleepAwaitable AsyncRuntime::Sleep(std::chrono::steady_clock::duration duration) {
+	return SleepAwaitable { .runtime = *this, .until = std::chrono::steady_clock::now() + duration };
+}
+
+void AsyncRuntime::SleepAwaitable::await_suspend(std::coroutine_handle<> handle) {
+	runtime.sleeping.emplace(until, handle);
+}
+
+AsyncRuntime::OffloadAwaitable AsyncRuntime::Offload(std::function<void()> work) {
+	return OffloadAwaitable { .runtime = *this, .work = std::move(work) };
+}
+
+void AsyncRuntime::OffloadAwaitable::await_suspend(std::coroutine_handle<> handle) {
+	if(runtime.cpu_threads.empty()) {
+		work();
+		runtime.Schedule(handle);
+		return;
+	}
+
+	{
+		std::scoped_lock lock { runtime.cpu_m };
+		runtime.cpu_queue.push_back(std::make_pair(std::move(work), handle));
+	}
+	runtime.cpu_cv.notify_one();
+}
+
+AsyncRuntime::SlotAwaitable AsyncRuntime::WaitForSlot(std::string host) {
+	return SlotAwaitable { .runtime = *this, .host = host };
+}
+
+void AsyncRuntime::WakeSlotWaiters(std::string host, int count) {
+	auto waiters = slot_waiters.find(host);
+	if(waiters == slot_waiters.end()) {
+		return;
+	}
+	for(int i = 0; i < count && !waiters->second.empty(); i++) {
+		Schedule(waiters->second.front());
+		waiters->second.pop_front();
+	}
+}
+
+void AsyncSemaphore::Release() {
+	if(waiting.empty()) {
+		count++;
+	} else {
+		// Handed straight to the next waiter
+		runtime.Schedule(waiting.front());
+		waiting.pop_front();
+	}
+}
+
+void AsyncLatch::CountDown() {
+	count--;
+	if(count == 0 && waiting) {
+		runtime.Schedule(waiting);
+	}
+}
+
+Task<FetchResult> fetch_url(
+	AsyncRuntime& runtime, std::string url, curl_slist* headers, FetchControl* control) {
+	TraceSpan span("http", request_type(url));
+	auto host             = apply_endpoint_override(url);
+	auto& rate_controller = get_rate_controller();
+
+	FetchResult result;
+	int attempts = 0;
+	for(int attempt = 0; attempt < MAX_REQUEST_ATTEMPTS; attempt++) {
+		std::chrono::steady_clock::duration wait;
+		bool acquired = false;
+		while(!(control && control->cancel)
+			  && !(acquired = rate_controller.TryAcquire(host, wait))) {
+			// Only the token bucket and backoff have a known end
+			if(wait == std::chrono::steady_clock::duration::zero()) {
+				co_await runtime.WaitForSlot(host);
+			} else {
+				co_await runtime.Sleep(wait);
+			}
+		}
+		if(!acquired) {
+			// May have been woken for a slot it no longer needs
+			runtime.WakeSlotWaiters(host, rate_controller.GetFreeSlots(host));
+			result.res = CURLE_ABORTED_BY_CALLBACK;
+			break;
+		}
+		if(attempt == 0 && control && control->on_start) {
+			control->on_start();
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		result     = co_await runtime.Perform(url, headers, control ? &control->cancel : nullptr);
+		attempts   = attempt + 1;
+		bool retry = finish_request(url, host, result.res, result.http_code, result.retry_after,
+			start, result.data.size());
+		// The limit may also have grown, wake one waiter per slot
+		runtime.WakeSlotWaiters(host, rate_controller.GetFreeSlots(host));
+		if(!retry) {
+			break;
+		}
+	}
+	span.Arg("status", result.res == CURLE_OK ? result.http_code : -1);
+	span.Arg("attempts", attempts);
+	span.Arg("bytes", result.data.size());
+
+	if(result.res != CURLE_OK && result.res != CURLE_ABORTED_BY_CALLBACK) {
+		std::cerr << "Downloading failed: " << curl_easy_strerror(result.res) << std::endl;
+	}
+	co_return result;
+}
+
+Task<rapidjson::Document> fetch_preview(AsyncRuntime& runtime, std::string client_id,
+	int num_previews, double lat, double lng, int range) {
+	auto result
+		= co_await fetch_url(runtime, preview_url(client_id, num_previews, lat, lng, range), NULL);
+
+	rapidjson::Document preview_document;
+	if(result.data.size() > 4) {
+		preview_document.Parse(result.data.substr(4));
+	}
+	co_return preview_document;
+}
+
+Task<rapidjson::Document> fetch_photometa(
+	AsyncRuntime& runtime, std::string client_id, std::string panorama_id, int fields) {
+	static curl_slist* headers = get_photometa_headers();
+	fields                     = photometa_request_fields(fields);
+	while(true) {
+		auto result = co_await fetch_url(runtime, photometa_url(panorama_id, fields), headers);
+
+		rapidjson::Document photometa_document;
+		{
+			TraceSpan span("pipeline", "parse photometa");
+			if(result.data.size() > 4) {
+				photometa_document.Parse(result.data.substr(4));
+			}
+		}
+		if(accept_photometa(photometa_document, fields, result.data.size())) {
+			co_return photometa_document;
+		}
+		fields = PHOTOMETA_ALL;
+	}
+}
+
+Task<std::string> fetch_tile(AsyncRuntime& runtime, std::string panorama_id, int x, int y,
+	int streetview_zoom, FetchControl* control) {
+	static curl_slist* headers = get_panorama_headers();
+	auto url                   = tile_url(panorama_id, x, y, streetview_zoom);
+	// Throttling and transient errors are already retried by fetch_url
+	auto result = co_await fetch_url(runtime, url, headers, control);
+	if(result.res == CURLE_OK && result.http_code == 200) {
+		co_return std::move(result.data);
+	} else if(result.res == CURLE_OK && result.http_code != 404) {
+		std::cout << "Error code " << result.http_code << std::endl;
+	}
+	co_return std::string();
+}
+
+// Finished tiles of a panorama, hedging compares against their median
+struct HedgeLatencies {
+	std::vector<double> latencies;
+
+	std::chrono::milliseconds Delay() {
+		auto delay = std::chrono::milliseconds(MIN_HEDGE_DELAY_MS);
+		if(!latencies.empty()) {
+			auto median = latencies.begin() + latencies.size() / 2;
+			std::nth_element(latencies.begin(), median, latencies.end());
+			delay = std::max(delay, std::chrono::milliseconds((long)(*median * 3)));
+		}
+		return delay;
+	}
+};
+
+// Requests of one tile, kept alive by each of them so the loser can finish after the winner
+struct HedgedTile {
+	HedgedTile(AsyncRuntime& runtime)
+		: finished(runtime, 1) { }
+
+	std::string panorama_id;
+	int x;
+	int y;
+	int streetview_zoom;
+	std::shared_ptr<HedgeLatencies> latencies;
+
+	FetchControl original;
+	FetchControl hedge;
+	std::chrono::steady_clock::time_point started;
+	int running = 0;
+	bool hedged = false;
+	bool done   = false;
+	std::string data;
+	AsyncLatch finished;
+};
+
+static Task<void> fetch_tile_attempt(
+	AsyncRuntime& runtime, std::shared_ptr<HedgedTile> tile, bool is_hedge) {
+	static auto& tiles_in_flight = get_metrics().Gauge("tiles_in_flight");
+	static auto& tile_hedges     = get_metrics().Counter("tile_hedges");
+	auto& control                = is_hedge ? tile->hedge : tile->original;
+	tile->running++;
+	tiles_in_flight.Add(1);
+	TraceSpan tile_span("tile", fmt::format("tile {},{}", tile->x, tile->y));
+	tile_span.Arg("hedge", is_hedge);
+	auto data = co_await fetch_tile(
+		runtime, tile->panorama_id, tile->x, tile->y, tile->streetview_zoom, &control);
+	tiles_in_flight.Add(-1);
+	tile->running--;
+
+	if(tile->done) {
+		co_return;
+	}
+	if(!data.empty()) {
+		tile->done = true;
+		tile->data = std::move(data);
+		auto latency = std::chrono::steady_clock::now() - tile->started;
+		tile->latencies->latencies.push_back(
+			std::chrono::duration<double, std::milli>(latency).count());
+		// The other request is aborted by curl's progress callback or before it is sent
+		(is_hedge ? tile->original : tile->hedge).cancel = true;
+		if(is_hedge) {
+			tile_hedges.Add();
+		}
+		tile->finished.CountDown();
+	} else if(tile->running == 0) {
+		// Both failed, or the original without a hedge. A hedge only starts while the original
+		// is running
+		tile->done = true;
+		tile->finished.CountDown();
+	}
+}
+
+// Waits from when the original request went out, a tile still queued by the rate limit isn't slow
+static Task<void> hedge_after_delay(AsyncRuntime& runtime, std::shared_ptr<HedgedTile> tile) {
+	// Tiles finishing in the meantime may raise the median
+	auto now = std::chrono::steady_clock::now();
+	while(!tile->done && now < tile->started + tile->latencies->Delay()) {
+		co_await runtime.Sleep(tile->started + tile->latencies->Delay() - now);
+		now = std::chrono::steady_clock::now();
+	}
+	if(!tile->done && tile->running > 0 && !tile->hedged) {
+		tile->hedged = true;
+		runtime.Spawn(fetch_tile_attempt(runtime, tile, true));
+	}
+}
+
+// Decodes the tile into the panorama on the CPU pool as soon as it arrives, so its encoded data
+// is freed right away and decoding overlaps with the remaining downloads
+static Task<void> fetch_tile_into(AsyncRuntime& runtime, std::string panorama_id, int x, int y,
+	int streetview_zoom, SkBitmap& panorama, TileCompleteness& completeness, SkColor background,
+	std::shared_ptr<HedgeLatencies> latencies, AsyncLatch& latch) {
+	auto tile             = std::make_shared<HedgedTile>(runtime);
+	tile->panorama_id     = panorama_id;
+	tile->x               = x;
+	tile->y               = y;
+	tile->streetview_zoom = streetview_zoom;
+	tile->latencies       = latencies;
+
+	tile->original.on_start = [&runtime, weak_tile = std::weak_ptr<HedgedTile>(tile)] {
+		auto tile     = weak_tile.lock();
+		tile->started = std::chrono::steady_clock::now();
+		runtime.Spawn(hedge_after_delay(runtime, tile));
+	};
+	runtime.Spawn(fetch_tile_attempt(runtime, tile, false));
+	co_await tile->finished;
+	auto tile_data = std::move(tile->data);
+
+	if(!tile_data.empty()) {
+		bool decoded = false;
+		co_await runtime.Offload(
+			[&] { decoded = decode_tile(panorama, completeness, x, y, tile_data, background); });
+		// Back on the loop thread, completeness is only ever written here
+		if(decoded) {
+			completeness.tiles[y * completeness.tiles_width + x] = true;
+		}
+	}
+	latch.CountDown();
+}
+
+Task<sk_sp<SkImage>> download_panorama_async(AsyncRuntime& runtime, std::string panorama_id,
+	int streetview_zoom, rapidjson::Document& photometa_document, TileCompleteness* completeness,
+	bool transparent_background) {
+	auto plan               = extract_tile_plan(photometa_document, streetview_zoom);
+	auto tiles_completeness = TileCompleteness::FromPlan(plan);
+
+	auto tiles      = tiles_completeness.Missing();
+	auto background = transparent_background ? SK_ColorTRANSPARENT : SK_ColorWHITE;
+	auto panorama   = allocate_panorama(plan, transparent_background);
+	auto latencies  = std::make_shared<HedgeLatencies>();
+	AsyncLatch latch(runtime, tiles.size());
+	for(auto [x, y] : tiles) {
+		runtime.Spawn(fetch_tile_into(runtime, panorama_id, x, y, plan.zoom, panorama,
+			tiles_completeness, background, latencies, latch));
+	}
+	co_await latch;
+
+	// Shares the pixels instead of copying them
+	panorama.setImmutable();
+	auto image = panorama.asImage();
+
+	if(completeness) {
+		*completeness = tiles_completeness;
+	}
+	co_return image;
+}
+
+Task<void> reserve_memory_async(AsyncRuntime& runtime, size_t bytes) {
+	auto& budget = get_memory_budget();
+	if(budget.TryReserve(bytes)) {
+		co_return;
+	}
+	// Released from other threads too, like the writer, so checked again instead of notified
+	MetricsTimer wait_timer(get_metrics().Histogram("memory_wait_us"));
+	while(!budget.TryReserve(bytes)) {
+		co_await runtime.Sleep(std::chrono::milliseconds(MEMORY_RETRY_MS));
+	}
+}
\ No newline at end of file
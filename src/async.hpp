@@ -0,0 +1,358 @@
+#pragma once
+
+#include <core/SkImage.h>
+#include <curl/curl.h>
+#include <rapidjson/document.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "download.hpp"
+
+template <typename T> class Task;
+
+struct TaskPromiseBase {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr exception;
+
+	// Lazy, nothing runs until the task is awaited or spawned
+	std::suspend_always initial_suspend() noexcept {
+		return {};
+	}
+
+	struct FinalAwaiter {
+		bool await_ready() noexcept {
+			return false;
+		}
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept {
+			auto continuation = handle.promise().continuation;
+			return continuation ? continuation : std::noop_coroutine();
+		}
+		void await_resume() noexcept { }
+	};
+
+	FinalAwaiter final_suspend() noexcept {
+		return {};
+	}
+	void unhandled_exception() {
+		exception = std::current_exception();
+	}
+};
+
+template <typename T> struct TaskPromise : TaskPromiseBase {
+	std::optional<T> value;
+
+	Task<T> get_return_object();
+	void return_value(T new_value) {
+		value = std::move(new_value);
+	}
+	T Result() {
+		if(exception) {
+			std::rethrow_exception(exception);
+		}
+		return std::move(*value);
+	}
+};
+
+template <> struct TaskPromise<void> : TaskPromiseBase {
+	Task<void> get_return_object();
+	void return_void() { }
+	void Result() {
+		if(exception) {
+			std::rethrow_exception(exception);
+		}
+	}
+};
+
+// Coroutine returning T, resumes whoever awaited it when done. Owns its frame
+template <typename T = void> class Task {
+public:
+	using promise_type = TaskPromise<T>;
+
+	explicit Task(std::coroutine_handle<promise_type> handle)
+		: handle(handle) { }
+	Task(Task&& other) noexcept
+		: handle(std::exchange(other.handle, nullptr)) { }
+	Task& operator=(Task&& other) noexcept {
+		if(this != &other) {
+			if(handle) {
+				handle.destroy();
+			}
+			handle = std::exchange(other.handle, nullptr);
+		}
+		return *this;
+	}
+	Task(const Task&)            = delete;
+	Task& operator=(const Task&) = delete;
+	~Task() {
+		if(handle) {
+			handle.destroy();
+		}
+	}
+
+	bool await_ready() {
+		return false;
+	}
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) {
+		handle.promise().continuation = continuation;
+		return handle;
+	}
+	T await_resume() {
+		return handle.promise().Result();
+	}
+
+private:
+	std::coroutine_handle<promise_type> handle;
+};
+
+template <typename T> Task<T> TaskPromise<T>::get_return_object() {
+	return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+	return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// Lets a caller abort a fetch, for example the slower request of a hedged tile
+struct FetchControl {
+	// Aborts the transfer or any retry still waiting, the result is CURLE_ABORTED_BY_CALLBACK
+	bool cancel = false;
+	// Called when the first request goes out, after waiting for the rate limit
+	std::function<void()> on_start;
+};
+
+struct FetchResult {
+	CURLcode res           = CURLE_OK;
+	long http_code         = 0;
+	curl_off_t retry_after = 0;
+	std::string data;
+};
+
+// Single threaded event loop driving every transfer through one curl multi handle with the
+// socket API, epoll on Linux and poll elsewhere. Coroutines only ever run on the thread
+// calling Run, CPU heavy work is moved to a small pool with Offload and resumes back on the
+// loop once finished
+class AsyncRuntime {
+public:
+	AsyncRuntime(int num_cpu_threads);
+	~AsyncRuntime();
+
+	// Starts a task, it runs until its first suspension before Spawn returns
+	void Spawn(Task<void> task);
+	// Resume a suspended coroutine on the next loop iteration
+	void Schedule(std::coroutine_handle<> handle);
+	// Runs the loop until every spawned task has finished
+	void Run();
+
+	struct PerformAwaitable {
+		AsyncRuntime& runtime;
+		std::string url;
+		curl_slist* headers;
+		const bool* cancel;
+		CURL* easy_handle = nullptr;
+		std::coroutine_handle<> waiting;
+		FetchResult result;
+
+		bool await_ready() {
+			return false;
+		}
+		void await_suspend(std::coroutine_handle<> handle);
+		FetchResult await_resume() {
+			return std::move(result);
+		}
+	};
+
+	struct SleepAwaitable {
+		AsyncRuntime& runtime;
+		std::chrono::steady_clock::time_point until;
+
+		bool await_ready() {
+			return std::chrono::steady_clock::now() >= until;
+		}
+		void await_suspend(std::coroutine_handle<> handle);
+		void await_resume() { }
+	};
+
+	struct OffloadAwaitable {
+		AsyncRuntime& runtime;
+		std::function<void()> work;
+
+		bool await_ready() {
+			return false;
+		}
+		void await_suspend(std::coroutine_handle<> handle);
+		void await_resume() { }
+	};
+
+	// One attempt of a request, no rate limiting or retries, see fetch_url. Aborted once cancel
+	// is set, the next time curl reports progress
+	PerformAwaitable Perform(std::string url, curl_slist* headers, const bool* cancel = nullptr);
+	SleepAwaitable Sleep(std::chrono::steady_clock::duration duration);
+	OffloadAwaitable Offload(std::function<void()> work);
+
+	struct SlotAwaitable {
+		AsyncRuntime& runtime;
+		std::string host;
+
+		bool await_ready() {
+			return false;
+		}
+		void await_suspend(std::coroutine_handle<> handle) {
+			runtime.slot_waiters[host].push_back(handle);
+		}
+		void await_resume() { }
+	};
+
+	// Waits for a request to the host to finish, when it is at its concurrency limit. Queued
+	// instead of polling so a freed slot is taken on the next loop iteration
+	SlotAwaitable WaitForSlot(std::string host);
+	// Resumes up to count coroutines waiting for a slot of the host, oldest first
+	void WakeSlotWaiters(std::string host, int count);
+
+	// True on a thread of any runtime's CPU pool. Work there already shares the cores with the
+	// rest of the pool and shouldn't start threads of its own
+	static bool OnCpuPool();
+
+private:
+	struct DetachedTask {
+		struct promise_type {
+			DetachedTask get_return_object() {
+				return {};
+			}
+			std::suspend_never initial_suspend() noexcept {
+				return {};
+			}
+			std::suspend_never final_suspend() noexcept {
+				return {};
+			}
+			void return_void() { }
+			void unhandled_exception() {
+				std::terminate();
+			}
+		};
+	};
+
+	DetachedTask RunDetached(Task<void> task);
+	void Wake();
+	void WaitForEvents(int timeout_ms);
+	void SocketAction(curl_socket_t socket, int flags);
+	void CheckFinished();
+	void CpuThread();
+
+	static int SocketCallback(
+		CURL* easy_handle, curl_socket_t socket, int what, void* userp, void* socketp);
+	static int TimerCallback(CURLM* multi_handle, long timeout_ms, void* userp);
+
+	CURLM* multi_handle;
+	std::vector<CURL*> free_handles;
+	std::optional<std::chrono::steady_clock::time_point> curl_deadline;
+	std::multimap<std::chrono::steady_clock::time_point, std::coroutine_handle<>> sleeping;
+	std::deque<std::coroutine_handle<>> ready;
+	std::unordered_map<std::string, std::deque<std::coroutine_handle<>>> slot_waiters;
+	int live_tasks = 0;
+
+#ifdef __linux__
+	int epoll_fd;
+#else
+	// Socket to CURL_POLL_* flags, rebuilt into a pollfd array every iteration
+	std::unordered_map<curl_socket_t, int> poll_sockets;
+#endif
+	// Lets the CPU pool interrupt the wait
+	int wake_pipe[2];
+
+	std::vector<std::thread> cpu_threads;
+	std::deque<std::pair<std::function<void()>, std::coroutine_handle<>>> cpu_queue;
+	std::vector<std::coroutine_handle<>> cpu_finished;
+	bool cpu_running = true;
+	std::mutex cpu_m;
+	std::condition_variable cpu_cv;
+};
+
+// Limits how many coroutines are inside a section, for example panoramas being stitched
+class AsyncSemaphore {
+public:
+	AsyncSemaphore(AsyncRuntime& runtime, int count)
+		: runtime(runtime)
+		, count(count) { }
+
+	struct AcquireAwaitable {
+		AsyncSemaphore& semaphore;
+
+		bool await_ready() {
+			if(semaphore.count > 0) {
+				semaphore.count--;
+				return true;
+			}
+			return false;
+		}
+		void await_suspend(std::coroutine_handle<> handle) {
+			semaphore.waiting.push_back(handle);
+		}
+		void await_resume() { }
+	};
+
+	AcquireAwaitable Acquire() {
+		return { *this };
+	}
+	void Release();
+
+private:
+	AsyncRuntime& runtime;
+	int count;
+	std::deque<std::coroutine_handle<>> waiting;
+};
+
+// Resumes one waiting coroutine once CountDown has been called count times
+class AsyncLatch {
+public:
+	AsyncLatch(AsyncRuntime& runtime, int count)
+		: runtime(runtime)
+		, count(count) { }
+
+	bool await_ready() {
+		return count == 0;
+	}
+	void await_suspend(std::coroutine_handle<> handle) {
+		waiting = handle;
+	}
+	void await_resume() { }
+
+	void CountDown();
+
+private:
+	AsyncRuntime& runtime;
+	int count;
+	std::coroutine_handle<> waiting;
+};
+
+// Same rate limiting, retries and metrics as download_from_url
+Task<FetchResult> fetch_url(
+	AsyncRuntime& runtime, std::string url, curl_slist* headers, FetchControl* control = nullptr);
+Task<rapidjson::Document> fetch_preview(AsyncRuntime& runtime, std::string client_id,
+	int num_previews, double lat, double lng, int range);
+// Only the fields asked for, PHOTOMETA_ALL to download the panorama afterwards
+Task<rapidjson::Document> fetch_photometa(AsyncRuntime& runtime, std::string client_id,
+	std::string panorama_id, int fields = PHOTOMETA_ALL);
+// Encoded tile, empty if it could not be fetched
+Task<std::string> fetch_tile(AsyncRuntime& runtime, std::string panorama_id, int x, int y,
+	int streetview_zoom, FetchControl* control = nullptr);
+// Every tile is in flight at once, stitching runs on the CPU pool. Like download_tiles, a tile
+// much slower than the others gets a second, hedged request and the first to finish wins
+Task<sk_sp<SkImage>> download_panorama_async(AsyncRuntime& runtime, std::string panorama_id,
+	int streetview_zoom, rapidjson::Document& photometa_document,
+	TileCompleteness* completeness = nullptr, bool transparent_background = false);
+// Waits without blocking the loop until the bytes fit in the memory budget, see MemoryBudget
+Task<void> reserve_memory_async(AsyncRuntime& runtime, size_t bytes);
\ No newline at end of file
@@ -0,0 +1,99 @@
+#include "batch.hpp"
+
+#include <fmt/format.h>
+#include <rapidjson/document.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+static bool parse_json_job(std::string& line, BatchJob& job) {
+	rapidjson::Document job_json;
+	job_json.Parse(line);
+	if(job_json.HasParseError() || !job_json.IsObject() || !job_json.HasMember("lat")
+		|| !job_json.HasMember("long") || !job_json["lat"].IsNumber()
+		|| !job_json["long"].IsNumber()) {
+		return false;
+	}
+	job.lat = job_json["lat"].GetDouble();
+	job.lng = job_json["long"].GetDouble();
+	if(job_json.HasMember("name") && job_json["name"].IsString()) {
+		job.name = job_json["name"].GetString();
+	}
+	if(job_json.HasMember("num_panoramas") && job_json["num_panoramas"].IsInt()) {
+		job.num_panoramas = job_json["num_panoramas"].GetInt();
+	}
+	if(job_json.HasMember("range") && job_json["range"].IsInt()) {
+		job.range = job_json["range"].GetInt();
+	}
+	return true;
+}
+
+static bool parse_csv_job(std::string& line, BatchJob& job) {
+	std::vector<std::string> columns;
+	std::stringstream line_stream(line);
+	std::string column;
+	while(std::getline(line_stream, column, ',')) {
+		columns.push_back(column);
+	}
+	if(columns.size() < 2) {
+		return false;
+	}
+	try {
+		job.lat = std::stod(columns[0]);
+		job.lng = std::stod(columns[1]);
+		if(columns.size() > 2) {
+			job.name = columns[2];
+		}
+		if(columns.size() > 3 && !columns[3].empty()) {
+			job.num_panoramas = std::stoi(columns[3]);
+		}
+		if(columns.size() > 4 && !columns[4].empty()) {
+			job.range = std::stoi(columns[4]);
+		}
+	} catch(std::exception&) {
+		return false;
+	}
+	return true;
+}
+
+std::vector<BatchJob> read_batch_jobs(std::string path, int num_panoramas, int range) {
+	std::ifstream jobs_file(path, std::ios::in);
+	if(!jobs_file) {
+		std::cerr << "Could not open job list " << path << std::endl;
+		return {};
+	}
+
+	std::vector<BatchJob> jobs;
+	std::string line;
+	int line_number = 0;
+	while(std::getline(jobs_file, line)) {
+		line_number++;
+		if(!line.empty() && line.back() == '\r') {
+			line.pop_back();
+		}
+		auto first = line.find_first_not_of(" \t");
+		if(first == std::string::npos) {
+			continue;
+		}
+
+		BatchJob job {
+			.num_panoramas = num_panoramas,
+			.range         = range,
+		};
+		bool parsed = line[first] == '{' ? parse_json_job(line, job) : parse_csv_job(line, job);
+		if(!parsed) {
+			if(line_number == 1 && line[first] != '{') {
+				// CSV header
+				continue;
+			}
+			std::cerr << "Malformed job on line " << line_number << " of " << path << std::endl;
+			return {};
+		}
+		if(job.name.empty()) {
+			job.name = fmt::format("line {}", line_number);
+		}
+		jobs.push_back(job);
+	}
+	return jobs;
+}
\ No newline at end of file
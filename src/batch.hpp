@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// One location of download batch, everything not given in the job list uses the command line
+struct BatchJob {
+	std::string name;
+	double lat;
+	double lng;
+	int num_panoramas;
+	int range;
+};
+
+// Reads a CSV of lat,long[,name[,num_panoramas[,range]]] with an optional header, or NDJSON of
+// objects with lat, long and optionally name, num_panoramas and range. Unnamed jobs are named
+// after their line. Returns nothing if the file can't be read or a line is malformed
+std::vector<BatchJob> read_batch_jobs(std::string path, int num_panoramas, int range);
\ No newline at end of file
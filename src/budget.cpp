@@ -0,0 +1,87 @@
+#include "budget.hpp"
+
+#include <algorithm>
+
+#include <unistd.h>
+
+#include "metrics.hpp"
+
+void MemoryBudget::SetLimit(size_t bytes) {
+	{
+		std::scoped_lock lock { budget_m };
+		limit = bytes;
+	}
+	budget_cv.notify_all();
+	get_metrics().Gauge("memory_budget_bytes").Set(bytes);
+}
+
+size_t MemoryBudget::GetLimit() {
+	std::scoped_lock lock { budget_m };
+	return limit;
+}
+
+bool MemoryBudget::Fits(size_t bytes) {
+	return limit == 0 || reserved == 0 || reserved + bytes <= limit;
+}
+
+void MemoryBudget::Add(size_t bytes) {
+	reserved += bytes;
+	high_water = std::max(high_water, reserved);
+	get_metrics().Gauge("memory_reserved_bytes").Set(reserved);
+}
+
+void MemoryBudget::Reserve(size_t bytes) {
+	std::unique_lock lock { budget_m };
+	if(!Fits(bytes)) {
+		MetricsTimer wait_timer(get_metrics().Histogram("memory_wait_us"));
+		budget_cv.wait(lock, [&] { return Fits(bytes); });
+	}
+	Add(bytes);
+}
+
+bool MemoryBudget::TryReserve(size_t bytes) {
+	std::scoped_lock lock { budget_m };
+	if(!Fits(bytes)) {
+		return false;
+	}
+	Add(bytes);
+	return true;
+}
+
+void MemoryBudget::ForceReserve(size_t bytes) {
+	std::scoped_lock lock { budget_m };
+	Add(bytes);
+}
+
+void MemoryBudget::Release(size_t bytes) {
+	{
+		std::scoped_lock lock { budget_m };
+		reserved -= std::min(bytes, reserved);
+		get_metrics().Gauge("memory_reserved_bytes").Set(reserved);
+	}
+	budget_cv.notify_all();
+}
+
+size_t MemoryBudget::GetReserved() {
+	std::scoped_lock lock { budget_m };
+	return reserved;
+}
+
+size_t MemoryBudget::GetHighWater() {
+	std::scoped_lock lock { budget_m };
+	return high_water;
+}
+
+MemoryBudget& get_memory_budget() {
+	static MemoryBudget memory_budget;
+	return memory_budget;
+}
+
+size_t default_memory_limit() {
+	long pages     = sysconf(_SC_PHYS_PAGES);
+	long page_size = sysconf(_SC_PAGE_SIZE);
+	if(pages <= 0 || page_size <= 0) {
+		return 0;
+	}
+	return (size_t)pages * page_size / 2;
+}
\ No newline at end of file
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+// Shared by every panorama in flight, see download_async. Large buffers, like stitched rasters,
+// downloaded tiles and encoded images, are reserved before they are allocated, and work waits
+// while the budget is used up so more panoramas at once only slows the download down. A
+// reservation larger than the whole budget waits until nothing else is reserved
+class MemoryBudget {
+public:
+	// 0 for no limit
+	void SetLimit(size_t bytes);
+	size_t GetLimit();
+	// Blocks until the bytes fit
+	void Reserve(size_t bytes);
+	// Non-blocking Reserve for the event loop
+	bool TryReserve(size_t bytes);
+	// Counted without waiting, for memory that already exists like queued writes
+	void ForceReserve(size_t bytes);
+	void Release(size_t bytes);
+
+	size_t GetReserved();
+	size_t GetHighWater();
+
+private:
+	// Must hold budget_m
+	bool Fits(size_t bytes);
+	void Add(size_t bytes);
+
+	size_t limit      = 0;
+	size_t reserved   = 0;
+	size_t high_water = 0;
+	std::mutex budget_m;
+	std::condition_variable budget_cv;
+};
+
+MemoryBudget& get_memory_budget();
+
+// Half of physical memory, the rest is left for the page cache and other processes
+size_t default_memory_limit();
\ No newline at end of file
@@ -0,0 +1,391 @@
+#include "catalog.hpp"
+
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+// Binary catalog layout, all integers and doubles little endian:
+//   header  "SVCAT\0\0\1"
+//   blocks  u32 count, then each field as one column of `count` values. Strings are stored as
+//           u32 offsets[count + 1] followed by the concatenated bytes. Adjacency is a u32
+//           offsets[count + 1] into a string column holding every adjacent id of the block
+//   footer  u32 num_blocks, then per block u64 offset, u32 count, f64 min/max lat, min/max lng
+//   trailer u64 footer offset, "SVCATEND"
+#define CATALOG_MAGIC "SVCAT\0\0\1"
+#define CATALOG_END_MAGIC "SVCATEND"
+#define CATALOG_BLOCK_SIZE 4096
+
+template <typename T> static void write_value(std::ofstream& file, T value) {
+	file.write((const char*)&value, sizeof(T));
+}
+
+template <typename T> static T read_value(std::ifstream& file) {
+	T value {};
+	file.read((char*)&value, sizeof(T));
+	return value;
+}
+
+template <typename T, typename F>
+static void write_column(std::ofstream& file, std::vector<CatalogRecord>& records, F get) {
+	for(auto& record : records) {
+		write_value<T>(file, get(record));
+	}
+}
+
+template <typename F>
+static void write_string_column(std::ofstream& file, std::vector<CatalogRecord>& records, F get) {
+	uint32_t offset = 0;
+	write_value<uint32_t>(file, offset);
+	for(auto& record : records) {
+		offset += get(record).size();
+		write_value<uint32_t>(file, offset);
+	}
+	for(auto& record : records) {
+		auto& str = get(record);
+		file.write(str.data(), str.size());
+	}
+}
+
+static std::vector<std::string> read_string_column(std::ifstream& file, uint32_t count) {
+	std::vector<uint32_t> offsets(count + 1);
+	file.read((char*)offsets.data(), offsets.size() * sizeof(uint32_t));
+	std::string bytes(offsets[count], '\0');
+	file.read(bytes.data(), bytes.size());
+
+	std::vector<std::string> strings;
+	for(uint32_t i = 0; i < count; i++) {
+		strings.push_back(bytes.substr(offsets[i], offsets[i + 1] - offsets[i]));
+	}
+	return strings;
+}
+
+CatalogWriter::~CatalogWriter() {
+	Close();
+}
+
+bool CatalogWriter::Open(std::string path, CatalogFormat format) {
+	std::scoped_lock lock { file_m };
+	this->format = format;
+	// Replaced like the binary format, a rerun would otherwise list every panorama twice
+	if(format == CatalogFormat::NDJSON) {
+		file.open(path, std::ios::out | std::ios::trunc);
+	} else {
+		file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+		file.write(CATALOG_MAGIC, 8);
+	}
+	return file.is_open();
+}
+
+void CatalogWriter::Append(CatalogRecord& record) {
+	std::scoped_lock lock { file_m };
+	if(!file.is_open()) {
+		return;
+	}
+
+	if(format == CatalogFormat::NDJSON) {
+		rapidjson::StringBuffer record_sb;
+		rapidjson::Writer<rapidjson::StringBuffer> record_writer(record_sb);
+		record_writer.StartObject();
+		record_writer.Key("id");
+		record_writer.String(record.id);
+		record_writer.Key("year");
+		record_writer.Int(record.year);
+		record_writer.Key("month");
+		record_writer.Int(record.month);
+		record_writer.Key("lat");
+		record_writer.Double(record.lat);
+		record_writer.Key("long");
+		record_writer.Double(record.lng);
+		record_writer.Key("yaw");
+		record_writer.Double(record.yaw);
+		record_writer.Key("pitch");
+		record_writer.Double(record.pitch);
+		record_writer.Key("roll");
+		record_writer.Double(record.roll);
+		record_writer.Key("street");
+		record_writer.String(record.street);
+		record_writer.Key("city");
+		record_writer.String(record.city);
+		record_writer.Key("adjacent");
+		record_writer.StartArray();
+		for(auto& id : record.adjacent) {
+			record_writer.String(id);
+		}
+		record_writer.EndArray();
+		record_writer.Key("path");
+		record_writer.String(record.path);
+		record_writer.EndObject();
+
+		file.write(record_sb.GetString(), record_sb.GetLength());
+		file.put('\n');
+	} else {
+		block.push_back(record);
+		if(block.size() == CATALOG_BLOCK_SIZE) {
+			WriteBlock();
+		}
+	}
+}
+
+void CatalogWriter::Flush() {
+	std::scoped_lock lock { file_m };
+	if(!file.is_open()) {
+		return;
+	}
+	if(format == CatalogFormat::BINARY && !block.empty()) {
+		WriteBlock();
+	}
+	file.flush();
+}
+
+void CatalogWriter::Close() {
+	std::scoped_lock lock { file_m };
+	if(!file.is_open()) {
+		return;
+	}
+
+	if(format == CatalogFormat::BINARY) {
+		if(!block.empty()) {
+			WriteBlock();
+		}
+
+		uint64_t footer_offset = file.tellp();
+		write_value<uint32_t>(file, blocks.size());
+		for(auto& index : blocks) {
+			write_value<uint64_t>(file, index.offset);
+			write_value<uint32_t>(file, index.num_records);
+			write_value<double>(file, index.min_lat);
+			write_value<double>(file, index.max_lat);
+			write_value<double>(file, index.min_lng);
+			write_value<double>(file, index.max_lng);
+		}
+		write_value<uint64_t>(file, footer_offset);
+		file.write(CATALOG_END_MAGIC, 8);
+	}
+
+	file.close();
+}
+
+void CatalogWriter::WriteBlock() {
+	BlockIndex index {
+		.offset      = (uint64_t)file.tellp(),
+		.num_records = (uint32_t)block.size(),
+		.min_lat     = block[0].lat,
+		.max_lat     = block[0].lat,
+		.min_lng     = block[0].lng,
+		.max_lng     = block[0].lng,
+	};
+	for(auto& record : block) {
+		index.min_lat = std::min(index.min_lat, record.lat);
+		index.max_lat = std::max(index.max_lat, record.lat);
+		index.min_lng = std::min(index.min_lng, record.lng);
+		index.max_lng = std::max(index.max_lng, record.lng);
+	}
+
+	write_value<uint32_t>(file, block.size());
+	write_string_column(file, block, [](CatalogRecord& r) -> std::string& { return r.id; });
+	write_column<int32_t>(file, block, [](CatalogRecord& r) { return r.year; });
+	write_column<int32_t>(file, block, [](CatalogRecord& r) { return r.month; });
+	write_column<double>(file, block, [](CatalogRecord& r) { return r.lat; });
+	write_column<double>(file, block, [](CatalogRecord& r) { return r.lng; });
+	write_column<double>(file, block, [](CatalogRecord& r) { return r.yaw; });
+	write_column<double>(file, block, [](CatalogRecord& r) { return r.pitch; });
+	write_column<double>(file, block, [](CatalogRecord& r) { return r.roll; });
+	write_string_column(file, block, [](CatalogRecord& r) -> std::string& { return r.street; });
+	write_string_column(file, block, [](CatalogRecord& r) -> std::string& { return r.city; });
+	write_string_column(file, block, [](CatalogRecord& r) -> std::string& { return r.path; });
+
+	// Adjacency is a list column, offsets into one flattened string column
+	std::vector<CatalogRecord> flattened;
+	uint32_t adjacent_offset = 0;
+	write_value<uint32_t>(file, adjacent_offset);
+	for(auto& record : block) {
+		adjacent_offset += record.adjacent.size();
+		write_value<uint32_t>(file, adjacent_offset);
+		for(auto& id : record.adjacent) {
+			flattened.push_back(CatalogRecord { .id = id });
+		}
+	}
+	write_value<uint32_t>(file, flattened.size());
+	write_string_column(file, flattened, [](CatalogRecord& r) -> std::string& { return r.id; });
+
+	blocks.push_back(index);
+	block.clear();
+}
+
+CatalogFormat catalog_format_from_string(std::string format) {
+	if(format == "binary") {
+		return CatalogFormat::BINARY;
+	}
+	return CatalogFormat::NDJSON;
+}
+
+static std::vector<CatalogRecord> read_binary_catalog(std::ifstream& file) {
+	std::vector<CatalogRecord> records;
+
+	file.seekg(-16, std::ios::end);
+	auto footer_offset = read_value<uint64_t>(file);
+	char end_magic[8];
+	file.read(end_magic, 8);
+	if(memcmp(end_magic, CATALOG_END_MAGIC, 8) != 0) {
+		std::cerr << "Catalog is truncated, missing footer" << std::endl;
+		return records;
+	}
+
+	file.seekg(footer_offset);
+	auto num_blocks = read_value<uint32_t>(file);
+	std::vector<uint64_t> block_offsets;
+	for(uint32_t i = 0; i < num_blocks; i++) {
+		block_offsets.push_back(read_value<uint64_t>(file));
+		// Count and bounding box, not needed for a full read
+		file.seekg(sizeof(uint32_t) + sizeof(double) * 4, std::ios::cur);
+	}
+
+	for(auto offset : block_offsets) {
+		file.seekg(offset);
+		auto count = read_value<uint32_t>(file);
+		auto start = records.size();
+		records.resize(start + count);
+		auto block = records.begin() + start;
+
+		auto ids = read_string_column(file, count);
+		for(uint32_t i = 0; i < count; i++) {
+			block[i].id = ids[i];
+		}
+		for(uint32_t i = 0; i < count; i++) {
+			block[i].year = read_value<int32_t>(file);
+		}
+		for(uint32_t i = 0; i < count; i++) {
+			block[i].month = read_value<int32_t>(file);
+		}
+		for(auto field : { &CatalogRecord::lat, &CatalogRecord::lng, &CatalogRecord::yaw,
+				 &CatalogRecord::pitch, &CatalogRecord::roll }) {
+			for(uint32_t i = 0; i < count; i++) {
+				block[i].*field = read_value<double>(file);
+			}
+		}
+		for(auto field : { &CatalogRecord::street, &CatalogRecord::city, &CatalogRecord::path }) {
+			auto strings = read_string_column(file, count);
+			for(uint32_t i = 0; i < count; i++) {
+				block[i].*field = strings[i];
+			}
+		}
+
+		std::vector<uint32_t> adjacent_offsets(count + 1);
+		file.read((char*)adjacent_offsets.data(), adjacent_offsets.size() * sizeof(uint32_t));
+		auto num_adjacent = read_value<uint32_t>(file);
+		auto adjacent_ids = read_string_column(file, num_adjacent);
+		for(uint32_t i = 0; i < count; i++) {
+			block[i].adjacent.assign(adjacent_ids.begin() + adjacent_offsets[i],
+				adjacent_ids.begin() + adjacent_offsets[i + 1]);
+		}
+	}
+
+	return records;
+}
+
+// Only the ID and location are required, older and hand-edited records may lack the rest
+static bool parse_ndjson_record(rapidjson::Document& record_json, CatalogRecord& record) {
+	if(!record_json.IsObject() || !record_json.HasMember("id") || !record_json["id"].IsString()
+		|| !record_json.HasMember("lat") || !record_json["lat"].IsNumber()
+		|| !record_json.HasMember("long") || !record_json["long"].IsNumber()) {
+		return false;
+	}
+	record.id  = record_json["id"].GetString();
+	record.lat = record_json["lat"].GetDouble();
+	record.lng = record_json["long"].GetDouble();
+
+	auto get_int = [&](const char* key, int& value) {
+		if(!record_json.HasMember(key)) {
+			return true;
+		}
+		if(!record_json[key].IsInt()) {
+			return false;
+		}
+		value = record_json[key].GetInt();
+		return true;
+	};
+	auto get_double = [&](const char* key, double& value) {
+		value = 0.0;
+		if(!record_json.HasMember(key)) {
+			return true;
+		}
+		if(!record_json[key].IsNumber()) {
+			return false;
+		}
+		value = record_json[key].GetDouble();
+		return true;
+	};
+	auto get_string = [&](const char* key, std::string& value) {
+		if(!record_json.HasMember(key)) {
+			return true;
+		}
+		if(!record_json[key].IsString()) {
+			return false;
+		}
+		value = record_json[key].GetString();
+		return true;
+	};
+	if(!get_int("year", record.year) || !get_int("month", record.month)
+		|| !get_double("yaw", record.yaw) || !get_double("pitch", record.pitch)
+		|| !get_double("roll", record.roll) || !get_string("street", record.street)
+		|| !get_string("city", record.city) || !get_string("path", record.path)) {
+		return false;
+	}
+
+	if(record_json.HasMember("adjacent")) {
+		if(!record_json["adjacent"].IsArray()) {
+			return false;
+		}
+		for(auto& id : record_json["adjacent"].GetArray()) {
+			if(id.IsString()) {
+				record.adjacent.push_back(id.GetString());
+			}
+		}
+	}
+	return true;
+}
+
+static std::vector<CatalogRecord> read_ndjson_catalog(std::ifstream& file) {
+	std::vector<CatalogRecord> records;
+	std::string line;
+	int num_skipped = 0;
+	while(std::getline(file, line)) {
+		if(line.empty()) {
+			continue;
+		}
+		rapidjson::Document record_json;
+		record_json.Parse(line);
+		CatalogRecord record;
+		if(record_json.HasParseError() || !parse_ndjson_record(record_json, record)) {
+			num_skipped++;
+			continue;
+		}
+		records.push_back(record);
+	}
+	if(num_skipped) {
+		std::cerr << "Skipped " << num_skipped << " malformed catalog records" << std::endl;
+	}
+	return records;
+}
+
+std::vector<CatalogRecord> read_catalog(std::string path) {
+	std::ifstream file(path, std::ios::in | std::ios::binary);
+	if(!file.is_open()) {
+		std::cerr << "Could not open catalog " << path << std::endl;
+		return {};
+	}
+
+	char magic[8] = {};
+	file.read(magic, 8);
+	if(memcmp(magic, CATALOG_MAGIC, 8) == 0) {
+		return read_binary_catalog(file);
+	} else {
+		file.clear();
+		file.seekg(0);
+		return read_ndjson_catalog(file);
+	}
+}
\ No newline at end of file
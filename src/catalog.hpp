@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum class CatalogFormat {
+	NDJSON,
+	BINARY,
+};
+
+struct CatalogRecord {
+	std::string id;
+	int year  = 0;
+	int month = 0;
+	double lat;
+	double lng;
+	double yaw;
+	double pitch;
+	double roll;
+	std::string street;
+	std::string city;
+	std::vector<std::string> adjacent;
+	std::string path;
+};
+
+// Streaming writer for panorama metadata, one record per panorama in a single file.
+// NDJSON writes one line per record. The binary format buffers records into blocks of
+// columns and ends with a footer indexing every block, see catalog.cpp for the layout.
+class CatalogWriter {
+public:
+	~CatalogWriter();
+
+	bool Open(std::string path, CatalogFormat format);
+	void Append(CatalogRecord& record);
+	// Puts every record appended so far in the file. A binary catalog is only readable after
+	// Close, which writes its footer
+	void Flush();
+	void Close();
+	bool IsOpen() {
+		return file.is_open();
+	}
+
+private:
+	void WriteBlock();
+
+	struct BlockIndex {
+		uint64_t offset;
+		uint32_t num_records;
+		double min_lat;
+		double max_lat;
+		double min_lng;
+		double max_lng;
+	};
+
+	std::ofstream file;
+	CatalogFormat format;
+	std::vector<CatalogRecord> block;
+	std::vector<BlockIndex> blocks;
+	std::mutex file_m;
+};
+
+CatalogFormat catalog_format_from_string(std::string format);
+std::vector<CatalogRecord> read_catalog(std::string path);
\ No newline at end of file
@@ -0,0 +1,139 @@
+#include "dedup.hpp"
+
+#include <core/SkBitmap.h>
+#include <core/SkPixmap.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+
+#include "pyramid.hpp"
+
+#define METERS_PER_LAT_DEGREE 111320.0
+#define DEG_RAD 0.0174533
+// Luminance is downsampled to this before the DCT
+#define HASH_INPUT_SIZE 32
+// Lowest frequencies kept from the DCT, one bit each
+#define HASH_SIDE 8
+
+// Rows of the DCT-II basis for the kept frequencies
+static const std::array<std::array<float, HASH_INPUT_SIZE>, HASH_SIDE>& dct_basis() {
+	static std::array<std::array<float, HASH_INPUT_SIZE>, HASH_SIDE> basis = [] {
+		std::array<std::array<float, HASH_INPUT_SIZE>, HASH_SIDE> basis;
+		for(int u = 0; u < HASH_SIDE; u++) {
+			for(int x = 0; x < HASH_INPUT_SIZE; x++) {
+				basis[u][x] = std::cos((2 * x + 1) * u * M_PI / (2 * HASH_INPUT_SIZE));
+			}
+		}
+		return basis;
+	}();
+	return basis;
+}
+
+uint64_t perceptual_hash(sk_sp<SkImage> image) {
+	// Panoramas are 2:1, squashing them to a square is the same for every panorama
+	std::vector<std::pair<int, int>> sizes { std::make_pair(HASH_INPUT_SIZE, HASH_INPUT_SIZE) };
+	auto small = build_pyramid(image, sizes)[0];
+
+	SkBitmap rgba;
+	rgba.allocPixels(SkImageInfo::Make(
+		HASH_INPUT_SIZE, HASH_INPUT_SIZE, kRGBA_8888_SkColorType, kPremul_SkAlphaType));
+	small->readPixels(rgba.pixmap(), 0, 0);
+
+	float luminance[HASH_INPUT_SIZE][HASH_INPUT_SIZE];
+	for(int y = 0; y < HASH_INPUT_SIZE; y++) {
+		auto row = static_cast<const uint8_t*>(rgba.getAddr(0, y));
+		for(int x = 0; x < HASH_INPUT_SIZE; x++) {
+			luminance[y][x]
+				= 0.299f * row[x * 4] + 0.587f * row[x * 4 + 1] + 0.114f * row[x * 4 + 2];
+		}
+	}
+
+	// Separable 2D DCT of only the low frequencies. Inner loops run over contiguous rows so
+	// they vectorize
+	auto& basis = dct_basis();
+	float columns[HASH_SIDE][HASH_INPUT_SIZE] = {};
+	for(int u = 0; u < HASH_SIDE; u++) {
+		for(int y = 0; y < HASH_INPUT_SIZE; y++) {
+			float weight = basis[u][y];
+			for(int x = 0; x < HASH_INPUT_SIZE; x++) {
+				columns[u][x] += weight * luminance[y][x];
+			}
+		}
+	}
+	std::array<float, HASH_SIDE * HASH_SIDE> coefficients;
+	for(int u = 0; u < HASH_SIDE; u++) {
+		for(int v = 0; v < HASH_SIDE; v++) {
+			float sum = 0;
+			for(int x = 0; x < HASH_INPUT_SIZE; x++) {
+				sum += columns[u][x] * basis[v][x];
+			}
+			coefficients[u * HASH_SIDE + v] = sum;
+		}
+	}
+
+	// The DC term is overall brightness, leave it out of the median
+	auto sorted = std::vector<float>(coefficients.begin() + 1, coefficients.end());
+	std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+	float median = sorted[sorted.size() / 2];
+
+	uint64_t hash = 0;
+	for(int i = 0; i < coefficients.size(); i++) {
+		if(coefficients[i] > median) {
+			hash |= 1ULL << i;
+		}
+	}
+	return hash;
+}
+
+int hash_distance(uint64_t a, uint64_t b) {
+	return std::popcount(a ^ b);
+}
+
+NearDuplicateIndex::NearDuplicateIndex(double radius, int max_distance)
+	: radius(radius)
+	, max_distance(max_distance) { }
+
+int64_t NearDuplicateIndex::CellKey(int row, int column) {
+	return ((int64_t)row << 32) ^ (uint32_t)column;
+}
+
+int NearDuplicateIndex::Column(int row, double lng) {
+	// Every panorama in a row is scaled by the cosine at the row's centre, so the same longitude
+	// always lands in the same column of that row
+	double center_lat = (row + 0.5) * radius / METERS_PER_LAT_DEGREE;
+	return std::floor(lng * METERS_PER_LAT_DEGREE * std::cos(center_lat * DEG_RAD) / radius);
+}
+
+std::string NearDuplicateIndex::FindOrAdd(std::string id, double lat, double lng, uint64_t hash) {
+	// Local equirectangular meters, fine at the scale of a few cells
+	double meters_per_lng_degree = METERS_PER_LAT_DEGREE * std::cos(lat * DEG_RAD);
+	int row                      = std::floor(lat * METERS_PER_LAT_DEGREE / radius);
+
+	for(int dy = -1; dy <= 1; dy++) {
+		int column = Column(row + dy, lng);
+		for(int dx = -1; dx <= 1; dx++) {
+			auto cell = cells.find(CellKey(row + dy, column + dx));
+			if(cell == cells.end()) {
+				continue;
+			}
+			for(auto& entry : cell->second) {
+				double north = (entry.lat - lat) * METERS_PER_LAT_DEGREE;
+				double east  = (entry.lng - lng) * meters_per_lng_degree;
+				if(north * north + east * east <= radius * radius
+					&& hash_distance(entry.hash, hash) <= max_distance) {
+					return entry.id;
+				}
+			}
+		}
+	}
+
+	cells[CellKey(row, Column(row, lng))].push_back(Entry {
+		.id   = id,
+		.lat  = lat,
+		.lng  = lng,
+		.hash = hash,
+	});
+	return "";
+}
\ No newline at end of file
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <core/SkImage.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Zoom downloaded to compare panoramas, 2 tiles
+#define DEDUP_ZOOM 1
+
+// 64 bit DCT hash of a panorama, similar images differ in few bits. Meant for a low zoom image,
+// zoom 1 is plenty
+uint64_t perceptual_hash(sk_sp<SkImage> image);
+int hash_distance(uint64_t a, uint64_t b);
+
+// Panoramas seen so far on a grid of cells the size of the radius, so only the 9 cells around
+// a panorama are compared. Not thread safe
+class NearDuplicateIndex {
+public:
+	NearDuplicateIndex(double radius, int max_distance);
+
+	// ID of an earlier panorama within the radius whose hash differs in at most max_distance
+	// bits, otherwise adds this panorama and returns an empty string
+	std::string FindOrAdd(std::string id, double lat, double lng, uint64_t hash);
+
+private:
+	struct Entry {
+		std::string id;
+		double lat;
+		double lng;
+		uint64_t hash;
+	};
+
+	int64_t CellKey(int row, int column);
+	int Column(int row, double lng);
+
+	double radius;
+	int max_distance;
+	std::unordered_map<int64_t, std::vector<Entry>> cells;
+};
\ No newline at end of file
@@ -0,0 +1,108 @@
+#include "delta.hpp"
+
+#include <fmt/format.h>
+#include <rapidjson/prettywriter.h>
+#include <rapidjson/stringbuffer.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#include "metrics.hpp"
+
+bool CrawlDelta::Load(std::string catalog_path) {
+	if(!std::filesystem::exists(catalog_path)) {
+		std::cerr << "Could not open catalog " << catalog_path << std::endl;
+		return false;
+	}
+	for(auto& record : read_catalog(catalog_path)) {
+		// A panorama downloaded twice keeps its last record
+		previous[record.id] = record;
+	}
+	loaded = true;
+	return true;
+}
+
+bool CrawlDelta::Knows(std::string& id) {
+	std::scoped_lock lock { delta_m };
+	return previous.count(id);
+}
+
+DeltaStatus CrawlDelta::Classify(Panorama& panorama) {
+	std::scoped_lock lock { delta_m };
+	seen.insert(panorama.id);
+
+	DeltaStatus status;
+	auto record = previous.find(panorama.id);
+	if(record == previous.end()) {
+		status = DeltaStatus::NEW;
+		new_ids.push_back(panorama.id);
+	} else if(record->second.year != panorama.year || record->second.month != panorama.month
+			  || (!record->second.path.empty()
+				  && !std::filesystem::exists(record->second.path))) {
+		// Image deleted since counts as changed too, it has to be downloaded again
+		status = DeltaStatus::CHANGED;
+		changed_ids.push_back(panorama.id);
+	} else {
+		status = DeltaStatus::UNCHANGED;
+		num_unchanged++;
+	}
+
+	const char* labels[] = { "{status=\"new\"}", "{status=\"changed\"}", "{status=\"unchanged\"}" };
+	get_metrics().Counter("delta_panoramas", labels[(int)status]).Add();
+	return status;
+}
+
+CatalogRecord CrawlDelta::Previous(std::string& id) {
+	std::scoped_lock lock { delta_m };
+	return previous[id];
+}
+
+std::string CrawlDelta::Summary() {
+	std::scoped_lock lock { delta_m };
+	size_t num_not_seen = previous.size() - num_unchanged - changed_ids.size();
+	return fmt::format("{} new, {} changed, {} unchanged, {} of {} earlier panoramas not seen\n",
+		new_ids.size(), changed_ids.size(), num_unchanged, num_not_seen, previous.size());
+}
+
+bool CrawlDelta::WriteReport(std::string path) {
+	std::scoped_lock lock { delta_m };
+	rapidjson::StringBuffer report_sb;
+	rapidjson::PrettyWriter<rapidjson::StringBuffer> report_writer(report_sb);
+	report_writer.SetIndent('\t', 1);
+
+	auto write_ids = [&](const char* key, std::vector<std::string>& ids) {
+		report_writer.Key(key);
+		report_writer.StartArray();
+		for(auto& id : ids) {
+			report_writer.String(id.c_str());
+		}
+		report_writer.EndArray();
+	};
+
+	std::vector<std::string> not_seen_ids;
+	for(auto& [id, record] : previous) {
+		if(!seen.count(id)) {
+			not_seen_ids.push_back(id);
+		}
+	}
+
+	report_writer.StartObject();
+	report_writer.Key("previous");
+	report_writer.Int(previous.size());
+	write_ids("new", new_ids);
+	write_ids("changed", changed_ids);
+	report_writer.Key("unchanged");
+	report_writer.Int(num_unchanged);
+	// Removed, outside the area of this run or filtered out by date
+	write_ids("not_seen", not_seen_ids);
+	report_writer.EndObject();
+
+	std::ofstream report_file(path, std::ios::out | std::ios::trunc);
+	if(!report_file) {
+		std::cerr << "Could not write delta report " << path << std::endl;
+		return false;
+	}
+	report_file.write(report_sb.GetString(), report_sb.GetLength());
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "catalog.hpp"
+#include "extract.hpp"
+
+enum class DeltaStatus {
+	NEW,
+	CHANGED,
+	UNCHANGED,
+};
+
+// Compares the panoramas of this run against the catalog of an earlier one, so only new
+// panoramas and those whose date changed or whose image went missing are downloaded again
+class CrawlDelta {
+public:
+	// Nothing is known until a catalog is loaded, every panorama is new
+	bool Load(std::string catalog_path);
+	bool IsLoaded() {
+		return loaded;
+	}
+	// Known panoramas only need their metadata refetched to be classified
+	bool Knows(std::string& id);
+	DeltaStatus Classify(Panorama& panorama);
+	// Record of an earlier run, only valid for known panoramas
+	CatalogRecord Previous(std::string& id);
+
+	std::string Summary();
+	// JSON with the new and changed IDs, the number unchanged and earlier IDs this run didn't see
+	bool WriteReport(std::string path);
+
+private:
+	bool loaded = false;
+	std::unordered_map<std::string, CatalogRecord> previous;
+	std::unordered_set<std::string> seen;
+	std::vector<std::string> new_ids;
+	std::vector<std::string> changed_ids;
+	int num_unchanged = 0;
+	std::mutex delta_m;
+};
\ No newline at end of file
@@ -2,15 +2,108 @@
 
 #define MAPS_PREVIEW_ID "CAEIBAgFCAYgAQ"
 
+#include <codec/SkCodec.h>
 #include <core/SkData.h>
 #include <core/SkImage.h>
 #include <fmt/format.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <tuple>
 
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "async.hpp"
+#include "budget.hpp"
 #include "extract.hpp"
 #include "headers.hpp"
+#include "metrics.hpp"
 #include "parse.hpp"
+#include "pb.hpp"
+#include "rate.hpp"
+#include "trace.hpp"
+
+#define TILE_THREADS 4
+// Encoded size of one tile, they are JPEGs of around 30 to 60KB
+#define TILE_BYTES_ESTIMATE ((size_t)64 << 10)
+
+static std::string endpoint_override;
+static std::string scratch_dir;
+
+void set_endpoint_override(std::string endpoint) {
+	endpoint_override = endpoint;
+}
+
+void set_scratch_dir(std::string dir) {
+	scratch_dir = dir;
+}
+
+// Scheme and host of a URL, e.g. https://www.google.com
+static std::string url_origin(std::string& url) {
+	auto scheme_end = url.find("://");
+	if(scheme_end == std::string::npos) {
+		return "";
+	}
+	return url.substr(0, url.find('/', scheme_end + 3));
+}
+
+const char* request_type(std::string& url) {
+	if(url.find("/v1/tile") != std::string::npos) {
+		return "tile";
+	} else if(url.find("/photometa/") != std::string::npos) {
+		return "photometa";
+	} else if(url.find("listentityphotos") != std::string::npos) {
+		return "preview";
+	}
+	return "main_page";
+}
+
+// Looked up once per type, not on every request
+struct RequestMetrics {
+	MetricsHistogram& latency;
+	MetricsCounter& bytes;
+	MetricsCounter& retries;
+	// Other statuses are rare enough to look up each time
+	MetricsCounter& ok;
+};
+
+static RequestMetrics make_request_metrics(const char* type) {
+	auto& metrics = get_metrics();
+	auto labels   = fmt::format("{{type=\"{}\"}}", type);
+	return RequestMetrics {
+		.latency = metrics.Histogram("request_latency_us", labels),
+		.bytes   = metrics.Counter("request_bytes", labels),
+		.retries = metrics.Counter("request_retries", labels),
+		.ok      = metrics.Counter("requests", fmt::format("{{type=\"{}\",status=\"200\"}}", type)),
+	};
+}
+
+static RequestMetrics& get_request_metrics(const char* type) {
+	// Every type request_type returns, main_page last
+	static const char* types[]      = { "tile", "photometa", "preview", "main_page" };
+	static RequestMetrics metrics[] = { make_request_metrics(types[0]),
+		make_request_metrics(types[1]), make_request_metrics(types[2]),
+		make_request_metrics(types[3]) };
+	for(int i = 0; i < 3; i++) {
+		if(strcmp(type, types[i]) == 0) {
+			return metrics[i];
+		}
+	}
+	return metrics[3];
+}
+
+static bool is_transient_error(CURLcode res) {
+	return res == CURLE_OPERATION_TIMEDOUT || res == CURLE_COULDNT_CONNECT
+		   || res == CURLE_SEND_ERROR || res == CURLE_RECV_ERROR || res == CURLE_GOT_NOTHING;
+}
 
 static size_t write_memory_callback(void* contents, size_t size, size_t nmemb, void* userp) {
 	size_t realsize = size * nmemb;
@@ -19,9 +112,52 @@ static size_t write_memory_callback(void* contents, size_t size, size_t nmemb, v
 	return realsize;
 }
 
+std::string apply_endpoint_override(std::string& url) {
+	// Rate limits are tracked per original host, even when redirected to a local server
+	auto host = url_origin(url);
+	if(!endpoint_override.empty()) {
+		url = endpoint_override + url.substr(host.size());
+	}
+	return host;
+}
+
+bool finish_request(std::string& url, std::string& host, CURLcode res, long http_code,
+	curl_off_t retry_after, std::chrono::steady_clock::time_point start, size_t bytes) {
+	auto type = request_type(url);
+	if(res == CURLE_ABORTED_BY_CALLBACK) {
+		// The other request of a hedged tile won, neither a success nor a failure of the host
+		get_metrics()
+			.Counter("requests", fmt::format("{{type=\"{}\",status=\"aborted\"}}", type))
+			.Add();
+		get_rate_controller().Abandon(host);
+		return false;
+	}
+
+	auto& metrics = get_request_metrics(type);
+	auto elapsed  = std::chrono::steady_clock::now() - start;
+	metrics.latency.Record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+	metrics.bytes.Add(bytes);
+	if(res == CURLE_OK && http_code == 200) {
+		metrics.ok.Add();
+	} else {
+		get_metrics()
+			.Counter("requests",
+				fmt::format("{{type=\"{}\",status=\"{}\"}}", type,
+					res == CURLE_OK ? std::to_string(http_code) : "error"))
+			.Add();
+	}
+	return get_rate_controller().Release(host, type, http_code,
+		is_transient_error(res), std::chrono::duration_cast<std::chrono::milliseconds>(elapsed),
+		(long)retry_after);
+}
+
 std::string download_from_url(
 	std::string url, CURL* curl_handle, CURLcode* res, curl_slist* headers) {
 	std::string download;
+
+	TraceSpan span("http", request_type(url));
+	auto host = apply_endpoint_override(url);
+
 	curl_easy_setopt(curl_handle, CURLOPT_URL, url.c_str());
 	curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_memory_callback);
 	curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &download);
@@ -37,9 +173,39 @@ std::string download_from_url(
 	//  curl_easy_setopt(curl_handle, CURLOPT_REDIR_PROTOCOLS, CURLPROTO_HTTP |
 	//  CURLPROTO_HTTPS);
 
-	*res = curl_easy_perform(curl_handle);
+	auto& metrics    = get_request_metrics(request_type(url));
+	int attempts     = 0;
+	long last_status = 0;
+	for(int attempt = 0; attempt < MAX_REQUEST_ATTEMPTS; attempt++) {
+		if(attempt > 0) {
+			metrics.retries.Add();
+		}
+
+		get_rate_controller().Acquire(host);
+		auto start = std::chrono::steady_clock::now();
+
+		download.clear();
+		*res = curl_easy_perform(curl_handle);
+
+		long http_code         = 0;
+		curl_off_t retry_after = 0;
+		if(*res == CURLE_OK) {
+			curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
+			curl_easy_getinfo(curl_handle, CURLINFO_RETRY_AFTER, &retry_after);
+		}
 
-	if(*res != CURLE_OK) {
+		attempts    = attempt + 1;
+		last_status = *res == CURLE_OK ? http_code : -1;
+		if(!finish_request(url, host, *res, http_code, retry_after, start, download.size())) {
+			break;
+		}
+	}
+	span.Arg("status", last_status);
+	span.Arg("attempts", attempts);
+	span.Arg("bytes", download.size());
+
+	// Aborted on purpose, the other request of a hedged tile finished first
+	if(*res != CURLE_OK && *res != CURLE_ABORTED_BY_CALLBACK) {
 		std::cerr << "Downloading failed: " << curl_easy_strerror(*res) << std::endl;
 	}
 
@@ -54,25 +220,105 @@ std::string download_client_id(CURL* curl_handle) {
 	return client_id;
 }
 
+// Which kind of photo and in which format, used by both endpoints
+static PbMessage photo_filter(int type, bool flag, int format) {
+	return PbMessage().Enum(1, type).Bool(2, flag).Enum(3, format);
+}
+
+static PbTemplate make_preview_template() {
+	PbMessage filters;
+	for(auto [type, flag, format] : std::initializer_list<std::tuple<int, bool, int>> {
+			{ 1, false, 3 }, { 2, true, 2 }, { 2, false, 3 }, { 8, false, 3 },
+			{ 10, false, 3 }, { 10, true, 2 }, { 9, true, 2 }, { 10, false, 3 },
+			{ 10, true, 2 }, { 10, false, 4 } }) {
+		filters.Message(1, photo_filter(type, flag, format));
+	}
+	filters.Bool(2, true).Bool(4, true);
+
+	// Number of previews, client ID, longitude, latitude and range are filled in per request
+	auto previews = PbMessage().Placeholder(2, 'i').String(3, MAPS_PREVIEW_ID).Bool(5, true);
+	auto request  = PbMessage()
+					   .Message(2, PbMessage().Int(1, 203).Int(2, 100))
+					   .Message(3, previews)
+					   .Message(7, filters)
+					   .Message(8, PbMessage())
+					   .Bool(9, false)
+					   .Message(11, PbMessage().Bool(4, true));
+	return PbTemplate("https://www.google.com/maps/rpc/photo/"
+					  "listentityphotos?authuser=0&hl=en&gl=us&pb=",
+		PbMessage()
+			.Enum(1, 3)
+			.Message(5, request)
+			.Message(6, PbMessage().Placeholder(1, 's').Enum(7, 81).Int(15, 11021))
+			.Message(9, PbMessage().Placeholder(2, 'd').Placeholder(3, 'd'))
+			.Placeholder(10, 'd'));
+}
+
+std::string preview_url(std::string client_id, int num_previews, double lat, double lng, int range) {
+	static const PbTemplate preview_template = make_preview_template();
+	return preview_template.Fill({ (int64_t)num_previews, client_id, lng, lat, (int64_t)range });
+}
+
+static PbTemplate make_photometa_template(int fields) {
+	PbMessage sections;
+	for(int section : { 1, 2, 3, 4, 5, 6, 8, 12 }) {
+		sections.Enum(1, section);
+	}
+	sections.Message(2, PbMessage().Enum(1, 1));
+	if(fields & PHOTOMETA_IMAGE) {
+		// Thumbnail size and the image formats, only needed to download the tiles
+		sections.Message(4, PbMessage().Int(1, 48));
+	}
+	sections.Message(5, PbMessage().Enum(1, 1))
+		.Message(5, PbMessage().Enum(1, 2))
+		.Message(6, PbMessage().Enum(1, 1))
+		.Message(6, PbMessage().Enum(1, 2));
+	if(fields & PHOTOMETA_IMAGE) {
+		PbMessage formats;
+		for(auto [type, flag, format] : std::initializer_list<std::tuple<int, bool, int>> {
+				{ 2, true, 2 }, { 2, false, 3 }, { 3, true, 2 }, { 3, false, 3 },
+				{ 8, false, 3 }, { 1, false, 3 }, { 4, false, 3 }, { 10, true, 2 },
+				{ 10, false, 3 } }) {
+			formats.Message(1, photo_filter(type, flag, format));
+		}
+		sections.Message(9, formats);
+	}
+
+	auto client = PbMessage()
+					  .String(1, "maps_sv.tactile")
+					  .Message(11, PbMessage().Message(2, PbMessage().Bool(1, true)));
+	return PbTemplate("https://www.google.com/maps/photometa/v1?authuser=0&hl=en&gl=us&pb=",
+		PbMessage()
+			.Message(1, client)
+			.Message(2, PbMessage().String(1, "en").String(2, "us"))
+			.Message(3, PbMessage().Message(1, PbMessage().Enum(1, 2).Placeholder(2, 's')))
+			.Message(4, sections));
+}
+
+std::string photometa_url(std::string panorama_id, int fields) {
+	// Encoded once for every combination of fields
+	static const auto photometa_templates = [] {
+		std::vector<PbTemplate> templates;
+		for(int fields = 0; fields <= PHOTOMETA_ALL; fields++) {
+			templates.push_back(make_photometa_template(fields));
+		}
+		return templates;
+	}();
+	return photometa_templates[fields & PHOTOMETA_ALL].Fill({ panorama_id });
+}
+
+std::string tile_url(std::string panorama_id, int x, int y, int streetview_zoom) {
+	return fmt::format(
+		"https://streetviewpixels-pa.googleapis.com/v1/tile?cb_client=maps_sv.tactile&panoid={}&x={}&"
+		"y={}&zoom={}&nbt=1&fover=2",
+		panorama_id, x, y, streetview_zoom);
+}
+
 rapidjson::Document download_preview_document(
 	CURL* curl_handle, std::string client_id, int num_previews, double lat, double lng, int range) {
 	CURLcode res;
 	auto photo_preview_download = download_from_url(
-		fmt::format(
-			"https://www.google.com/maps/rpc/photo/listentityphotos?authuser=0&hl=en&gl=us&pb=!1e3!5m54!2m2!1i203!2i100!3m3!2i{}"
-			"!"
-			"3s{}!5b1!7m42!1m3!1e1!2b0!3e3!1m3!1e2!2b1!3e2!1m3!1e2!2b0!3e3!1m3!"
-			"1e8!"
-			"2b0!3e3!1m3!1e10!2b0!3e3!1m3!1e10!2b1!3e2!1m3!1e9!2b1!3e2!1m3!"
-			"1e10!"
-			"2b0!"
-			"3e3!1m3!1e10!2b1!3e2!1m3!1e10!2b0!3e4!2b1!4b1!8m0!9b0!11m1!4b1!"
-			"6m3!"
-			"1s{}"
-			"!"
-			"7e81!15i11021!9m2!2d{}!3d{}!10d{}",
-			num_previews, MAPS_PREVIEW_ID, client_id, lng, lat, range),
-		curl_handle, &res, NULL);
+		preview_url(client_id, num_previews, lat, lng, range), curl_handle, &res, NULL);
 
 	// Parse into JSON
 	rapidjson::Document preview_document;
@@ -81,67 +327,447 @@ rapidjson::Document download_preview_document(
 	return preview_document;
 }
 
-rapidjson::Document download_photometa(
-	CURL* curl_handle, std::string client_id, std::string panorama_id) {
+// Cleared the first time a reduced response is missing something a caller needs
+static std::atomic<bool> photometa_selection = true;
 
-	CURLcode res;
-	auto photometa_url = fmt::format("https://www.google.com/maps/photometa/"
-									 "v1?authuser=0&hl=en&gl=us&pb=!1m4!1smaps_sv.tactile!11m2!"
-									 "2m1!"
-									 "1b1!2m2!1sen!2sus!3m3!1m2!1e2!2s{}!4m57!1e1!1e2!1e3!1e4!1e5!"
-									 "1e6!1e8!1e12!2m1!1e1!4m1!1i48!5m1!1e1!5m1!1e2!6m1!1e1!6m1!"
-									 "1e2!"
-									 "9m36!1m3!1e2!2b1!3e2!1m3!1e2!2b0!3e3!1m3!1e3!2b1!3e2!1m3!"
-									 "1e3!"
-									 "2b0!3e3!1m3!1e8!2b0!3e3!1m3!1e1!2b0!3e3!1m3!1e4!2b0!3e3!1m3!"
-									 "1e10!2b1!3e2!1m3!1e10!2b0!3e3",
-		panorama_id);
-	auto photometa_download
-		= download_from_url(photometa_url, curl_handle, &res, get_photometa_headers());
+int photometa_request_fields(int fields) {
+	return photometa_selection ? fields : PHOTOMETA_ALL;
+}
+
+bool accept_photometa(rapidjson::Document& photometa_document, int fields, size_t bytes) {
+	get_metrics()
+		.Histogram("photometa_bytes",
+			fields == PHOTOMETA_ALL ? "{fields=\"all\"}" : "{fields=\"selected\"}")
+		.Record(bytes);
+	if(fields == PHOTOMETA_ALL || !photometa_has_fields(photometa_document, 0)
+		|| photometa_has_fields(photometa_document, fields)) {
+		// Responses for missing panoramas are just as empty with everything requested
+		return true;
+	}
+	if(photometa_selection.exchange(false)) {
+		std::cerr << "Reduced photometa responses are incomplete, requesting everything"
+				  << std::endl;
+	}
+	return false;
+}
+
+rapidjson::Document download_photometa(
+	CURL* curl_handle, std::string client_id, std::string panorama_id, int fields) {
 	rapidjson::Document photometa_document;
-	photometa_document.Parse(photometa_download.substr(4));
+	fields = photometa_request_fields(fields);
+	while(true) {
+		CURLcode res;
+		auto photometa_download = download_from_url(
+			photometa_url(panorama_id, fields), curl_handle, &res, get_photometa_headers());
+		TraceSpan span("pipeline", "parse photometa");
+		photometa_document.Parse(photometa_download.substr(4));
+		if(accept_photometa(photometa_document, fields, photometa_download.size())) {
+			return photometa_document;
+		}
+		fields = PHOTOMETA_ALL;
+	}
+}
 
-	return photometa_document;
+static CURLSH* get_share_handle() {
+	static std::mutex share_locks[CURL_LOCK_DATA_LAST];
+	static CURLSH* share_handle = [] {
+		// Lets short lived tile handles reuse connections, DNS and TLS sessions
+		CURLSH* handle = curl_share_init();
+		curl_share_setopt(handle, CURLSHOPT_LOCKFUNC,
+			+[](CURL* curl_handle, curl_lock_data data, curl_lock_access access, void* userptr) {
+				share_locks[data].lock();
+			});
+		curl_share_setopt(handle, CURLSHOPT_UNLOCKFUNC,
+			+[](CURL* curl_handle, curl_lock_data data, void* userptr) {
+				share_locks[data].unlock();
+			});
+		curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+		curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+		return handle;
+	}();
+	return share_handle;
 }
 
-sk_sp<SkImage> download_panorama(CURL* curl_handle, std::string panorama_id, int streetview_zoom,
-	rapidjson::Document& photmeta_document) {
-	auto [tiles_width, tiles_height] = extract_tiles_dimensions(photmeta_document, streetview_zoom);
+struct TileRequest {
+	int x;
+	int y;
+	std::string data;
+	// Read by the progress callback to abort the slower of two hedged requests
+	std::atomic<bool> done = false;
+	int attempts           = 0;
+	int in_flight          = 0;
+	bool hedged            = false;
+	std::chrono::steady_clock::time_point started;
+};
 
-	sk_sp<SkSurface> tile_surface
-		= SkSurface::MakeRasterN32Premul(tiles_width * 512, tiles_height * 512);
+static int abort_finished_tile(void* clientp, curl_off_t dltotal, curl_off_t dlnow,
+	curl_off_t ultotal, curl_off_t ulnow) {
+	return static_cast<TileRequest*>(clientp)->done ? 1 : 0;
+}
 
-	// Start processing
-	tile_surface->getCanvas()->clear(SK_ColorWHITE);
-	for(int y = 0; y < tiles_height; y++) {
-		for(int x = 0; x < tiles_width; x++) {
-			// Download the specific tile
-			// Each tile takes around ~40ms to download
+// Download a set of tiles on several handles. Failed requests are only retried by
+// download_from_url, and a tile that takes much longer than its siblings gets a second, hedged
+// request, whichever finishes first wins.
+// Returns the encoded tile data in the same order, empty for tiles that could not be fetched
+static std::vector<std::string> download_tiles(CURL* curl_handle, std::string panorama_id,
+	int streetview_zoom, std::vector<std::pair<int, int>>& tiles) {
+	std::vector<TileRequest> requests(tiles.size());
+	for(int i = 0; i < tiles.size(); i++) {
+		requests[i].x = tiles[i].first;
+		requests[i].y = tiles[i].second;
+	}
+
+	std::mutex requests_m;
+	std::condition_variable requests_cv;
+	std::vector<double> latencies;
+	static auto& tiles_in_flight = get_metrics().Gauge("tiles_in_flight");
+	static auto& tile_hedges     = get_metrics().Counter("tile_hedges");
+
+	auto tile_thread = [&](CURL* handle) {
+		auto headers = get_panorama_headers();
+		std::unique_lock lock { requests_m };
+		while(true) {
+			// Median of finished tiles, hedge anything much slower than that
+			auto hedge_delay = std::chrono::milliseconds(MIN_HEDGE_DELAY_MS);
+			if(!latencies.empty()) {
+				auto median = latencies.begin() + latencies.size() / 2;
+				std::nth_element(latencies.begin(), median, latencies.end());
+				hedge_delay = std::max(hedge_delay, std::chrono::milliseconds((long)(*median * 3)));
+			}
+
+			auto now             = std::chrono::steady_clock::now();
+			TileRequest* request = nullptr;
+			bool pending         = false;
+			for(auto& candidate : requests) {
+				if(candidate.done) {
+					continue;
+				}
+				if(candidate.in_flight == 0 && candidate.attempts == 0) {
+					request = &candidate;
+					break;
+				}
+				pending |= candidate.in_flight > 0;
+			}
+			if(!request) {
+				for(auto& candidate : requests) {
+					if(!candidate.done && candidate.in_flight == 1 && !candidate.hedged
+						&& now - candidate.started > hedge_delay) {
+						request         = &candidate;
+						request->hedged = true;
+						break;
+					}
+				}
+			}
+
+			if(!request) {
+				if(!pending) {
+					// Every tile is either done or out of attempts
+					break;
+				}
+				requests_cv.wait_for(lock, std::chrono::milliseconds(50));
+				continue;
+			}
+
+			if(request->in_flight == 0) {
+				request->attempts++;
+				request->started = now;
+			}
+			request->in_flight++;
+			// Only the second request of a tile is the hedge
+			bool is_hedge = request->in_flight > 1;
+			tiles_in_flight.Add(1);
+			lock.unlock();
+
+			TraceSpan tile_span("tile", fmt::format("tile {},{}", request->x, request->y));
+			tile_span.Arg("hedge", is_hedge);
 			CURLcode res;
-			auto tile_url = fmt::format(
-				"https://streetviewpixels-pa.googleapis.com/v1/tile?cb_client=maps_sv.tactile&panoid={}&x={}&"
-				"y={}&zoom={}&nbt=1&fover=2",
-				panorama_id, x, y, streetview_zoom);
-			auto tile_download
-				= download_from_url(tile_url, curl_handle, &res, get_panorama_headers());
+			curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+			curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, abort_finished_tile);
+			curl_easy_setopt(handle, CURLOPT_XFERINFODATA, request);
+			auto url = tile_url(panorama_id, request->x, request->y, streetview_zoom);
+			auto tile_download = download_from_url(url, handle, &res, headers);
+			curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 1L);
 
+			long http_code = 0;
 			if(res == CURLE_OK) {
-				long http_code = 0;
-				curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
+				curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &http_code);
+			}
+
+			lock.lock();
+			tiles_in_flight.Add(-1);
+			request->in_flight--;
+			if(!request->done) {
 				if(http_code == 200) {
-					// Construct an image from the data
-					// This is less than 1ms
-					auto image = SkImage::MakeFromEncoded(
-						SkData::MakeWithoutCopy(tile_download.data(), tile_download.size()));
-					tile_surface->getCanvas()->drawImage(image, 512 * x, 512 * y);
-				} else {
+					request->data = std::move(tile_download);
+					request->done = true;
+					latencies.push_back(std::chrono::duration<double, std::milli>(
+						std::chrono::steady_clock::now() - request->started)
+											.count());
+					// The hedge beat the original request
+					if(is_hedge) {
+						tile_hedges.Add();
+					}
+				} else if(res == CURLE_OK && http_code != 404) {
 					std::cout << "Error code " << http_code << std::endl;
 				}
 			}
+			requests_cv.notify_all();
 		}
+		lock.unlock();
+		curl_slist_free_all(headers);
+	};
+
+	std::vector<std::thread> threads;
+	std::vector<CURL*> handles;
+	for(int i = 1; i < std::min<int>(TILE_THREADS, tiles.size()); i++) {
+		CURL* handle = curl_easy_init();
+		curl_easy_setopt(handle, CURLOPT_SHARE, get_share_handle());
+		handles.push_back(handle);
+		threads.push_back(std::thread(tile_thread, handle));
+	}
+	tile_thread(curl_handle);
+	for(auto& thread : threads) {
+		thread.join();
+	}
+	for(auto handle : handles) {
+		curl_easy_cleanup(handle);
 	}
 
-	return tile_surface->makeImageSnapshot();
+	std::vector<std::string> tile_data;
+	for(auto& request : requests) {
+		tile_data.push_back(std::move(request.data));
+	}
+	return tile_data;
+}
+
+// Pixels in an unlinked scratch file mapped into memory. Its pages live in the page cache, so
+// under memory pressure the kernel writes them out instead of the process running out of memory
+static bool allocate_scratch_pixels(SkBitmap& bitmap, SkImageInfo info) {
+	size_t row_bytes = info.minRowBytes();
+	size_t size      = info.computeByteSize(row_bytes);
+
+	std::string path = scratch_dir + "/panorama-XXXXXX";
+	int fd           = mkstemp(path.data());
+	if(fd == -1) {
+		return false;
+	}
+	// Removed once unmapped
+	unlink(path.c_str());
+	if(ftruncate(fd, size) != 0) {
+		close(fd);
+		return false;
+	}
+	void* pixels = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(pixels == MAP_FAILED) {
+		return false;
+	}
+	// Tiles are written once, then read front to back by the PNG encoder and the pyramid
+	madvise(pixels, size, MADV_SEQUENTIAL);
+
+	return bitmap.installPixels(
+		info, pixels, row_bytes,
+		[](void* pixels, void* size) { munmap(pixels, (size_t)size); }, (void*)size);
+}
+
+size_t estimate_stitch_bytes(TilePlan& plan) {
+	size_t bytes = plan.NumTiles() * TILE_BYTES_ESTIMATE;
+	if(scratch_dir.empty()) {
+		bytes += (size_t)plan.width * plan.height * 4;
+	}
+	return bytes;
+}
+
+SkBitmap allocate_panorama(TilePlan& plan, bool transparent_background) {
+	// Output is exactly the valid pixels, partial edge tiles are clipped when decoding
+	auto info = SkImageInfo::MakeN32Premul(plan.width, plan.height);
+	SkBitmap panorama;
+	if(!scratch_dir.empty()) {
+		if(allocate_scratch_pixels(panorama, info)) {
+			// A new file is already zero, which is transparent
+			if(!transparent_background) {
+				panorama.eraseColor(SK_ColorWHITE);
+			}
+			return panorama;
+		}
+		std::cerr << "Could not map a scratch file in " << scratch_dir << ", using memory"
+				  << std::endl;
+	}
+
+	panorama.allocPixels(info);
+	// A transparent background leaves missing tiles as a mask in the alpha channel
+	panorama.eraseColor(transparent_background ? SK_ColorTRANSPARENT : SK_ColorWHITE);
+	return panorama;
+}
+
+bool decode_tile(SkBitmap& panorama, TileCompleteness& completeness, int x, int y,
+	std::string& tile_data, SkColor background) {
+	static auto& decode_us = get_metrics().Histogram("tile_decode_us");
+	MetricsTimer decode_timer(decode_us);
+	auto codec = SkCodec::MakeFromData(SkData::MakeWithoutCopy(tile_data.data(), tile_data.size()));
+	if(!codec) {
+		return false;
+	}
+
+	auto tile_rect = SkIRect::MakeXYWH(completeness.tile_width * x, completeness.tile_height * y,
+		codec->dimensions().width(), codec->dimensions().height());
+	SkIRect visible_rect;
+	if(!visible_rect.intersect(tile_rect, SkIRect::MakeWH(panorama.width(), panorama.height()))) {
+		return false;
+	}
+
+	SkPixmap destination;
+	panorama.pixmap().extractSubset(&destination, visible_rect);
+	SkCodec::Result result;
+	if(visible_rect == tile_rect) {
+		// Decode in place, the codec writes rows straight into the panorama
+		result = codec->getPixels(destination);
+	} else {
+		// Edge tiles hanging past the panorama, decode whole and copy the visible part
+		SkBitmap tile;
+		tile.allocPixels(panorama.info().makeWH(tile_rect.width(), tile_rect.height()));
+		result = codec->getPixels(tile.pixmap());
+		if(result == SkCodec::kSuccess) {
+			tile.pixmap().readPixels(destination);
+		}
+	}
+
+	if(result != SkCodec::kSuccess) {
+		// Corrupt tiles may have been partially written
+		destination.erase(background);
+		return false;
+	}
+	return true;
+}
+
+// Decode downloaded tiles into the panorama on the available cores and mark them in the
+// completeness bitmap
+static void decode_tiles(SkBitmap& panorama, std::vector<std::pair<int, int>>& tiles,
+	std::vector<std::string>& tile_data, TileCompleteness& completeness, SkColor background) {
+	MetricsTimer stitch_timer(get_metrics().Histogram("stitch_us"));
+	TraceSpan span("pipeline", "stitch");
+	span.Arg("tiles", tiles.size());
+
+	// Panoramas decoded at the same time, from preloader threads for example, split the cores
+	// between them. The CPU pool already keeps every core busy, there the tiles are decoded on
+	// the calling thread
+	static std::atomic<int> active_decodes = 0;
+	int num_decodes = ++active_decodes;
+	int num_cores   = std::max(1u, std::thread::hardware_concurrency());
+	// Helpers besides the calling thread
+	int num_threads = std::min<int>(tiles.size(), std::max(1, num_cores / num_decodes) - 1);
+	if(AsyncRuntime::OnCpuPool()) {
+		num_threads = 0;
+	}
+
+	// Completeness is a vector<bool>, only written once every thread is done
+	std::vector<char> decoded(tiles.size(), false);
+	std::atomic<int> next_tile = 0;
+	auto decode_next           = [&] {
+		for(int i = next_tile++; i < tiles.size(); i = next_tile++) {
+			auto [x, y] = tiles[i];
+			decoded[i]  = !tile_data[i].empty()
+						 && decode_tile(panorama, completeness, x, y, tile_data[i], background);
+		}
+	};
+	std::vector<std::thread> threads;
+	for(int t = 0; t < num_threads; t++) {
+		threads.push_back(std::thread(decode_next));
+	}
+	decode_next();
+	for(auto& thread : threads) {
+		thread.join();
+	}
+	active_decodes--;
+
+	for(int i = 0; i < tiles.size(); i++) {
+		if(decoded[i]) {
+			auto [x, y] = tiles[i];
+			completeness.tiles[y * completeness.tiles_width + x] = true;
+		}
+	}
+}
+
+sk_sp<SkImage> stitch_tiles(TilePlan& plan, std::vector<std::pair<int, int>>& tiles,
+	std::vector<std::string>& tile_data, TileCompleteness& completeness,
+	bool transparent_background) {
+	auto panorama = allocate_panorama(plan, transparent_background);
+	decode_tiles(panorama, tiles, tile_data, completeness,
+		transparent_background ? SK_ColorTRANSPARENT : SK_ColorWHITE);
+
+	// Shares the pixels instead of copying them
+	panorama.setImmutable();
+	return panorama.asImage();
+}
+
+sk_sp<SkImage> download_panorama(CURL* curl_handle, std::string panorama_id, int streetview_zoom,
+	rapidjson::Document& photmeta_document, TileCompleteness* completeness,
+	bool transparent_background) {
+	auto plan               = extract_tile_plan(photmeta_document, streetview_zoom);
+	auto tiles_completeness = TileCompleteness::FromPlan(plan);
+
+	// Every tile is held until stitching, the image belongs to the caller afterwards
+	size_t memory_bytes = estimate_stitch_bytes(plan);
+	get_memory_budget().Reserve(memory_bytes);
+
+	// Each tile takes around ~40ms to download
+	auto tiles     = tiles_completeness.Missing();
+	auto tile_data = download_tiles(curl_handle, panorama_id, plan.zoom, tiles);
+	auto image
+		= stitch_tiles(plan, tiles, tile_data, tiles_completeness, transparent_background);
+	get_memory_budget().Release(memory_bytes);
+
+	if(completeness) {
+		*completeness = tiles_completeness;
+	}
+	return image;
+}
+
+sk_sp<SkImage> repair_panorama(
+	CURL* curl_handle, std::string panorama_id, sk_sp<SkImage> image, TileCompleteness& completeness) {
+	SkBitmap panorama;
+	panorama.allocPixels(SkImageInfo::MakeN32Premul(image->width(), image->height()));
+	image->readPixels(panorama.pixmap(), 0, 0);
+
+	// Only the tiles that failed last time
+	auto tiles     = completeness.Missing();
+	auto tile_data = download_tiles(curl_handle, panorama_id, completeness.zoom, tiles);
+	decode_tiles(panorama, tiles, tile_data, completeness, SK_ColorTRANSPARENT);
+
+	panorama.setImmutable();
+	return panorama.asImage();
+}
+
+TileCompleteness TileCompleteness::FromPlan(TilePlan& plan) {
+	TileCompleteness completeness;
+	completeness.zoom         = plan.zoom;
+	completeness.tile_width   = plan.tile_width;
+	completeness.tile_height  = plan.tile_height;
+	completeness.tiles_width  = plan.tiles_x;
+	completeness.tiles_height = plan.tiles_y;
+	completeness.tiles.assign(plan.NumTiles(), false);
+	return completeness;
+}
+
+bool TileCompleteness::IsComplete() {
+	return NumMissing() == 0;
+}
+
+int TileCompleteness::NumMissing() {
+	return std::count(tiles.begin(), tiles.end(), false);
+}
+
+std::vector<std::pair<int, int>> TileCompleteness::Missing() {
+	std::vector<std::pair<int, int>> missing;
+	for(int y = 0; y < tiles_height; y++) {
+		for(int x = 0; x < tiles_width; x++) {
+			if(!tiles[y * tiles_width + x]) {
+				missing.push_back(std::make_pair(x, y));
+			}
+		}
+	}
+	return missing;
 }
 
 std::vector<Panorama> get_infos(
@@ -149,7 +775,7 @@ std::vector<Panorama> get_infos(
 	std::vector<Panorama> infos;
 	for(auto& id : ids) {
 		// Get photometa
-		auto photometa_document = download_photometa(curl_handle, client_id, id);
+		auto photometa_document = download_photometa(curl_handle, client_id, id, PHOTOMETA_INFO);
 
 		// Get info
 		auto panorama_info = extract_info(photometa_document);
@@ -1,22 +1,79 @@
 #pragma once
 
+#include <core/SkBitmap.h>
 #include <core/SkCanvas.h>
 #include <core/SkSurface.h>
 #include <curl/curl.h>
 #include <rapidjson/document.h>
 
+#include <chrono>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "extract.hpp"
 
+#define MAX_REQUEST_ATTEMPTS 5
+// A tile is hedged once it takes three times the median of its panorama, and never before this
+#define MIN_HEDGE_DELAY_MS 500
+
+// Which tiles of a stitched panorama were actually drawn, row major
+struct TileCompleteness {
+	int zoom         = 0;
+	int tile_width   = 512;
+	int tile_height  = 512;
+	int tiles_width  = 0;
+	int tiles_height = 0;
+	std::vector<bool> tiles;
+
+	static TileCompleteness FromPlan(TilePlan& plan);
+
+	bool IsComplete();
+	int NumMissing();
+	std::vector<std::pair<int, int>> Missing();
+};
+
+void set_endpoint_override(std::string endpoint);
+// Back stitched panoramas with files in this directory instead of the heap
+void set_scratch_dir(std::string dir);
+// Label for metrics and traces, one per endpoint
+const char* request_type(std::string& url);
+// Rewrites the URL to the endpoint override, returns the original host for rate limiting
+std::string apply_endpoint_override(std::string& url);
+// Records metrics and releases the rate limit slot, returns true if the request should be retried
+bool finish_request(std::string& url, std::string& host, CURLcode res, long http_code,
+	curl_off_t retry_after, std::chrono::steady_clock::time_point start, size_t bytes);
+std::string preview_url(std::string client_id, int num_previews, double lat, double lng, int range);
+std::string photometa_url(std::string panorama_id, int fields = PHOTOMETA_ALL);
+std::string tile_url(std::string panorama_id, int x, int y, int streetview_zoom);
 std::string download_from_url(
 	std::string url, CURL* curl_handle, CURLcode* res, curl_slist* headers);
 std::string download_client_id(CURL* curl_handle);
 rapidjson::Document download_preview_document(
 	CURL* curl_handle, std::string client_id, int num_previews, double lat, double lng, int range);
-rapidjson::Document download_photometa(
-	CURL* curl_handle, std::string client_id, std::string panorama_id);
+// Fields to request, everything once a reduced response turned out to be missing some
+int photometa_request_fields(int fields);
+// Records the response size, false if a reduced response lacks fields and has to be requested
+// again with everything. Reduced requests are not tried again after that
+bool accept_photometa(rapidjson::Document& photometa_document, int fields, size_t bytes);
+rapidjson::Document download_photometa(CURL* curl_handle, std::string client_id,
+	std::string panorama_id, int fields = PHOTOMETA_ALL);
 sk_sp<SkImage> download_panorama(CURL* curl_handle, std::string panorama_id, int streetview_zoom,
-	rapidjson::Document& photmeta_document);
+	rapidjson::Document& photmeta_document, TileCompleteness* completeness = nullptr,
+	bool transparent_background = false);
+// Memory held while the tiles of a plan are downloaded and stitched, for MemoryBudget. The
+// raster is left out when it is backed by a scratch file
+size_t estimate_stitch_bytes(TilePlan& plan);
+// Pixels of a whole panorama, cleared to white or transparent, tiles are decoded straight into it
+SkBitmap allocate_panorama(TilePlan& plan, bool transparent_background);
+// Decodes a tile into its place in the panorama without an intermediate image, different tiles
+// can be decoded on different threads at once. On failure the tile is cleared to background
+bool decode_tile(SkBitmap& panorama, TileCompleteness& completeness, int x, int y,
+	std::string& tile_data, SkColor background);
+sk_sp<SkImage> stitch_tiles(TilePlan& plan, std::vector<std::pair<int, int>>& tiles,
+	std::vector<std::string>& tile_data, TileCompleteness& completeness,
+	bool transparent_background);
+sk_sp<SkImage> repair_panorama(
+	CURL* curl_handle, std::string panorama_id, sk_sp<SkImage> image, TileCompleteness& completeness);
 std::vector<Panorama> get_infos(
 	CURL* curl_handle, std::string client_id, std::vector<std::string>& ids);
\ No newline at end of file
@@ -2,6 +2,9 @@
 
 #define _USE_MATH_DEFINES
 #define DEG_RAD 0.0174533
+#define METERS_PER_LAT_DEGREE 111320.0
+// Street View goes up to 5, anything far past that is a malformed response
+#define MAX_TILE_ZOOM 10
 
 #include <fmt/format.h>
 #include <rapidjson/prettywriter.h>
@@ -9,8 +12,11 @@
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 
+#include <algorithm>
 #include <cmath>
+#include <initializer_list>
 #include <iostream>
+#include <numeric>
 
 std::vector<std::string> extract_panorama_ids(rapidjson::Document& preview_document) {
 	std::vector<std::string> ids;
@@ -80,12 +86,64 @@ std::vector<Panorama> extract_adjacent_panoramas(rapidjson::Document& photometa_
 	return panoramas;
 }
 
-std::pair<double, double> extract_tiles_dimensions(
-	rapidjson::Document& photometa_document, int streetview_zoom) {
-	auto& tiles_dimensions = photometa_document[1][0][2][2];
-	double tiles_width     = tiles_dimensions[1].GetInt() / 512 / pow(2, 5 - streetview_zoom);
-	double tiles_height    = tiles_dimensions[0].GetInt() / 512 / pow(2, 5 - streetview_zoom);
-	return std::make_pair(tiles_width, tiles_height);
+// Element at the path if every step along it is an array long enough
+static rapidjson::Value* find_path(rapidjson::Value& value, std::initializer_list<int> path) {
+	auto current = &value;
+	for(int index : path) {
+		if(!current->IsArray() || current->Size() <= index) {
+			return nullptr;
+		}
+		current = &(*current)[index];
+	}
+	return current;
+}
+
+TilePlan extract_tile_plan(rapidjson::Document& photometa_document, int streetview_zoom) {
+	auto& image_info = photometa_document[1][0][2];
+	// Full resolution as height, width
+	auto& full_dimensions = image_info[2];
+	int full_width        = full_dimensions[1].GetInt();
+	int full_height       = full_dimensions[0].GetInt();
+
+	// Height and width, both positive
+	auto valid_size = [](rapidjson::Value* size) {
+		return size && size->Size() == 2 && (*size)[0].IsInt() && (*size)[1].IsInt()
+			   && (*size)[0].GetInt() > 0 && (*size)[1].GetInt() > 0;
+	};
+
+	TilePlan plan;
+	// Malformed sizes keep the default 512
+	auto tile_size = find_path(image_info, { 3, 1 });
+	if(valid_size(tile_size)) {
+		plan.tile_width  = (*tile_size)[1].GetInt();
+		plan.tile_height = (*tile_size)[0].GetInt();
+	}
+
+	// Each zoom level halves the resolution, the highest is the first whose tiles cover the
+	// full width. Usually 5 for 13312 wide panoramas but lower for older or user panoramas
+	plan.max_zoom = 0;
+	while(plan.max_zoom < MAX_TILE_ZOOM
+		  && ((long long)plan.tile_width << plan.max_zoom) < full_width) {
+		plan.max_zoom++;
+	}
+	plan.zoom = std::clamp(streetview_zoom, 0, plan.max_zoom);
+
+	// Prefer the per zoom sizes in the photometa when they are present
+	int shift   = plan.max_zoom - plan.zoom;
+	plan.width  = (full_width + (1 << shift) - 1) >> shift;
+	plan.height = (full_height + (1 << shift) - 1) >> shift;
+	auto levels = find_path(image_info, { 3, 0 });
+	if(levels && levels->Size() == plan.max_zoom + 1) {
+		auto zoom_dimensions = find_path(*levels, { plan.zoom, 0 });
+		if(valid_size(zoom_dimensions)) {
+			plan.width  = (*zoom_dimensions)[1].GetInt();
+			plan.height = (*zoom_dimensions)[0].GetInt();
+		}
+	}
+
+	plan.tiles_x = (plan.width + plan.tile_width - 1) / plan.tile_width;
+	plan.tiles_y = (plan.height + plan.tile_height - 1) / plan.tile_height;
+	return plan;
 }
 
 bool valid_photometa(rapidjson::Document& photometa_document) {
@@ -93,20 +151,90 @@ bool valid_photometa(rapidjson::Document& photometa_document) {
 	return photometa_document.Size() > 0;
 }
 
+bool photometa_has_fields(rapidjson::Document& photometa_document, int fields) {
+	auto panorama = find_path(photometa_document, { 1, 0 });
+	if(!panorama) {
+		return false;
+	}
+	if(fields & PHOTOMETA_INFO) {
+		auto position = find_path(*panorama, { 5, 0, 1 });
+		if(!find_path(*panorama, { 1, 1 }) || !find_path(*panorama, { 6, 7, 1 }) || !position
+			|| position->Size() <= 2) {
+			return false;
+		}
+	}
+	if((fields & PHOTOMETA_LINKS) && !find_path(*panorama, { 5, 0, 3, 0 })) {
+		return false;
+	}
+	if((fields & PHOTOMETA_LOCATION) && !find_path(*panorama, { 3 })) {
+		return false;
+	}
+	if((fields & PHOTOMETA_IMAGE) && !find_path(*panorama, { 2, 2, 1 })) {
+		return false;
+	}
+	return true;
+}
+
+PanoramaColumns::PanoramaColumns(std::vector<Panorama>& panoramas) {
+	lat.resize(panoramas.size());
+	lng.resize(panoramas.size());
+	year.resize(panoramas.size());
+	month.resize(panoramas.size());
+	for(int i = 0; i < panoramas.size(); i++) {
+		lat[i]   = panoramas[i].lat;
+		lng[i]   = panoramas[i].lng;
+		year[i]  = panoramas[i].year;
+		month[i] = panoramas[i].month;
+	}
+}
+
 double center_distance(double lat, double lng, Panorama& panorama) {
-	return std::sqrt(std::pow(panorama.lat - lat, 2) + std::pow(panorama.lng - lng, 2));
+	double north = (panorama.lat - lat) * METERS_PER_LAT_DEGREE;
+	double east  = (panorama.lng - lng) * METERS_PER_LAT_DEGREE * std::cos(lat * DEG_RAD);
+	return std::sqrt(north * north + east * east);
+}
+
+// The loops below have no branches or calls so they are vectorized, the cosine is only
+// taken once for the center and the distances stay squared to avoid the square root
+
+void squared_distances(double lat, double lng, PanoramaColumns& columns, double* distances) {
+	double meters_per_lng_degree = METERS_PER_LAT_DEGREE * std::cos(lat * DEG_RAD);
+	const double* lats           = columns.lat.data();
+	const double* lngs           = columns.lng.data();
+	size_t size                  = columns.Size();
+	for(size_t i = 0; i < size; i++) {
+		double north = (lats[i] - lat) * METERS_PER_LAT_DEGREE;
+		double east  = (lngs[i] - lng) * meters_per_lng_degree;
+		distances[i] = north * north + east * east;
+	}
+}
+
+void select_within_distance_and_date(double lat, double lng, double radius, int year_start,
+	int year_end, int month_start, int month_end, PanoramaColumns& columns, uint8_t* selected) {
+	double meters_per_lng_degree = METERS_PER_LAT_DEGREE * std::cos(lat * DEG_RAD);
+	double radius_squared        = radius * radius;
+	const double* lats           = columns.lat.data();
+	const double* lngs           = columns.lng.data();
+	const int* years             = columns.year.data();
+	const int* months            = columns.month.data();
+	size_t size                  = columns.Size();
+	for(size_t i = 0; i < size; i++) {
+		double north = (lats[i] - lat) * METERS_PER_LAT_DEGREE;
+		double east  = (lngs[i] - lng) * meters_per_lng_degree;
+		// Bitwise and, every condition is evaluated
+		selected[i] = (north * north + east * east <= radius_squared) & (months[i] >= month_start)
+					  & (months[i] <= month_end) & (years[i] >= year_start)
+					  & (years[i] <= year_end);
+	}
 }
 
 int num_within_distance_and_date(double lat, double lng, double radius, int year_start,
 	int year_end, int month_start, int month_end, std::vector<Panorama>& panoramas) {
-	int num = 0;
-	for(auto& panorama : panoramas) {
-		if(is_within_distance_and_date(
-			   lat, lng, radius, year_start, year_end, month_start, month_end, panorama)) {
-			num++;
-		}
-	}
-	return num;
+	PanoramaColumns columns(panoramas);
+	std::vector<uint8_t> selected(columns.Size());
+	select_within_distance_and_date(lat, lng, radius, year_start, year_end, month_start,
+		month_end, columns, selected.data());
+	return std::accumulate(selected.begin(), selected.end(), 0);
 }
 
 bool is_within_distance_and_date(double lat, double lng, double radius, int year_start,
@@ -124,9 +252,22 @@ bool is_within_date(
 }
 
 void sort_by_distance(double lat, double lng, std::vector<Panorama>& panoramas) {
-	std::sort(panoramas.begin(), panoramas.end(), [&](Panorama& a, Panorama& b) {
-		return center_distance(lat, lng, a) < center_distance(lat, lng, b);
-	});
+	// Every distance is computed once instead of on every comparison
+	PanoramaColumns columns(panoramas);
+	std::vector<double> distances(columns.Size());
+	squared_distances(lat, lng, columns, distances.data());
+
+	std::vector<int> order(panoramas.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(),
+		[&](int a, int b) { return distances[a] < distances[b]; });
+
+	std::vector<Panorama> sorted;
+	sorted.reserve(panoramas.size());
+	for(int index : order) {
+		sorted.push_back(std::move(panoramas[index]));
+	}
+	panoramas = std::move(sorted);
 }
 
 bool is_date_specified(int year_start, int year_end, int month_start, int month_end) {
@@ -2,6 +2,7 @@
 
 #include <rapidjson/document.h>
 
+#include <cstdint>
 #include <string>
 #include <utility>
 #include <vector>
@@ -22,14 +23,66 @@ struct Panorama {
 	std::string id;
 };
 
+// Positions and dates of panoramas in separate arrays, so filters over many of them are
+// vectorized loops over only the fields they read
+struct PanoramaColumns {
+	std::vector<double> lat;
+	std::vector<double> lng;
+	std::vector<int> year;
+	std::vector<int> month;
+
+	PanoramaColumns(std::vector<Panorama>& panoramas);
+	size_t Size() {
+		return lat.size();
+	}
+};
+
+// Exact tile grid of one zoom level. Sizes are the valid pixels at that zoom, the last column
+// and row of tiles may only be partially covered
+struct TilePlan {
+	int zoom;
+	int max_zoom;
+	int width;
+	int height;
+	int tile_width  = 512;
+	int tile_height = 512;
+	int tiles_x;
+	int tiles_y;
+
+	bool HasTile(int x, int y) {
+		return x >= 0 && y >= 0 && x < tiles_x && y < tiles_y;
+	}
+	int NumTiles() {
+		return tiles_x * tiles_y;
+	}
+};
+
+// Parts of a photometa response a caller needs, leaving out the image makes responses smaller
+enum PhotometaFields {
+	PHOTOMETA_INFO     = 1,
+	PHOTOMETA_LINKS    = 2,
+	PHOTOMETA_LOCATION = 4,
+	PHOTOMETA_IMAGE    = 8,
+	PHOTOMETA_ALL      = 15,
+};
+
 std::vector<std::string> extract_panorama_ids(rapidjson::Document& preview_document);
 Panorama extract_info(rapidjson::Document& photometa_document);
 Location extract_location(rapidjson::Document& photometa_document);
 std::vector<Panorama> extract_adjacent_panoramas(rapidjson::Document& photometa_document);
-std::pair<double, double> extract_tiles_dimensions(
-	rapidjson::Document& photometa_document, int streetview_zoom);
+TilePlan extract_tile_plan(rapidjson::Document& photometa_document, int streetview_zoom);
 bool valid_photometa(rapidjson::Document& photometa_document);
+// Whether everything the extract functions read for these fields is present, with no fields
+// only whether the response describes a panorama at all
+bool photometa_has_fields(rapidjson::Document& photometa_document, int fields);
+// Distances in meters use an equirectangular approximation around the center, accurate to well
+// under a percent within tens of kilometers
 double center_distance(double lat, double lng, Panorama& panorama);
+// Squared distance in meters from the center to each panorama
+void squared_distances(double lat, double lng, PanoramaColumns& columns, double* distances);
+// Radius and date checks fused into one pass, 1 for every panorama within both
+void select_within_distance_and_date(double lat, double lng, double radius, int year_start,
+	int year_end, int month_start, int month_end, PanoramaColumns& columns, uint8_t* selected);
 int num_within_distance_and_date(double lat, double lng, double radius, int year_start,
 	int year_end, int month_start, int month_end, std::vector<Panorama>& panoramas);
 bool is_within_distance_and_date(double lat, double lng, double radius, int year_start,
@@ -0,0 +1,389 @@
+#include "graph.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <queue>
+
+#define GRAPH_MAGIC "SVGRAPH\1"
+#define METERS_PER_LAT_DEGREE 111320.0
+#define DEG_RAD 0.0174533
+#define PI 3.14159265358979323846
+// Street View IDs are 22 characters, user panoramas a few dozen
+#define MAX_GRAPH_ID_LENGTH 1024
+// Saved node with an empty ID: length, lat, lng, yaw, year, month, expanded
+#define MIN_NODE_BYTES (4 + 3 * 8 + 2 * 4 + 1)
+// Saved edge: to, bearing, distance
+#define EDGE_BYTES 12
+
+template <typename T> static void write_value(std::ofstream& file, T value) {
+	file.write((const char*)&value, sizeof(T));
+}
+
+template <typename T> static T read_value(std::ifstream& file) {
+	T value {};
+	file.read((char*)&value, sizeof(T));
+	return value;
+}
+
+static double angle_difference(double a, double b) {
+	double difference = std::fmod(std::abs(a - b), 2 * PI);
+	return difference > PI ? 2 * PI - difference : difference;
+}
+
+std::optional<uint32_t> PanoramaGraph::Find(std::string id) {
+	auto found = index.find(id);
+	if(found == index.end()) {
+		return std::nullopt;
+	}
+	return found->second;
+}
+
+uint32_t PanoramaGraph::AddNode(Panorama& panorama) {
+	auto found = index.find(panorama.id);
+	if(found != index.end()) {
+		auto& node = nodes[found->second];
+		node.lat   = panorama.lat;
+		node.lng   = panorama.lng;
+		node.yaw   = panorama.yaw;
+		// Adjacent panoramas don't come with a date
+		if(panorama.year) {
+			node.year  = panorama.year;
+			node.month = panorama.month;
+		}
+		return found->second;
+	}
+
+	uint32_t node = nodes.size();
+	nodes.push_back(Node {
+		.id    = panorama.id,
+		.lat   = panorama.lat,
+		.lng   = panorama.lng,
+		.yaw   = panorama.yaw,
+		.year  = panorama.year,
+		.month = panorama.month,
+	});
+	index[panorama.id] = node;
+	// No compressed edges yet
+	offsets.push_back(offsets.back());
+	return node;
+}
+
+void PanoramaGraph::AddEdge(uint32_t from, uint32_t to) {
+	for(auto& edge : GetEdges(from)) {
+		if(edge.to == to) {
+			return;
+		}
+	}
+	auto& buffer = pending[from];
+	for(auto& edge : buffer) {
+		if(edge.to == to) {
+			return;
+		}
+	}
+
+	// Equirectangular, links are a few meters long
+	double north = (nodes[to].lat - nodes[from].lat) * METERS_PER_LAT_DEGREE;
+	double east  = (nodes[to].lng - nodes[from].lng) * METERS_PER_LAT_DEGREE
+				  * std::cos(nodes[from].lat * DEG_RAD);
+	double bearing = std::atan2(east, north);
+	if(bearing < 0) {
+		bearing += 2 * PI;
+	}
+	buffer.push_back(Edge {
+		.to       = to,
+		.bearing  = (float)bearing,
+		.distance = (float)std::sqrt(north * north + east * east),
+	});
+}
+
+void PanoramaGraph::Insert(Panorama& panorama, std::vector<Panorama>& adjacent) {
+	uint32_t from        = AddNode(panorama);
+	nodes[from].expanded = true;
+	for(auto& other : adjacent) {
+		uint32_t to = AddNode(other);
+		AddEdge(from, to);
+		AddEdge(to, from);
+	}
+}
+
+void PanoramaGraph::Compact() {
+	if(pending.empty()) {
+		return;
+	}
+
+	size_t num_pending = 0;
+	for(auto& [node, buffer] : pending) {
+		num_pending += buffer.size();
+	}
+
+	std::vector<uint32_t> new_offsets(nodes.size() + 1);
+	std::vector<Edge> new_edges;
+	new_edges.reserve(edges.size() + num_pending);
+	for(uint32_t node = 0; node < nodes.size(); node++) {
+		new_offsets[node] = new_edges.size();
+		new_edges.insert(
+			new_edges.end(), edges.begin() + offsets[node], edges.begin() + offsets[node + 1]);
+		auto buffer = pending.find(node);
+		if(buffer != pending.end()) {
+			new_edges.insert(new_edges.end(), buffer->second.begin(), buffer->second.end());
+		}
+	}
+	new_offsets[nodes.size()] = new_edges.size();
+
+	offsets = std::move(new_offsets);
+	edges   = std::move(new_edges);
+	pending.clear();
+}
+
+std::span<const PanoramaGraph::Edge> PanoramaGraph::GetEdges(uint32_t node) {
+	// Only compacted edges, AddEdge checks the buffer itself
+	return std::span<const Edge>(edges.data() + offsets[node], offsets[node + 1] - offsets[node]);
+}
+
+size_t PanoramaGraph::NumEdges() {
+	Compact();
+	return edges.size();
+}
+
+Panorama PanoramaGraph::GetPanorama(uint32_t node) {
+	auto& info = nodes[node];
+	Panorama panorama;
+	panorama.id    = info.id;
+	panorama.lat   = info.lat;
+	panorama.lng   = info.lng;
+	panorama.yaw   = info.yaw;
+	panorama.pitch = 0;
+	panorama.roll  = 0;
+	panorama.year  = info.year;
+	panorama.month = info.month;
+	return panorama;
+}
+
+std::vector<Panorama> PanoramaGraph::GetAdjacent(uint32_t node) {
+	Compact();
+	std::vector<Panorama> adjacent;
+	for(auto& edge : GetEdges(node)) {
+		adjacent.push_back(GetPanorama(edge.to));
+	}
+	return adjacent;
+}
+
+std::vector<uint32_t> PanoramaGraph::Bfs(uint32_t start, int max_depth) {
+	Compact();
+	std::vector<int> depth(nodes.size(), -1);
+	std::vector<uint32_t> order { start };
+	depth[start] = 0;
+	for(size_t i = 0; i < order.size(); i++) {
+		uint32_t node = order[i];
+		if(depth[node] == max_depth) {
+			continue;
+		}
+		for(auto& edge : GetEdges(node)) {
+			if(depth[edge.to] == -1) {
+				depth[edge.to] = depth[node] + 1;
+				order.push_back(edge.to);
+			}
+		}
+	}
+	return order;
+}
+
+std::vector<uint32_t> PanoramaGraph::ShortestPath(uint32_t from, uint32_t to) {
+	Compact();
+	std::vector<float> distance(nodes.size(), std::numeric_limits<float>::infinity());
+	std::vector<uint32_t> previous(nodes.size(), UINT32_MAX);
+	using QueueEntry = std::pair<float, uint32_t>;
+	std::priority_queue<QueueEntry, std::vector<QueueEntry>, std::greater<QueueEntry>> queue;
+
+	distance[from] = 0;
+	queue.push(std::make_pair(0.0f, from));
+	while(!queue.empty()) {
+		auto [node_distance, node] = queue.top();
+		queue.pop();
+		if(node == to) {
+			break;
+		}
+		if(node_distance > distance[node]) {
+			continue;
+		}
+		for(auto& edge : GetEdges(node)) {
+			float next = node_distance + edge.distance;
+			if(next < distance[edge.to]) {
+				distance[edge.to] = next;
+				previous[edge.to] = node;
+				queue.push(std::make_pair(next, edge.to));
+			}
+		}
+	}
+
+	std::vector<uint32_t> path;
+	if(from != to && previous[to] == UINT32_MAX) {
+		return path;
+	}
+	for(uint32_t node = to; node != from; node = previous[node]) {
+		path.push_back(node);
+	}
+	path.push_back(from);
+	std::reverse(path.begin(), path.end());
+	return path;
+}
+
+std::vector<uint32_t> PanoramaGraph::Walk(
+	uint32_t start, double heading, double max_turn, int max_steps) {
+	Compact();
+	std::vector<uint32_t> path { start };
+	std::vector<bool> visited(nodes.size(), false);
+	visited[start] = true;
+
+	uint32_t node = start;
+	for(int step = 0; step < max_steps; step++) {
+		const Edge* best = nullptr;
+		for(auto& edge : GetEdges(node)) {
+			double turn = angle_difference(edge.bearing, heading);
+			if(!visited[edge.to] && turn <= max_turn
+				&& (!best || turn < angle_difference(best->bearing, heading))) {
+				best = &edge;
+			}
+		}
+		if(!best) {
+			break;
+		}
+
+		// Follow the road as it bends
+		heading       = best->bearing;
+		node          = best->to;
+		visited[node] = true;
+		path.push_back(node);
+	}
+	return path;
+}
+
+// Layout, little endian:
+//   "SVGRAPH\1", u32 num_nodes, per node u32 id length, id, f64 lat, lng, yaw, i32 year,
+//   month, u8 expanded, then u32 offsets[num_nodes + 1], then per edge u32 to, f32 bearing,
+//   f32 distance
+bool PanoramaGraph::Save(std::string path) {
+	Compact();
+	std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+	if(!file.is_open()) {
+		std::cerr << "Could not write graph " << path << std::endl;
+		return false;
+	}
+
+	file.write(GRAPH_MAGIC, 8);
+	write_value<uint32_t>(file, nodes.size());
+	for(auto& node : nodes) {
+		write_value<uint32_t>(file, node.id.size());
+		file.write(node.id.data(), node.id.size());
+		write_value<double>(file, node.lat);
+		write_value<double>(file, node.lng);
+		write_value<double>(file, node.yaw);
+		write_value<int32_t>(file, node.year);
+		write_value<int32_t>(file, node.month);
+		write_value<uint8_t>(file, node.expanded);
+	}
+	file.write((const char*)offsets.data(), offsets.size() * sizeof(uint32_t));
+	for(auto& edge : edges) {
+		write_value<uint32_t>(file, edge.to);
+		write_value<float>(file, edge.bearing);
+		write_value<float>(file, edge.distance);
+	}
+	return file.good();
+}
+
+bool PanoramaGraph::Load(std::string path) {
+	std::ifstream file(path, std::ios::in | std::ios::binary | std::ios::ate);
+	if(!file.is_open()) {
+		return false;
+	}
+	// Counts in the file are checked against what is left of it before allocating
+	uint64_t file_size = file.tellg();
+	file.seekg(0);
+	auto remaining = [&] { return file_size - (uint64_t)file.tellg(); };
+
+	auto corrupt = [&](const char* reason) {
+		std::cerr << "Corrupt panorama graph " << path << ": " << reason << std::endl;
+		return false;
+	};
+
+	char magic[8] = {};
+	file.read(magic, 8);
+	if(!file || memcmp(magic, GRAPH_MAGIC, 8) != 0) {
+		std::cerr << "Not a panorama graph " << path << std::endl;
+		return false;
+	}
+
+	// Read into locals so a bad file leaves the graph as it was
+	std::vector<Node> new_nodes;
+	std::unordered_map<std::string, uint32_t> new_index;
+	auto num_nodes = read_value<uint32_t>(file);
+	if(!file || num_nodes > remaining() / MIN_NODE_BYTES) {
+		return corrupt("node count");
+	}
+	new_nodes.reserve(num_nodes);
+	for(uint32_t i = 0; i < num_nodes; i++) {
+		Node node;
+		auto id_length = read_value<uint32_t>(file);
+		if(!file || id_length > MAX_GRAPH_ID_LENGTH || id_length > remaining()) {
+			return corrupt("panorama ID length");
+		}
+		node.id.resize(id_length);
+		file.read(node.id.data(), node.id.size());
+		node.lat      = read_value<double>(file);
+		node.lng      = read_value<double>(file);
+		node.yaw      = read_value<double>(file);
+		node.year     = read_value<int32_t>(file);
+		node.month    = read_value<int32_t>(file);
+		node.expanded = read_value<uint8_t>(file);
+		if(!file) {
+			return corrupt("truncated nodes");
+		}
+		if(!new_index.emplace(node.id, i).second) {
+			return corrupt("duplicate panorama ID");
+		}
+		new_nodes.push_back(std::move(node));
+	}
+
+	if(remaining() / sizeof(uint32_t) < (uint64_t)num_nodes + 1) {
+		return corrupt("truncated offsets");
+	}
+	std::vector<uint32_t> new_offsets(num_nodes + 1);
+	file.read((char*)new_offsets.data(), new_offsets.size() * sizeof(uint32_t));
+	if(!file || new_offsets[0] != 0) {
+		return corrupt("offsets");
+	}
+	for(uint32_t node = 0; node < num_nodes; node++) {
+		if(new_offsets[node] > new_offsets[node + 1]) {
+			return corrupt("offsets not increasing");
+		}
+	}
+	uint64_t num_edges = new_offsets[num_nodes];
+	if(num_edges > remaining() / EDGE_BYTES) {
+		return corrupt("truncated edges");
+	}
+
+	std::vector<Edge> new_edges(num_edges);
+	for(auto& edge : new_edges) {
+		edge.to       = read_value<uint32_t>(file);
+		edge.bearing  = read_value<float>(file);
+		edge.distance = read_value<float>(file);
+		if(edge.to >= num_nodes) {
+			return corrupt("link to a missing panorama");
+		}
+	}
+	if(!file) {
+		return corrupt("truncated edges");
+	}
+
+	nodes.swap(new_nodes);
+	index.swap(new_index);
+	offsets.swap(new_offsets);
+	edges.swap(new_edges);
+	pending.clear();
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "extract.hpp"
+
+// Links between panoramas collected while crawling or navigating. Nodes are numbered in order of
+// insertion and links are stored compressed (CSR): one offset per node into a single array of
+// edges. New links go to a small per node buffer first and are merged into the compressed
+// arrays before the next query or save. Not thread safe
+class PanoramaGraph {
+public:
+	struct Node {
+		std::string id;
+		double lat;
+		double lng;
+		double yaw;
+		int year  = 0;
+		int month = 0;
+		// Links of this panorama are known, not only that it is linked from another one
+		bool expanded = false;
+	};
+
+	struct Edge {
+		uint32_t to;
+		// Radians clockwise from north
+		float bearing;
+		// Meters
+		float distance;
+	};
+
+	// Adds the panorama and links it both ways with each adjacent panorama
+	void Insert(Panorama& panorama, std::vector<Panorama>& adjacent);
+	std::optional<uint32_t> Find(std::string id);
+	Node& GetNode(uint32_t node) {
+		return nodes[node];
+	}
+	Panorama GetPanorama(uint32_t node);
+	std::vector<Panorama> GetAdjacent(uint32_t node);
+	std::span<const Edge> GetEdges(uint32_t node);
+	size_t NumNodes() {
+		return nodes.size();
+	}
+	size_t NumEdges();
+
+	// Nodes in order of hops from start, up to max_depth hops
+	std::vector<uint32_t> Bfs(uint32_t start, int max_depth);
+	// Shortest path by distance including both ends, empty if not connected
+	std::vector<uint32_t> ShortestPath(uint32_t from, uint32_t to);
+	// Follows the link closest to the current heading while it turns less than max_turn
+	// radians, like holding the up arrow in the viewer
+	std::vector<uint32_t> Walk(uint32_t start, double heading, double max_turn, int max_steps);
+
+	bool Save(std::string path);
+	bool Load(std::string path);
+
+private:
+	uint32_t AddNode(Panorama& panorama);
+	void AddEdge(uint32_t from, uint32_t to);
+	void Compact();
+
+	std::vector<Node> nodes;
+	std::unordered_map<std::string, uint32_t> index;
+	std::vector<uint32_t> offsets { 0 };
+	std::vector<Edge> edges;
+	std::unordered_map<uint32_t, std::vector<Edge>> pending;
+};
\ No newline at end of file
@@ -4,6 +4,13 @@
 #define SK_GANESH 1
 #define SK_ENABLE_SKSL 1
 #define PI 3.14159265358979323846264f
+// Panoramas queued for prefetching at once, the closest first
+#define PREFETCH_MAX_QUEUED 8
+// Extra cost of a panorama two moves away compared to one move away
+#define PREFETCH_HOP_PENALTY 0.5
+// Queue is scored again after turning this far
+#define PREFETCH_RESCORE_RADIANS 0.2
+#define PREFETCH_CACHE_BYTES ((size_t)1 << 30)
 
 #include <core/SkBitmap.h>
 #include <core/SkCanvas.h>
@@ -18,29 +25,65 @@
 #include <gpu/GrDirectContext.h>
 #include <gpu/gl/GrGLInterface.h>
 
+#include <algorithm>
 #include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unordered_map>
 
 #include "download.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+static double angle_difference(double a, double b) {
+	double difference = std::fmod(std::abs(a - b), 2 * PI);
+	return difference > PI ? 2 * PI - difference : difference;
+}
+
+// Lower is closer: how far the view has to turn to face the panorama plus how many meters
+// away it is, 40 meters counting as much as turning a radian
+static double closeness_heuristic(Panorama& from, Panorama& to, double heading) {
+	// Same frame as corrected_yaw
+	double angle = std::atan2(-(to.lng - from.lng), to.lat - from.lat) + PI;
+	double north = (to.lat - from.lat) * 111320.0;
+	double east  = (to.lng - from.lng) * 111320.0 * std::cos(from.lat * PI / 180.0);
+	return angle_difference(angle, heading) + std::sqrt(north * north + east * east) / 40.0;
+}
 
 InterfaceWindow::InterfaceWindow(std::string initial_panorama_id, int zoom, CURL* curl_handle,
-	int year_start, int year_end, int month_start, int month_end)
+	int year_start, int year_end, int month_start, int month_end, std::string fixture_directory)
 	: year_start(year_start)
 	, year_end(year_end)
 	, month_start(month_start)
 	, month_end(month_end)
-	, client_id(client_id)
+	, client_id(fixture_directory.empty() ? download_client_id(curl_handle) : "")
+	, fixture_directory(fixture_directory)
 	, curl_handle(curl_handle) {
 	// Start preloader
-	preloader.SetClientId(download_client_id(curl_handle));
+	preloader.SetClientId(client_id);
+	preloader.SetFixtureDirectory(fixture_directory);
 	preloader.SetZoom(zoom);
 	preloader.SetCurlHandle(curl_handle);
+	preloader.SetCacheBudget(PREFETCH_CACHE_BYTES);
 	preloader.Start(5);
 
-	// Set initial panorama
-	ChangePanorama(initial_panorama_id);
+	// Set initial panorama, nothing to show until it is downloaded
+	auto transition = LoadTransition(initial_panorama_id);
+	if(transition.panorama_info) {
+		ApplyTransition(transition);
+	}
+
+	// From now on curl_handle is only used on this thread
+	transition_thread = std::thread(&InterfaceWindow::TransitionThread, this);
+}
+
+InterfaceWindow::~InterfaceWindow() {
+	transition_m.lock();
+	run_transition_thread = false;
+	transition_m.unlock();
+	transition_cv.notify_all();
+	transition_thread.join();
 }
 
 bool InterfaceWindow::PrepareWindow() {
@@ -117,7 +160,6 @@ bool InterfaceWindow::PrepareWindow() {
 		window, *[](GLFWwindow* window, int key, int scancode, int action, int mods) {
 			InterfaceWindow* renderer = (InterfaceWindow*)glfwGetWindowUserPointer(window);
 			if(key == GLFW_KEY_UP && action == GLFW_PRESS) {
-				// TODO this heuristic doesn't work
 				renderer->ChangePanorama(renderer->GetClosestAdjacent().id);
 			}
 		});
@@ -154,48 +196,245 @@ bool InterfaceWindow::PrepareWindow() {
 	return true;
 }
 
+bool InterfaceWindow::PrepareHeadless(int width, int height) {
+	// The map is drawn in the bottom right corner
+	if(width < map_width || height < map_height) {
+		std::cerr << "Headless surface must be at least " << map_width << "x" << map_height
+				  << std::endl;
+		return false;
+	}
+	surface = SkSurface::MakeRasterN32Premul(width, height);
+	if(!surface) {
+		return false;
+	}
+	this->width  = width;
+	this->height = height;
+	timing_start = std::chrono::high_resolution_clock::now();
+	return true;
+}
+
+bool InterfaceWindow::RecordEvents(std::string path) {
+	event_log.open(path, std::ios::out | std::ios::trunc);
+	if(!event_log) {
+		std::cerr << "Could not open " << path << " for recording" << std::endl;
+		return false;
+	}
+	record_start  = std::chrono::steady_clock::now();
+	recorded_view = glfw_events;
+	return true;
+}
+
+void InterfaceWindow::RecordEvent(ViewerEvent event) {
+	event.time
+		= std::chrono::duration<double>(std::chrono::steady_clock::now() - record_start).count();
+	event_log << viewer_event_json(event) << '\n';
+}
+
+void InterfaceWindow::SaveFixtures(std::string directory) {
+	save_fixture_directory = directory;
+	if(panorama_info) {
+		save_fixture(directory, *panorama_info);
+	}
+}
+
 void InterfaceWindow::DrawFrame() {
-	RenderPanorama();
-	RenderMap();
-	surface->getCanvas()->flush();
-	glfwSwapBuffers(window);
-	glfwPollEvents();
+	TraceSpan span("viewer", "DrawFrame");
+
+	// Swap in the next panorama once it is downloaded, never waits for it
+	{
+		// Everything but waiting for the display
+		MetricsTimer frame_timer(get_metrics().Histogram("viewer_frame_us"));
+		transition_m.lock();
+		auto transition = std::move(finished_transition);
+		finished_transition.reset();
+		transition_m.unlock();
+		if(transition && transition->panorama_info
+			&& transition->panorama_info->id == loading_id) {
+			ApplyTransition(*transition);
+		}
+		if(transition && !transition->panorama_info) {
+			loading_id.clear();
+		}
+
+		{
+			MetricsTimer render_timer(
+				get_metrics().Histogram("viewer_render_us", "{stage=\"panorama\"}"));
+			RenderPanorama();
+		}
+		{
+			MetricsTimer render_timer(
+				get_metrics().Histogram("viewer_render_us", "{stage=\"map\"}"));
+			RenderMap();
+		}
+		RenderLoading();
+		surface->getCanvas()->flush();
+	}
+	if(!loading_id.empty()) {
+		get_metrics().Counter("viewer_loading_frames").Add();
+	}
 	frame++;
 
-	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	if(window) {
+		glfwSwapBuffers(window);
+		glfwPollEvents();
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+
+	if(event_log.is_open()
+		&& (glfw_events.screen_offset_x != recorded_view.screen_offset_x
+			|| glfw_events.screen_offset_y != recorded_view.screen_offset_y
+			|| glfw_events.zoom != recorded_view.zoom)) {
+		recorded_view = glfw_events;
+		RecordEvent(ViewerEvent {
+			.type     = ViewerEventType::VIEW,
+			.offset_x = glfw_events.screen_offset_x,
+			.offset_y = glfw_events.screen_offset_y,
+			.zoom     = glfw_events.zoom,
+		});
+	}
 
 	// Start queueing
-	// QueueCloseAdjacent();
-	// fmt::print("FPS: {}\n", (double)frame
-	//							/ (std::chrono::high_resolution_clock::now() - timing_start).count()
-	//							* 1000.0);
+	QueueCloseAdjacent();
 }
 
 void InterfaceWindow::ChangePanorama(std::string id) {
-	panorama_info    = preloader.GetPanorama(id, true);
-	current_panorama = extract_info(panorama_info->photometa);
-	fmt::print("Lat: {} Long: {}\n", current_panorama.lat, current_panorama.lng);
-	auto unfiltered_adjacent = extract_adjacent_panoramas(panorama_info->photometa);
+	if(id.empty() || id == current_panorama.id || id == loading_id) {
+		return;
+	}
+	loading_id    = id;
+	loading_start = std::chrono::steady_clock::now();
+	if(event_log.is_open()) {
+		RecordEvent(ViewerEvent { .type = ViewerEventType::MOVE, .id = id });
+	}
+
+	// Replaces a move that has not finished yet
+	transition_m.lock();
+	requested_id = id;
+	transition_m.unlock();
+	transition_cv.notify_one();
+}
+
+void InterfaceWindow::TransitionThread() {
+	std::unique_lock lock { transition_m };
+	while(true) {
+		transition_cv.wait(
+			lock, [this] { return !run_transition_thread || !requested_id.empty(); });
+		if(!run_transition_thread) {
+			break;
+		}
+
+		auto id = requested_id;
+		lock.unlock();
+		auto transition = LoadTransition(id);
+		lock.lock();
+
+		// Otherwise the user already moved on, the panorama stays in the preloader cache
+		if(requested_id == id) {
+			requested_id.clear();
+			finished_transition = std::move(transition);
+		}
+	}
+}
+
+InterfaceWindow::Transition InterfaceWindow::LoadTransition(std::string id) {
+	TraceSpan span("viewer", "transition " + id);
+	Transition transition;
+	auto panorama_info = preloader.GetPanorama(id, true);
+	if(!panorama_info->image || !valid_photometa(panorama_info->photometa)) {
+		std::cerr << "Could not download panorama " << id << std::endl;
+		return transition;
+	}
+	if(!save_fixture_directory.empty()) {
+		save_fixture(save_fixture_directory, *panorama_info);
+	}
+	transition.panorama_info       = panorama_info;
+	transition.panorama            = extract_info(panorama_info->photometa);
+	transition.unfiltered_adjacent = extract_adjacent_panoramas(panorama_info->photometa);
 
 	// Filter adjacent to year and month range
-	adjacent.clear();
-	for(auto& panorama : unfiltered_adjacent) {
+	for(auto& panorama : transition.unfiltered_adjacent) {
 		if(!is_date_specified(year_start, year_end, month_start, month_end)) {
 			// Just add it, much faster
-			adjacent.push_back(panorama);
+			transition.adjacent.push_back(panorama);
 		} else {
-			// Have to download date
-			auto photometa_document = download_photometa(curl_handle, client_id, panorama.id);
-			panorama                = extract_info(photometa_document);
+			graph_m.lock();
+			auto node       = graph.Find(panorama.id);
+			bool date_known = node && graph.GetNode(*node).year;
+			if(date_known) {
+				// Date already known from an earlier visit or crawl
+				panorama = graph.GetPanorama(*node);
+			}
+			graph_m.unlock();
+
+			if(!date_known && !fixture_directory.empty()) {
+				// Nothing is downloaded with fixtures, a panorama never visited while saving them
+				// has no date and is kept
+				rapidjson::Document photometa_document;
+				if(!load_fixture_photometa(fixture_directory, panorama.id, photometa_document)
+					|| !valid_photometa(photometa_document)) {
+					transition.adjacent.push_back(panorama);
+					continue;
+				}
+				panorama = extract_info(photometa_document);
+			} else if(!date_known) {
+				// Have to download date
+				auto photometa_document
+					= download_photometa(curl_handle, client_id, panorama.id, PHOTOMETA_INFO);
+				panorama = extract_info(photometa_document);
+			}
 			if(is_within_date(year_start, year_end, month_start, month_end, panorama)) {
-				adjacent.push_back(panorama);
+				transition.adjacent.push_back(panorama);
 			}
 		}
 	}
 
+	return transition;
+}
+
+void InterfaceWindow::ApplyTransition(Transition& transition) {
+	if(!loading_id.empty()) {
+		// Time the old panorama stayed on screen after the move was requested
+		get_metrics().Histogram("viewer_transition_stall_us").Record(
+			std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - loading_start)
+				.count());
+	}
+	// The first panorama fades from itself
+	previous_panorama_info = panorama_info ? panorama_info : transition.panorama_info;
+	previous_panorama      = panorama_info ? current_panorama : transition.panorama;
+	panorama_info          = transition.panorama_info;
+	current_panorama       = transition.panorama;
+	adjacent               = transition.adjacent;
+	transition_start       = std::chrono::steady_clock::now();
+	loading_id.clear();
+	fmt::print("Lat: {} Long: {}\n", current_panorama.lat, current_panorama.lng);
+
+	graph_m.lock();
+	graph.Insert(current_panorama, transition.unfiltered_adjacent);
+	graph_m.unlock();
+
 	PrepareShader();
 }
 
+bool InterfaceWindow::LoadGraph(std::string path) {
+	std::scoped_lock lock { graph_m };
+	if(!graph.Load(path)) {
+		return false;
+	}
+	// The initial panorama was loaded before the graph
+	if(panorama_info) {
+		std::vector<Panorama> unfiltered_adjacent
+			= extract_adjacent_panoramas(panorama_info->photometa);
+		graph.Insert(current_panorama, unfiltered_adjacent);
+	}
+	return true;
+}
+
+bool InterfaceWindow::SaveGraph(std::string path) {
+	std::scoped_lock lock { graph_m };
+	return graph.Save(path);
+}
+
 void InterfaceWindow::RenderPanorama() {
 	if(shader_builder) {
 		// Set view resolution
@@ -215,6 +454,19 @@ void InterfaceWindow::RenderPanorama() {
 		// TODO fixing pitch is complicated
 		shader_builder->uniform("u_rotation") = SkV2 { yaw + (float)current_panorama.yaw,
 			pitch + (float)current_panorama.pitch - PI };
+		shader_builder->uniform("u_previousRotation") = SkV2 {
+			yaw + (float)previous_panorama.yaw, pitch + (float)previous_panorama.pitch - PI
+		};
+
+		// Fade in the panorama that was just moved to
+		float fade = 1.0f;
+		if(crossfade_seconds > 0.0) {
+			double elapsed = std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - transition_start)
+								 .count();
+			fade = std::min(1.0, elapsed / crossfade_seconds);
+		}
+		shader_builder->uniform("u_fade").set(&fade, 1);
 
 		// Calculate corrected yaw
 		corrected_yaw = std::fmod(std::fmod(yaw - PI / 2, 2 * PI) + 2 * PI, 2 * PI);
@@ -248,11 +500,28 @@ void InterfaceWindow::RenderMap() {
 	surface->getCanvas()->drawRect(
 		SkRect::MakeXYWH(start_x, start_y, map_width, map_height), background_paint);
 
+	// Draw links known around the current panorama
+	graph_m.lock();
+	auto current_node = graph.Find(current_panorama.id);
+	if(current_node) {
+		SkPaint link_paint;
+		link_paint.setColor(SkColorSetARGB(255, 180, 180, 180));
+		link_paint.setStrokeWidth(3);
+		for(auto node : graph.Bfs(*current_node, 3)) {
+			auto from = graph.GetPanorama(node);
+			for(auto& edge : graph.GetEdges(node)) {
+				auto to = graph.GetPanorama(edge.to);
+				surface->getCanvas()->drawLine(GetMapPoint(from), GetMapPoint(to), link_paint);
+			}
+		}
+	}
+	graph_m.unlock();
+
 	// Draw the adjacent
 	SkPaint adjacent_panorama_paint;
 	for(auto& panorama : adjacent) {
-		adjacent_panorama_paint.setColor(
-			SkColorSetARGB(255, PanoramaClosenessHeuristic(panorama) * 100.0, 0, 0));
+		double closeness = std::min(PanoramaClosenessHeuristic(panorama) * 100.0, 255.0);
+		adjacent_panorama_paint.setColor(SkColorSetARGB(255, closeness, 0, 0));
 
 		surface->getCanvas()->drawCircle(GetMapPoint(panorama), 8, adjacent_panorama_paint);
 	}
@@ -264,6 +533,26 @@ void InterfaceWindow::RenderMap() {
 		start_x + map_width / 2, start_y + map_height / 2, 12, current_panorama_paint);
 }
 
+void InterfaceWindow::RenderLoading() {
+	if(loading_id.empty()) {
+		return;
+	}
+
+	// Spinner in the middle of the view until the next panorama is downloaded
+	SkPaint loading_paint;
+	loading_paint.setColor(SkColorSetARGB(200, 255, 255, 255));
+	loading_paint.setStyle(SkPaint::kStroke_Style);
+	loading_paint.setStrokeWidth(8);
+	loading_paint.setAntiAlias(true);
+
+	double elapsed
+		= std::chrono::duration<double>(std::chrono::steady_clock::now() - loading_start).count();
+	float start_angle = std::fmod(elapsed * 360.0, 360.0);
+	surface->getCanvas()->drawArc(
+		SkRect::MakeXYWH(surface->width() / 2 - 40, surface->height() / 2 - 40, 80, 80),
+		start_angle, 270, false, loading_paint);
+}
+
 SkPoint InterfaceWindow::GetMapPoint(Panorama& adjacent) {
 	int start_x = surface->width() - map_width;
 	int start_y = surface->height() - map_height;
@@ -276,10 +565,15 @@ void InterfaceWindow::PrepareShader() {
 	const char* sksl_src = R"(
 	// Handle 8 images at once, each one max 2048x2048
 	uniform shader image;
+	// Panorama being faded out
+	uniform shader previous_image;
 
 	uniform vec2 u_imageResolution;
+	uniform vec2 u_previousResolution;
 	uniform vec2 u_viewResolution;
 	uniform vec2 u_rotation;
+	uniform vec2 u_previousRotation;
+	uniform float u_fade;
 
 	//uniform float u_pitch;
 	//uniform float u_yaw;
@@ -296,47 +590,62 @@ void InterfaceWindow::PrepareShader() {
 		return vec3(c.y*p.x + s.y*p.z, p.y, -s.y*p.x + c.y*p.z);
 	}
 
+	vec2 imageCoord(vec3 camDir, vec2 rotation, vec2 resolution) {
+	    // Rotate
+	    vec3 rd = normalize(rotateXY(camDir, rotation.yx));
+	
+	    // Radial azmuth polar
+	    vec2 texCoord = vec2(atan(rd.z, rd.x) + PI, acos(-rd.y)) / vec2(2.0 * PI, PI);
+		// Y is flipped but X is not
+		return vec2(texCoord.x, 1 - texCoord.y) * resolution;
+	}
+
 	float4 main(float2 fragCoord) {
 		// Place 0,0 in center from -1 to 1 ndc
 	    vec2 uv = fragCoord * 2.0 / u_viewResolution - 1.0;
 
 	    // Spherical
 	    vec3 camDir = normalize(vec3(uv * vec2(tan(0.5 * u_fovH), tan(0.5 * u_fovV)), 1.0));
-	
-	    // Rotate
-	    vec3 rd = normalize(rotateXY(camDir, u_rotation.yx));
-	
-	    // Radial azmuth polar
-	    vec2 texCoord = vec2(atan(rd.z, rd.x) + PI, acos(-rd.y)) / vec2(2.0 * PI, PI);
-		// Y is flipped but X is not
-		vec2 imageCoord = vec2(texCoord.x, 1 - texCoord.y) * u_imageResolution;
 
-		return image.eval(imageCoord);
+		float4 color = image.eval(imageCoord(camDir, u_rotation, u_imageResolution));
+		if(u_fade >= 1.0) {
+			return color;
+		}
+		float4 previous
+			= previous_image.eval(imageCoord(camDir, u_previousRotation, u_previousResolution));
+		return mix(previous, color, u_fade);
 	}
 		)";
 
-	auto [effect, errorText] = SkRuntimeEffect::MakeForShader(SkString(sksl_src));
-	if(!effect) {
-		fprintf(stdout, "sksl didn't compile: %s", errorText.c_str());
-		return;
-	}
-	shader_effect = effect;
-
-	if(shader_builder) {
-		delete shader_builder;
+	// Compiled once, later panoramas only swap the images
+	if(!shader_builder) {
+		MetricsTimer compile_timer(
+			get_metrics().Histogram("viewer_shader_us", "{step=\"compile\"}"));
+		auto [effect, errorText] = SkRuntimeEffect::MakeForShader(SkString(sksl_src));
+		if(!effect) {
+			fprintf(stdout, "sksl didn't compile: %s", errorText.c_str());
+			return;
+		}
+		shader_effect  = effect;
+		shader_builder = new SkRuntimeShaderBuilder(std::move(effect));
 	}
-	shader_builder = new SkRuntimeShaderBuilder(std::move(effect));
 
+	MetricsTimer bind_timer(get_metrics().Histogram("viewer_shader_us", "{step=\"bind\"}"));
 	// Set one time image resolution
+	auto& image          = panorama_info->image;
+	auto& previous_image = previous_panorama_info->image;
 	shader_builder->uniform("u_imageResolution")
-		= SkV2 { (float)panorama_info->image->width(), (float)panorama_info->image->height() };
+		= SkV2 { (float)image->width(), (float)image->height() };
+	shader_builder->uniform("u_previousResolution")
+		= SkV2 { (float)previous_image->width(), (float)previous_image->height() };
 
 	// Set image
-	shader_builder->child("image")
-		= panorama_info->image->makeShader(SkSamplingOptions(SkFilterMode::kLinear));
+	shader_builder->child("image") = image->makeShader(SkSamplingOptions(SkFilterMode::kLinear));
+	shader_builder->child("previous_image")
+		= previous_image->makeShader(SkSamplingOptions(SkFilterMode::kLinear));
 }
 
-Panorama& InterfaceWindow::GetClosestAdjacent() {
+Panorama InterfaceWindow::GetClosestAdjacent() {
 	Panorama closest_panorama;
 	double closest_difference = 1000;
 	for(auto& panorama : adjacent) {
@@ -374,23 +683,70 @@ void InterfaceWindow::SwitchToAdjacent(double x, double y) {
 }
 
 void InterfaceWindow::QueueCloseAdjacent() {
-	auto sorted_adjacent = adjacent;
-	std::sort(sorted_adjacent.begin(), sorted_adjacent.end(), [this](Panorama& a, Panorama& b) {
-		return PanoramaClosenessHeuristic(b) < PanoramaClosenessHeuristic(a);
-	});
+	// Only after moving or turning, the preloader keeps working on the last queue meanwhile
+	if(prefetch_panorama_id == current_panorama.id
+		&& angle_difference(corrected_yaw, prefetch_yaw) < PREFETCH_RESCORE_RADIANS) {
+		return;
+	}
+	prefetch_panorama_id = current_panorama.id;
+	prefetch_yaw         = corrected_yaw;
+
+	// Cheapest route to every panorama up to two moves away
+	std::unordered_map<std::string, double> scores;
+	auto add_candidate = [&](std::string& id, double score) {
+		auto found = scores.find(id);
+		if(found == scores.end() || score < found->second) {
+			scores[id] = score;
+		}
+	};
+	bool date_specified = is_date_specified(year_start, year_end, month_start, month_end);
+	std::scoped_lock lock { graph_m };
+	for(auto& first_hop : adjacent) {
+		double first_score = closeness_heuristic(current_panorama, first_hop, corrected_yaw);
+		add_candidate(first_hop.id, first_score);
+
+		// Links of the next panorama are known once it is prefetched or was crawled before
+		auto node = graph.Find(first_hop.id);
+		if(!node || !graph.GetNode(*node).expanded) {
+			auto download = preloader.PeekPanorama(first_hop.id);
+			if(!download || !valid_photometa(download->photometa)) {
+				continue;
+			}
+			auto info          = extract_info(download->photometa);
+			auto next_adjacent = extract_adjacent_panoramas(download->photometa);
+			graph.Insert(info, next_adjacent);
+			node = graph.Find(first_hop.id);
+		}
+
+		for(auto& second_hop : graph.GetAdjacent(*node)) {
+			if(second_hop.id == current_panorama.id
+				|| (second_hop.year && date_specified
+					&& !is_within_date(year_start, year_end, month_start, month_end, second_hop))) {
+				continue;
+			}
+			// Walking on keeps roughly the same heading
+			add_candidate(second_hop.id,
+				first_score + PREFETCH_HOP_PENALTY
+					+ closeness_heuristic(first_hop, second_hop, corrected_yaw));
+		}
+	}
+
+	std::vector<std::pair<double, std::string>> sorted_candidates;
+	for(auto& [id, score] : scores) {
+		sorted_candidates.emplace_back(score, id);
+	}
+	std::sort(sorted_candidates.begin(), sorted_candidates.end());
+	if(sorted_candidates.size() > PREFETCH_MAX_QUEUED) {
+		sorted_candidates.resize(PREFETCH_MAX_QUEUED);
+	}
 
-	// Only use first half
-	for(int i = 0; i < sorted_adjacent.size() / 2; i++) {
-		preloader.QueuePanorama(sorted_adjacent[i].id);
+	std::vector<std::string> ids;
+	for(auto& candidate : sorted_candidates) {
+		ids.push_back(candidate.second);
 	}
+	preloader.ReplaceQueue(ids);
 }
 
 double InterfaceWindow::PanoramaClosenessHeuristic(Panorama& adjacent) {
-	auto angle
-		= std::atan2(-(adjacent.lng - current_panorama.lng), adjacent.lat - current_panorama.lat)
-		  + PI;
-	return std::abs(angle - corrected_yaw)
-		   + std::sqrt(std::pow(adjacent.lat - current_panorama.lat, 2)
-					   + std::pow(adjacent.lng - current_panorama.lng, 2))
-				 * 2500.0;
+	return closeness_heuristic(current_panorama, adjacent, corrected_yaw);
 }
\ No newline at end of file
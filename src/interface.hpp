@@ -8,24 +8,53 @@
 #define GLFW_INCLUDE_GLCOREARB
 #include <GLFW/glfw3.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "extract.hpp"
+#include "graph.hpp"
 #include "preloader.hpp"
+#include "replay.hpp"
 
 class InterfaceWindow {
 public:
+	// With a fixture directory nothing is downloaded, panoramas only come from saved fixtures
 	InterfaceWindow(std::string initial_panorama_id, int zoom, CURL* curl_handle, int year_start,
-		int year_end, int month_start, int month_end);
+		int year_end, int month_start, int month_end, std::string fixture_directory = "");
+	~InterfaceWindow();
 
 	bool PrepareWindow();
+	// Renders on the CPU into a raster surface instead of a window, for benchmarks
+	bool PrepareHeadless(int width, int height);
 	void DrawFrame();
+	// Starts moving to the panorama in the background, the current one keeps rendering until
+	// the next one is downloaded
 	void ChangePanorama(std::string id);
 	void PrepareShader();
-	Panorama& GetClosestAdjacent();
+	Panorama GetClosestAdjacent();
 	void SwitchToAdjacent(double x, double y);
+	// Links found while navigating are added to the graph and drawn on the map
+	bool LoadGraph(std::string path);
+	bool SaveGraph(std::string path);
+	// 0 switches panoramas instantly
+	void SetCrossfade(double seconds) {
+		crossfade_seconds = seconds;
+	}
+	// Appends every drag, zoom and move from now on, see ViewerEvent
+	bool RecordEvents(std::string path);
+	// The current panorama and every one moved to later is also saved as a fixture here
+	void SaveFixtures(std::string directory);
+	bool IsLoading() {
+		return !loading_id.empty();
+	}
 
 	bool ShouldClose() {
 		return glfwWindowShouldClose(window);
@@ -47,15 +76,29 @@ public:
 	glfw_events_s glfw_events;
 
 private:
+	struct Transition {
+		// nullptr if the panorama could not be downloaded
+		std::shared_ptr<PanoramaDownload> panorama_info;
+		Panorama panorama;
+		std::vector<Panorama> adjacent;
+		std::vector<Panorama> unfiltered_adjacent;
+	};
+
+	Transition LoadTransition(std::string id);
+	void ApplyTransition(Transition& transition);
+	void TransitionThread();
 	void RenderPanorama();
 	void RenderMap();
+	void RenderLoading();
+	void RecordEvent(ViewerEvent event);
 	SkPoint GetMapPoint(Panorama& adjacent);
 	void QueueCloseAdjacent();
 	double PanoramaClosenessHeuristic(Panorama& adjacent);
 
 	// Render variables
 	sk_sp<SkSurface> surface;
-	GLFWwindow* window;
+	// nullptr when headless
+	GLFWwindow* window = nullptr;
 	sk_sp<GrDirectContext> direct_context;
 	SkRuntimeShaderBuilder* shader_builder = nullptr;
 	sk_sp<SkRuntimeEffect> shader_effect   = nullptr;
@@ -74,6 +117,8 @@ private:
 	int month_start;
 	int month_end;
 	std::string client_id;
+	// Empty unless panoramas only come from fixtures
+	std::string fixture_directory;
 
 	// Panorama variables
 	CURL* curl_handle;
@@ -81,7 +126,36 @@ private:
 	std::shared_ptr<PanoramaDownload> panorama_info;
 	Panorama current_panorama;
 	std::vector<Panorama> adjacent;
+	PanoramaGraph graph;
+	// Also read by the transition thread
+	std::mutex graph_m;
 	float yaw;
 	float pitch;
 	double corrected_yaw;
+
+	// Where the prefetch queue was last scored
+	std::string prefetch_panorama_id;
+	double prefetch_yaw = 0.0;
+
+	// Transition variables, the transition thread downloads the latest requested panorama
+	std::string requested_id;
+	std::optional<Transition> finished_transition;
+	bool run_transition_thread = true;
+	std::mutex transition_m;
+	std::condition_variable transition_cv;
+	std::thread transition_thread;
+	// Only used on the render thread
+	std::string loading_id;
+	std::chrono::steady_clock::time_point loading_start;
+	std::shared_ptr<PanoramaDownload> previous_panorama_info;
+	Panorama previous_panorama;
+	std::chrono::steady_clock::time_point transition_start;
+	double crossfade_seconds = 0.3;
+
+	// Recording, only used on the render thread
+	std::ofstream event_log;
+	std::chrono::steady_clock::time_point record_start;
+	glfw_events_s recorded_view;
+	// Set before moving, then read by the transition thread
+	std::string save_fixture_directory;
 };
\ No newline at end of file
@@ -28,31 +28,65 @@
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 
+#include <algorithm>
 #include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <unistd.h>
 #include <unordered_set>
 #include <utility>
 
+#include "area.hpp"
+#include "async.hpp"
+#include "batch.hpp"
+#include "budget.hpp"
+#include "catalog.hpp"
+#include "dedup.hpp"
+#include "delta.hpp"
 #include "download.hpp"
 #include "extract.hpp"
+#include "graph.hpp"
 #include "headers.hpp"
 #include "interface.hpp"
+#include "metrics.hpp"
 #include "parse.hpp"
+#include "pyramid.hpp"
+#include "repair.hpp"
+#include "replay.hpp"
+#include "serve.hpp"
+#include "sfm.hpp"
+#include "shard.hpp"
+#include "trace.hpp"
+#include "writer.hpp"
 
 int main(int argc, char** argv) {
 	CLI::App app { "Street View custom client in C++" };
 	app.require_subcommand(1, 1);
+	int metrics_port = 0;
+	app.add_option("--metrics-port", metrics_port,
+		"Serve Prometheus metrics on this localhost port while running");
+	std::string stats_file;
+	app.add_option(
+		"--stats-file", stats_file, "Periodically write Prometheus metrics to this file");
+	int stats_interval = 10;
+	app.add_option("--stats-interval", stats_interval, "Seconds between writes of --stats-file");
+	std::string trace_path;
+	app.add_option("--trace", trace_path,
+		"Record requests and pipeline stages in Chrome trace event format, open in Perfetto");
+	std::string endpoint;
+	app.add_option("--endpoint", endpoint,
+		"Send every request to this base URL instead of Google, e.g. http://localhost:8080 for a local stand-in server");
 
 	auto& download_sub = *app.add_subcommand("download", "Download panoramas");
 	double lat;
-	download_sub.add_option("--lat", lat, "Latitude")->required();
+	auto lat_option = download_sub.add_option("--lat", lat, "Latitude");
 	double lng;
-	download_sub.add_option("--long", lng, "Longitude")->required();
+	auto lng_option = download_sub.add_option("--long", lng, "Longitude");
 	int range = 10000;
 	download_sub.add_option("-r,--range", range, "Range from location, unit not known");
 	int month_start = -1;
@@ -65,7 +99,7 @@ int main(int argc, char** argv) {
 	download_sub.add_option("--year-end", year_end, "Ending year (inclusive)");
 	std::string filepath_format = "tiles/{id}";
 	download_sub.add_option("--path-format", filepath_format,
-		"Path format, not including the extension. Supports {id}, {year}, {month}, {lat}, {long}, {street}, {city}");
+		"Path format, not including the extension. Supports {id}, {year}, {month}, {lat}, {long}, {street}, {city}, {zoom}");
 	int num_panoramas = 100;
 	download_sub.add_option(
 		"-n,--num-panoramas", num_panoramas, "Number of panoramas to attempt to download");
@@ -78,15 +112,123 @@ int main(int argc, char** argv) {
 	bool only_include_json_info = false;
 	download_sub.add_flag(
 		"--only-json", only_include_json_info, "Only include JSON info alongside panorama");
+	std::string catalog_path;
+	download_sub.add_option("--catalog", catalog_path,
+		"Write metadata of every panorama to this single file instead of one JSON file per panorama, replacing it");
+	std::string catalog_format = "ndjson";
+	download_sub.add_option("--catalog-format", catalog_format, "Catalog format, ndjson or binary")
+		->check(CLI::IsMember({ "ndjson", "binary" }));
+	std::string since_path;
+	download_sub.add_option("--since", since_path,
+		"Catalog of an earlier run, only panoramas that are new or whose date changed are downloaded again");
+	std::string delta_report_path;
+	download_sub.add_option("--delta-report", delta_report_path,
+		"With --since, write the new, changed and unchanged panoramas to this JSON file");
+	std::string missing_tiles = "white";
+	download_sub
+		.add_option("--missing-tiles", missing_tiles,
+			"What to do with panoramas missing tiles after retries: white (leave the missing tiles white), fail (skip the panorama), mask (leave the missing tiles transparent) or repair (mask and queue for the repair subcommand)")
+		->check(CLI::IsMember({ "white", "fail", "mask", "repair" }));
+	std::string repair_queue_path = "repair_queue.ndjson";
+	download_sub.add_option(
+		"--repair-queue", repair_queue_path, "Where panoramas to repair are queued");
+	std::vector<int> pyramid_zooms;
+	download_sub
+		.add_option("--pyramid", pyramid_zooms,
+			"Zoom levels to save, e.g. 1,3,5. Only the highest is downloaded, the others are downsampled from it. Adds _z{zoom} to the path format unless it contains {zoom}")
+		->delimiter(',');
+	bool dedup = false;
+	download_sub.add_flag("--dedup", dedup,
+		"Skip panoramas that look the same as one already downloaded nearby, compared on zoom 1 before downloading the full zoom");
+	double dedup_radius = 15;
+	download_sub.add_option(
+		"--dedup-radius", dedup_radius, "Meters within which panoramas are compared for --dedup");
+	int dedup_bits = 10;
+	download_sub.add_option("--dedup-bits", dedup_bits,
+		"Maximum differing bits of the 64 bit perceptual hash to count as a duplicate");
+	int parallel_panoramas = 8;
+	download_sub.add_option("-p,--parallel", parallel_panoramas,
+		"Number of panoramas downloaded at once, their tiles all share the same connections");
+	std::string scratch_dir;
+	download_sub.add_option("--scratch-dir", scratch_dir,
+		"Stitch panoramas in memory mapped files in this directory instead of the heap, for zoom 5 and many --parallel");
+	int memory_budget_mb = 0;
+	download_sub.add_option("--memory-budget", memory_budget_mb,
+		"Megabytes of rasters, tiles and encoded images panoramas in flight may hold before new ones wait, half of physical memory by default");
+	bool fsync_output = false;
+	download_sub.add_flag("--fsync", fsync_output, "Flush every file to disk before moving on");
+	bool direct_io = false;
+	download_sub.add_flag(
+		"--direct-io", direct_io, "Write panorama images with O_DIRECT, bypassing the page cache");
 
 	auto& download_recursive_sub = *download_sub.add_subcommand(
 		"recursive", "Recursively attempt to download nearby panoramas");
 	int num_recursive_attempts = 10;
 	download_recursive_sub.add_option("-a,--num-attempts", num_recursive_attempts,
 		"Number of recursive attempts to download more images");
-	double recursive_radius = 10;
+	double recursive_radius = 1000;
 	download_recursive_sub.add_option(
-		"-r,--radius", recursive_radius, "Radius of images to download in latitude degrees");
+		"-r,--radius", recursive_radius, "Radius of images to download in meters");
+	std::string graph_path;
+	download_recursive_sub.add_option("--graph", graph_path,
+		"Keep links between panoramas in this file, known links are not fetched again");
+
+	auto& download_area_sub = *download_sub.add_subcommand(
+		"area", "Download every panorama in a bounding box or polygon, --lat and --long are not used");
+	std::string area_bbox;
+	auto area_bbox_option = download_area_sub.add_option(
+		"--bbox", area_bbox, "Bounding box as min_lat,min_long,max_lat,max_long");
+	std::string area_polygon;
+	auto area_polygon_option = download_area_sub.add_option(
+		"--polygon", area_polygon, "Polygon as lat,long;lat,long;... of at least 3 vertices");
+	area_bbox_option->excludes(area_polygon_option);
+	int area_threads = 16;
+	download_area_sub.add_option(
+		"-t,--threads", area_threads, "Number of preview queries to run at once");
+
+	auto& download_worker_sub = *download_sub.add_subcommand(
+		"worker", "Download shards handed out by a coordinator, --lat and --long are not used");
+	std::string coordinator_address = "127.0.0.1:7878";
+	download_worker_sub.add_option(
+		"--coordinator", coordinator_address, "Address of the coordinator as host:port");
+	download_worker_sub.add_option(
+		"-t,--threads", area_threads, "Number of preview queries to run at once");
+
+	auto& download_batch_sub = *download_sub.add_subcommand("batch",
+		"Download around every location of a job list in one process, --lat and --long are not used");
+	std::string batch_jobs_path;
+	download_batch_sub
+		.add_option("--jobs", batch_jobs_path,
+			"CSV of lat,long[,name[,num_panoramas[,range]]] or NDJSON objects with the same keys")
+		->required();
+	int batch_parallel = 16;
+	download_batch_sub.add_option(
+		"--parallel-jobs", batch_parallel, "Number of jobs whose panoramas are queued at once");
+
+	auto& coordinate_sub = *app.add_subcommand(
+		"coordinate", "Split an area into geohash shards and hand them out to download workers");
+	auto coordinate_bbox_option = coordinate_sub.add_option(
+		"--bbox", area_bbox, "Bounding box as min_lat,min_long,max_lat,max_long");
+	auto coordinate_polygon_option = coordinate_sub.add_option(
+		"--polygon", area_polygon, "Polygon as lat,long;lat,long;... of at least 3 vertices");
+	coordinate_bbox_option->excludes(coordinate_polygon_option);
+	int geohash_precision = 6;
+	coordinate_sub.add_option("--precision", geohash_precision,
+		"Geohash length of each shard, 5 is about 4.9x4.9km and 6 about 1.2x0.6km");
+	std::string coordinator_bind = "127.0.0.1";
+	coordinate_sub.add_option(
+		"--bind", coordinator_bind, "Address to listen on, 0.0.0.0 for workers on other hosts");
+	int coordinator_port = 7878;
+	coordinate_sub.add_option("--port", coordinator_port, "Port to listen on");
+	int worker_timeout = 120;
+	coordinate_sub.add_option("--timeout", worker_timeout,
+		"Seconds of silence before a worker is considered dead and its shards reassigned");
+	coordinate_sub
+		.add_option("--catalog", catalog_path,
+			"Merge the catalogs of every worker into this file once all shards are finished")
+		->required();
+	coordinate_sub.add_option("--catalog-format", catalog_format, "Catalog format, ndjson or binary")
+		->check(CLI::IsMember({ "ndjson", "binary" }));
 
 	auto& render_sub = *app.add_subcommand("render", "Render panoramas in viewer");
 	std::string initial_id;
@@ -97,14 +239,556 @@ int main(int argc, char** argv) {
 	render_sub.add_option("--month-end", month_end, "Ending month (inclusive)");
 	render_sub.add_option("--year-start", year_start, "Starting year");
 	render_sub.add_option("--year-end", year_end, "Ending year (inclusive)");
+	double crossfade = 0.3;
+	render_sub.add_option(
+		"--crossfade", crossfade, "Seconds to fade between panoramas, 0 to switch instantly");
+	render_sub.add_option("--graph", graph_path,
+		"Load and extend links between panoramas in this file, shown on the map");
+	std::string record_path;
+	render_sub.add_option(
+		"--record", record_path, "Write every drag, zoom and move to this file for --benchmark");
+	std::string save_fixtures_directory;
+	render_sub.add_option("--save-fixtures", save_fixtures_directory,
+		"Save every panorama visited to this directory for --fixtures");
+	std::string fixtures_directory;
+	render_sub.add_option("--fixtures", fixtures_directory,
+		"Read panoramas saved with --save-fixtures instead of downloading them");
+	std::string benchmark_path;
+	render_sub.add_option("--benchmark", benchmark_path,
+		"Replay events saved with --record without a window and report frame times");
+	int benchmark_width = 1920;
+	render_sub.add_option("--benchmark-width", benchmark_width, "Width of the benchmark surface");
+	int benchmark_height = 1080;
+	render_sub.add_option(
+		"--benchmark-height", benchmark_height, "Height of the benchmark surface");
+
+	auto& serve_sub = *app.add_subcommand("serve",
+		"Keep the client ID, connections and caches warm and answer panorama requests over HTTP");
+	int serve_port = 8090;
+	serve_sub.add_option("--port", serve_port, "Port on localhost to listen on, 0 for none");
+	std::string serve_socket;
+	serve_sub.add_option("--socket", serve_socket, "Also listen on this Unix socket");
+	serve_sub.add_option(
+		"-z,--zoom", streetview_zoom, "Dimensions of stitched images, same as download -z");
+	int serve_threads = 8;
+	serve_sub.add_option("-t,--threads", serve_threads, "Number of requests handled at once");
+	int serve_cache_mb = 1024;
+	serve_sub.add_option(
+		"--cache-mb", serve_cache_mb, "Megabytes of stitched panoramas kept in memory");
+
+	auto& repair_sub = *app.add_subcommand(
+		"repair", "Download only the missing tiles of panoramas queued with --missing-tiles repair");
+	repair_sub.add_option("--repair-queue", repair_queue_path, "Queue of panoramas to repair");
+
+	auto& graph_sub = *app.add_subcommand("graph", "Query links saved with --graph");
+	graph_sub.add_option("--graph", graph_path, "Graph file")->required();
+	std::string graph_from;
+	graph_sub.add_option("--from", graph_from, "Starting panorama ID")->required();
+	std::string graph_to;
+	graph_sub.add_option("--to", graph_to, "Print the shortest path to this panorama ID");
+	double graph_heading = -1;
+	graph_sub.add_option(
+		"--heading", graph_heading, "Walk from --from along this compass heading in degrees");
+	int graph_steps = 50;
+	graph_sub.add_option("--steps", graph_steps, "Maximum panoramas to walk");
+	int graph_depth = 2;
+	graph_sub.add_option("--depth", graph_depth,
+		"Without --to or --heading, print every panorama within this many links");
+
+	auto& export_sfm_sub = *app.add_subcommand(
+		"export-sfm", "Write openMVG sfm_data.json with GPS priors and the pairs worth matching");
+	export_sfm_sub.add_option("--catalog", catalog_path, "Catalog written by download --catalog")
+		->required();
+	std::string sfm_output = "matches";
+	export_sfm_sub.add_option(
+		"-o,--output", sfm_output, "Directory for sfm_data.json and matching_pairs.txt");
+	std::string sfm_pairs = "both";
+	export_sfm_sub
+		.add_option("--pairs", sfm_pairs,
+			"Pairs to match: adjacency (linked by Street View), knn (nearest panoramas) or both")
+		->check(CLI::IsMember({ "adjacency", "knn", "both" }));
+	int sfm_neighbours = 6;
+	export_sfm_sub.add_option(
+		"-k,--neighbours", sfm_neighbours, "Nearest panoramas matched with each one for knn");
 
 	CLI11_PARSE(app, argc, argv);
 
 	curl_global_init(CURL_GLOBAL_ALL);
+	if(!endpoint.empty()) {
+		set_endpoint_override(endpoint);
+	}
+	if(!scratch_dir.empty()) {
+		set_scratch_dir(scratch_dir);
+	}
 	if(download_sub) {
+		get_memory_budget().SetLimit(
+			memory_budget_mb ? (size_t)memory_budget_mb << 20 : default_memory_limit());
+	}
+	if(!trace_path.empty()) {
+		trace_start(trace_path);
+	}
+	TraceScope trace_scope;
+	if(metrics_port) {
+		get_metrics().StartServer(metrics_port);
+	}
+	if(!stats_file.empty()) {
+		get_metrics().StartStatsFile(stats_file, stats_interval);
+	}
+	if(download_sub) {
+		auto missing_tile_policy = missing_tile_policy_from_string(missing_tiles);
+		// Otherwise missing tiles are white, like before policies existed
+		bool transparent_background = missing_tile_policy == MissingTilePolicy::MASK
+									  || missing_tile_policy == MissingTilePolicy::REPAIR;
+
+		// Loaded before the new catalog is opened, they must not be the same file
+		CrawlDelta delta;
+		if(!since_path.empty()) {
+			if(!catalog_path.empty()
+				&& std::filesystem::weakly_canonical(since_path)
+					   == std::filesystem::weakly_canonical(catalog_path)) {
+				std::cerr << "--since and --catalog must be different files" << std::endl;
+				return 1;
+			}
+			if(!delta.Load(since_path)) {
+				return 1;
+			}
+		}
+
+		CatalogWriter catalog;
+		if(!catalog_path.empty()) {
+			auto catalog_parent = std::filesystem::path(catalog_path).parent_path();
+			if(!catalog_parent.empty()) {
+				std::filesystem::create_directories(catalog_parent);
+			}
+			if(!catalog.Open(catalog_path, catalog_format_from_string(catalog_format))) {
+				std::cerr << "Could not open catalog " << catalog_path << std::endl;
+				return 1;
+			}
+		}
+
+		// Only the highest level of the pyramid is downloaded
+		int download_zoom = streetview_zoom;
+		if(!pyramid_zooms.empty()) {
+			download_zoom = *std::max_element(pyramid_zooms.begin(), pyramid_zooms.end());
+			if(filepath_format.find("{zoom}") == std::string::npos) {
+				filepath_format += "_z{zoom}";
+			}
+		}
+
+		// Files are written in the background, directories are created as needed
+		OutputWriter output_writer(4);
+		output_writer.SetSync(fsync_output);
+		output_writer.SetDirect(direct_io);
+
+		auto write_png = [&](std::string path, sk_sp<SkImage> image) {
+			sk_sp<SkData> tile_data;
+			{
+				MetricsTimer encode_timer(get_metrics().Histogram("encode_us"));
+				TraceSpan encode_span("pipeline", "encode");
+				tile_data = image->encodeToData(SkEncodedImageFormat::kPNG, 95);
+			}
+			output_writer.Write(path, tile_data);
+		};
+
+		// Write the image and metadata of one panorama whose photometa and tiles are already
+		// downloaded. Runs on the CPU pool of the async runtime
+		auto write_panorama = [&](Panorama& panorama, rapidjson::Document& photometa_document,
+								  sk_sp<SkImage> tile_surface, TileCompleteness& completeness) {
+			// Location
+			auto location = extract_location(photometa_document);
+
+			auto format_filename = [&](int zoom) {
+				return fmt::format(fmt::runtime(filepath_format), fmt::arg("id", panorama.id),
+					fmt::arg("year", panorama.year), fmt::arg("month", panorama.month),
+					fmt::arg("street", location.street),
+					fmt::arg("city", location.city_and_state), fmt::arg("lat", panorama.lat),
+					fmt::arg("long", panorama.lng), fmt::arg("zoom", zoom));
+			};
+			std::string filename = format_filename(download_zoom);
+
+			if(!only_include_json_info && !completeness.IsComplete()) {
+				fmt::print("{} is missing {} tiles\n", panorama.id, completeness.NumMissing());
+				if(missing_tile_policy == MissingTilePolicy::FAIL) {
+					return;
+				}
+			}
+
+			// The catalog replaces the JSON file alongside the panorama
+			bool write_json_file
+				= (include_json_info || only_include_json_info) && !catalog.IsOpen();
+
+			if(!only_include_json_info) {
+				write_png(filename + ".png", tile_surface);
+
+				std::vector<int> lower_zooms;
+				std::vector<std::pair<int, int>> lower_sizes;
+				for(int zoom : pyramid_zooms) {
+					if(zoom != download_zoom) {
+						// Exact dimensions of that zoom, as if it was downloaded
+						auto plan = extract_tile_plan(photometa_document, zoom);
+						lower_zooms.push_back(zoom);
+						lower_sizes.push_back(std::make_pair(plan.width, plan.height));
+					}
+				}
+				if(!lower_zooms.empty()) {
+					auto levels = build_pyramid(tile_surface, lower_sizes);
+					for(int i = 0; i < lower_zooms.size(); i++) {
+						write_png(format_filename(lower_zooms[i]) + ".png", levels[i]);
+					}
+				}
+				get_metrics().Counter("panoramas_written").Add();
+
+				if(!completeness.IsComplete()
+					&& missing_tile_policy == MissingTilePolicy::REPAIR) {
+					RepairEntry entry {
+						.id           = panorama.id,
+						.path         = filename + ".png",
+						.completeness = completeness,
+					};
+					append_repair_entry(repair_queue_path, entry);
+				}
+			}
+
+			if(write_json_file) {
+				// Include JSON info alongside
+				rapidjson::Document infoJson(rapidjson::kObjectType);
+				infoJson.AddMember("id", panorama.id, infoJson.GetAllocator());
+				infoJson.AddMember("year", panorama.year, infoJson.GetAllocator());
+				infoJson.AddMember("month", panorama.month, infoJson.GetAllocator());
+				infoJson.AddMember("location", location.city_and_state, infoJson.GetAllocator());
+				infoJson.AddMember("lat", panorama.lat, infoJson.GetAllocator());
+				infoJson.AddMember("long", panorama.lng, infoJson.GetAllocator());
+
+				rapidjson::StringBuffer infoSb;
+				rapidjson::PrettyWriter<rapidjson::StringBuffer> infoWriter(infoSb);
+				infoWriter.SetIndent('\t', 1);
+				infoJson.Accept(infoWriter);
+
+				// Write to filesystem at the same location the panorama is
+				output_writer.Write(filename + ".json", infoSb.GetString(), infoSb.GetLength());
+			}
+
+			if(catalog.IsOpen()) {
+				CatalogRecord record {
+					.id     = panorama.id,
+					.year   = panorama.year,
+					.month  = panorama.month,
+					.lat    = panorama.lat,
+					.lng    = panorama.lng,
+					.yaw    = panorama.yaw,
+					.pitch  = panorama.pitch,
+					.roll   = panorama.roll,
+					.street = location.street,
+					.city   = location.city_and_state,
+					.path   = only_include_json_info ? "" : filename + ".png",
+				};
+				for(auto& adjacent : extract_adjacent_panoramas(photometa_document)) {
+					record.adjacent.push_back(adjacent.id);
+				}
+				catalog.Append(record);
+			}
+		};
+
 		auto curl_handle = curl_easy_init();
 
-		if(download_recursive_sub) {
+		// Tiles and raster while stitching, then the PNG being encoded and the pyramid levels with
+		// theirs. A PNG of a photo is rarely more than half of its raster
+		auto estimate_panorama_bytes = [&](rapidjson::Document& photometa_document) {
+			auto plan    = extract_tile_plan(photometa_document, download_zoom);
+			size_t bytes = estimate_stitch_bytes(plan) + (size_t)plan.width * plan.height * 2;
+			for(int zoom : pyramid_zooms) {
+				if(zoom != download_zoom) {
+					auto level_plan = extract_tile_plan(photometa_document, zoom);
+					bytes += (size_t)level_plan.width * level_plan.height * 6;
+				}
+			}
+			return bytes;
+		};
+
+		// Every request goes through one event loop, tiles of all panoramas share connections
+		AsyncRuntime runtime(std::thread::hardware_concurrency());
+		AsyncSemaphore panorama_slots(runtime, parallel_panoramas);
+		NearDuplicateIndex near_duplicates(dedup_radius, dedup_bits);
+
+		// Photometa, tiles and image of one panorama, skipped if filter returns false
+		auto download_async = [&](std::string client_id, std::string panorama_id,
+								  std::function<bool(Panorama&)> filter) -> Task<void> {
+			co_await panorama_slots.Acquire();
+			auto start = std::chrono::high_resolution_clock::now();
+
+			// Panoramas of an earlier run are usually unchanged, their metadata is enough to tell
+			bool known              = delta.IsLoaded() && delta.Knows(panorama_id);
+			auto photometa_document = co_await fetch_photometa(runtime, client_id, panorama_id,
+				known ? PHOTOMETA_INFO | PHOTOMETA_LINKS : PHOTOMETA_ALL);
+			if(valid_photometa(photometa_document)) {
+				auto panorama = extract_info(photometa_document);
+				bool download = filter(panorama);
+				if(download && delta.IsLoaded()) {
+					download = delta.Classify(panorama) != DeltaStatus::UNCHANGED;
+					if(!download && catalog.IsOpen()) {
+						// The earlier image is kept, the new catalog still lists it
+						auto record = delta.Previous(panorama.id);
+						record.adjacent.clear();
+						for(auto& adjacent : extract_adjacent_panoramas(photometa_document)) {
+							record.adjacent.push_back(adjacent.id);
+						}
+						catalog.Append(record);
+					} else if(download && known) {
+						// Changed, the tile plan needs the image fields left out before
+						auto full_photometa
+							= co_await fetch_photometa(runtime, client_id, panorama_id);
+						photometa_document.Swap(full_photometa);
+					}
+				}
+				if(download) {
+					sk_sp<SkImage> tile_surface;
+					TileCompleteness completeness;
+					std::string duplicate_of;
+					if(dedup) {
+						// Only a couple of tiles, far cheaper than the download it may save
+						auto thumbnail = co_await download_panorama_async(runtime, panorama.id,
+							DEDUP_ZOOM, photometa_document, &completeness,
+							transparent_background);
+						if(download_zoom == DEDUP_ZOOM) {
+							tile_surface = thumbnail;
+						}
+
+						uint64_t hash;
+						co_await runtime.Offload([&] { hash = perceptual_hash(thumbnail); });
+						// Back on the event loop, of two duplicates in flight the first one wins
+						duplicate_of = near_duplicates.FindOrAdd(
+							panorama.id, panorama.lat, panorama.lng, hash);
+					}
+
+					if(!duplicate_of.empty()) {
+						fmt::print("{} is a near duplicate of {}, skipping\n", panorama.id,
+							duplicate_of);
+						get_metrics().Counter("near_duplicates").Add();
+					} else {
+						// Waits while panoramas in flight and queued writes fill the budget
+						size_t memory_bytes = 0;
+						if(!only_include_json_info) {
+							memory_bytes = estimate_panorama_bytes(photometa_document);
+							co_await reserve_memory_async(runtime, memory_bytes);
+						}
+
+						if(!only_include_json_info && !tile_surface) {
+							// Get panorama image
+							MetricsTimer download_timer(
+								get_metrics().Histogram("panorama_download_us"));
+							tile_surface = co_await download_panorama_async(runtime, panorama.id,
+								download_zoom, photometa_document, &completeness,
+								transparent_background);
+						}
+
+						// PNG encoding is the slowest part, keep it off the event loop
+						co_await runtime.Offload([&] {
+							TraceSpan span("pipeline", "panorama " + panorama.id);
+							write_panorama(panorama, photometa_document, tile_surface, completeness);
+						});
+						// Encoded images still queued are counted by the writer
+						tile_surface.reset();
+						get_memory_budget().Release(memory_bytes);
+
+						auto stop = std::chrono::high_resolution_clock::now();
+						fmt::print("Downloading {} took {}ms\n", panorama_id,
+							std::chrono::duration_cast<std::chrono::milliseconds>(stop - start)
+								.count());
+					}
+				}
+			}
+
+			panorama_slots.Release();
+		};
+
+		// Year and month of a panorama only known from a preview
+		auto fetch_info = [&](std::string client_id, Panorama& panorama) -> Task<void> {
+			auto photometa_document
+				= co_await fetch_photometa(runtime, client_id, panorama.id, PHOTOMETA_INFO);
+			panorama = extract_info(photometa_document);
+		};
+
+		if(!download_area_sub && !download_worker_sub && !download_batch_sub
+			&& (!*lat_option || !*lng_option)) {
+			std::cerr << "--lat and --long are required" << std::endl;
+			return 1;
+		}
+
+		if(download_area_sub) {
+			if(!*area_bbox_option && !*area_polygon_option) {
+				std::cerr << "--bbox or --polygon is required" << std::endl;
+				return 1;
+			}
+			auto parsed_area
+				= *area_bbox_option ? parse_bbox(area_bbox) : parse_polygon(area_polygon);
+			if(!parsed_area) {
+				std::cerr << "Invalid --bbox or --polygon" << std::endl;
+				return 1;
+			}
+			if(range <= 0) {
+				std::cerr << "--range must be positive" << std::endl;
+				return 1;
+			}
+			auto& area = *parsed_area;
+
+			auto start = std::chrono::high_resolution_clock::now();
+
+			auto client_id = download_client_id(curl_handle);
+
+			// Every cell is queried at once, dense cells are split further
+			auto panorama_ids = sweep_area(client_id, area, range, num_panoramas, area_threads);
+
+			auto stop = std::chrono::high_resolution_clock::now();
+			fmt::print("Sweeping area found {} panoramas in {}ms\n", panorama_ids.size(),
+				std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count());
+
+			for(auto& panorama_id : panorama_ids) {
+				runtime.Spawn(download_async(client_id, panorama_id, [&](Panorama& panorama) {
+					// Cells overlap the edges of the area
+					return area.Contains(panorama.lat, panorama.lng)
+						   && is_within_date(year_start, year_end, month_start, month_end, panorama);
+				}));
+			}
+			runtime.Run();
+		} else if(download_worker_sub) {
+			if(!catalog.IsOpen()) {
+				std::cerr << "Workers need --catalog so the coordinator can merge results"
+						  << std::endl;
+				return 1;
+			}
+
+			char hostname[256] = {};
+			gethostname(hostname, sizeof(hostname) - 1);
+			ShardClient shard_client;
+			if(!shard_client.Connect(coordinator_address, fmt::format("{}-{}", hostname, getpid()),
+				   std::filesystem::absolute(catalog_path).string())) {
+				return 1;
+			}
+
+			auto client_id = download_client_id(curl_handle);
+
+			std::string shard;
+			while(!(shard = shard_client.NextShard()).empty()) {
+				auto start = std::chrono::high_resolution_clock::now();
+
+				auto area         = geohash_area(shard);
+				auto panorama_ids = sweep_area(
+					client_id, area, area_range(area), num_panoramas, area_threads);
+
+				int shard_panoramas = 0;
+				for(auto& panorama_id : panorama_ids) {
+					runtime.Spawn(download_async(client_id, panorama_id, [&](Panorama& panorama) {
+						// Each panorama belongs to exactly one shard, neighbours skip it. Shards
+						// on the edge reach outside the area
+						bool in_shard
+							= geohash_encode(panorama.lat, panorama.lng, shard.size()) == shard
+							  && shard_client.GetArea().Contains(panorama.lat, panorama.lng)
+							  && is_within_date(
+								  year_start, year_end, month_start, month_end, panorama);
+						if(in_shard) {
+							shard_panoramas++;
+						}
+						shard_client.Progress(shard, shard_panoramas);
+						return in_shard;
+					}));
+				}
+				runtime.Run();
+
+				// The coordinator counts the shard as done, its records have to be on disk
+				output_writer.Flush();
+				catalog.Flush();
+				shard_client.Finished(shard, shard_panoramas);
+
+				auto stop = std::chrono::high_resolution_clock::now();
+				fmt::print("Shard {} with {} panoramas took {}ms\n", shard, shard_panoramas,
+					std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count());
+			}
+
+			// The coordinator merges catalogs once every worker has disconnected
+			output_writer.Flush();
+			catalog.Close();
+		} else if(download_batch_sub) {
+			auto jobs = read_batch_jobs(batch_jobs_path, num_panoramas, range);
+			if(jobs.empty()) {
+				std::cerr << "No jobs to run in " << batch_jobs_path << std::endl;
+				return 1;
+			}
+
+			auto start = std::chrono::high_resolution_clock::now();
+
+			// Every job shares one client ID, one event loop and its connections
+			auto client_id = download_client_id(curl_handle);
+
+			// Overlapping jobs find the same panoramas, only the first one downloads them
+			std::unordered_set<std::string> claimed;
+			AsyncSemaphore job_slots(runtime, batch_parallel);
+			int jobs_finished    = 0;
+			int total_downloaded = 0;
+
+			auto download_counted = [&](std::string client_id, std::string panorama_id,
+										std::function<bool(Panorama&)> filter,
+										AsyncLatch& latch) -> Task<void> {
+				co_await download_async(client_id, panorama_id, filter);
+				latch.CountDown();
+			};
+
+			auto run_job = [&](BatchJob& job) -> Task<void> {
+				co_await job_slots.Acquire();
+				auto job_start = std::chrono::high_resolution_clock::now();
+
+				auto preview_document = co_await fetch_preview(
+					runtime, client_id, job.num_panoramas, job.lat, job.lng, job.range);
+				std::vector<std::string> panorama_ids;
+				int num_found = 0;
+				if(preview_document.IsArray() && preview_document.Size() > 0
+					&& preview_document[0].IsArray()) {
+					for(auto& panorama_id : extract_panorama_ids(preview_document)) {
+						num_found++;
+						if(claimed.insert(panorama_id).second) {
+							panorama_ids.push_back(panorama_id);
+						}
+					}
+				}
+
+				// Panoramas of the job are queued with those of every other running job
+				int num_downloaded = 0;
+				AsyncLatch latch(runtime, panorama_ids.size());
+				for(auto& panorama_id : panorama_ids) {
+					runtime.Spawn(download_counted(
+						client_id, panorama_id,
+						[&](Panorama& panorama) {
+							bool within_date = is_within_date(
+								year_start, year_end, month_start, month_end, panorama);
+							if(within_date) {
+								num_downloaded++;
+							}
+							return within_date;
+						},
+						latch));
+				}
+				co_await latch;
+
+				jobs_finished++;
+				total_downloaded += num_downloaded;
+				auto job_stop = std::chrono::high_resolution_clock::now();
+				fmt::print("Job {} ({}/{}): {} found, {} shared with other jobs, {} downloaded in "
+						   "{}ms\n",
+					job.name, jobs_finished, jobs.size(), num_found,
+					num_found - panorama_ids.size(), num_downloaded,
+					std::chrono::duration_cast<std::chrono::milliseconds>(job_stop - job_start)
+						.count());
+				job_slots.Release();
+			};
+
+			for(auto& job : jobs) {
+				runtime.Spawn(run_job(job));
+			}
+			runtime.Run();
+
+			auto stop = std::chrono::high_resolution_clock::now();
+			fmt::print("{} jobs downloaded {} panoramas in {}ms\n", jobs.size(), total_downloaded,
+				std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count());
+		} else if(download_recursive_sub) {
 			auto start = std::chrono::high_resolution_clock::now();
 
 			auto client_id = download_client_id(curl_handle);
@@ -113,11 +797,33 @@ int main(int argc, char** argv) {
 			std::unordered_set<std::string> already_downloaded;
 			std::unordered_set<std::string> already_have;
 
+			// Links and dates found by earlier crawls
+			PanoramaGraph graph;
+			if(!graph_path.empty() && std::filesystem::exists(graph_path)) {
+				// Saving at the end would replace it with only this crawl
+				if(!graph.Load(graph_path)) {
+					std::cerr << "Could not load graph " << graph_path << std::endl;
+					return 1;
+				}
+				fmt::print("Loaded graph with {} panoramas\n", graph.NumNodes());
+			}
+
 			// Download initial starting point
 			auto initial_preview_document
 				= download_preview_document(curl_handle, client_id, num_panoramas, lat, lng, range);
-			auto panorama_ids = extract_panorama_ids(initial_preview_document);
-			auto sorted_infos = get_infos(curl_handle, client_id, panorama_ids);
+			std::vector<Panorama> sorted_infos;
+			for(auto& id : extract_panorama_ids(initial_preview_document)) {
+				sorted_infos.push_back(Panorama { .id = id });
+			}
+			for(auto& info : sorted_infos) {
+				auto node = graph.Find(info.id);
+				if(node && graph.GetNode(*node).year) {
+					info = graph.GetPanorama(*node);
+				} else {
+					runtime.Spawn(fetch_info(client_id, info));
+				}
+			}
+			runtime.Run();
 			sort_by_distance(lat, lng, sorted_infos);
 			for(auto& info : sorted_infos) {
 				already_have.emplace(info.id);
@@ -130,23 +836,33 @@ int main(int argc, char** argv) {
 					if(!already_downloaded.count(panorama.id)) {
 						already_downloaded.emplace(panorama.id);
 
-						// Download this one and get its adjacent
-						auto photometa_document
-							= download_photometa(curl_handle, client_id, panorama.id);
-						if(!valid_photometa(photometa_document)) {
-							continue;
+						std::vector<Panorama> adjacent;
+						auto node = graph.Find(panorama.id);
+						if(node && graph.GetNode(*node).expanded) {
+							// Links already known, no need to download anything
+							adjacent = graph.GetAdjacent(*node);
+						} else {
+							// Download this one and get its adjacent
+							auto photometa_document
+								= download_photometa(curl_handle, client_id, panorama.id,
+									PHOTOMETA_INFO | PHOTOMETA_LINKS);
+							if(!valid_photometa(photometa_document)) {
+								continue;
+							}
+							adjacent = extract_adjacent_panoramas(photometa_document);
 						}
-						auto adjacent = extract_adjacent_panoramas(photometa_document);
 
 						// Download photometa for each to get year and month, takes longer
 						// Only do this when year and/or month are specified
 						if(is_date_specified(year_start, year_end, month_start, month_end)) {
 							for(auto& panorama : adjacent) {
-								auto photometa_document
-									= download_photometa(curl_handle, client_id, panorama.id);
-								panorama = extract_info(photometa_document);
+								if(!panorama.year) {
+									runtime.Spawn(fetch_info(client_id, panorama));
+								}
 							}
+							runtime.Run();
 						}
+						graph.Insert(panorama, adjacent);
 
 						// Insert only the ones we don't already have
 						for(auto& info : adjacent) {
@@ -172,74 +888,27 @@ int main(int argc, char** argv) {
 				}
 			}
 
+			if(!graph_path.empty()) {
+				graph.Save(graph_path);
+			}
+
 			auto stop = std::chrono::high_resolution_clock::now();
 			fmt::print("Downloading panorama list took {}ms\n",
 				std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count());
 
 			// Download all the panoramas within the distance
-			for(auto& panorama : sorted_infos) {
-				if(is_within_distance_and_date(lat, lng, recursive_radius, year_start, year_end,
-					   month_start, month_end, panorama)) {
-					auto start = std::chrono::high_resolution_clock::now();
-
-					// Obtain photometa for tiles dimensions and date
-					auto photometa_document
-						= download_photometa(curl_handle, client_id, panorama.id);
-					if(!valid_photometa(photometa_document)) {
-						continue;
-					}
-					panorama = extract_info(photometa_document);
-
-					// Location
-					auto location = extract_location(photometa_document);
-
-					std::string filename = fmt::format(fmt::runtime(filepath_format + ".png"),
-						fmt::arg("id", panorama.id), fmt::arg("year", panorama.year),
-						fmt::arg("month", panorama.month), fmt::arg("street", location.street),
-						fmt::arg("city", location.city_and_state), fmt::arg("lat", panorama.lat),
-						fmt::arg("long", panorama.lng));
-					std::filesystem::create_directories(
-						std::filesystem::path(filename).parent_path());
-
-					if(!only_include_json_info) {
-						// Get panorama image
-						auto tile_surface = download_panorama(
-							curl_handle, panorama.id, streetview_zoom, photometa_document);
-
-						auto tile_data = tile_surface->encodeToData(SkEncodedImageFormat::kPNG, 95);
-						std::ofstream outfile(filename + ".png", std::ios::out | std::ios::binary);
-						outfile.write((const char*)tile_data->bytes(), tile_data->size());
-						outfile.close();
-					}
-
-					if(include_json_info || only_include_json_info) {
-						// Include JSON info alongside
-						rapidjson::Document infoJson(rapidjson::kObjectType);
-						infoJson.AddMember("id", panorama.id, infoJson.GetAllocator());
-						infoJson.AddMember("year", panorama.year, infoJson.GetAllocator());
-						infoJson.AddMember("month", panorama.month, infoJson.GetAllocator());
-						infoJson.AddMember(
-							"location", location.city_and_state, infoJson.GetAllocator());
-						infoJson.AddMember("lat", panorama.lat, infoJson.GetAllocator());
-						infoJson.AddMember("long", panorama.lng, infoJson.GetAllocator());
-
-						rapidjson::StringBuffer infoSb;
-						rapidjson::PrettyWriter<rapidjson::StringBuffer> infoWriter(infoSb);
-						infoWriter.SetIndent('\t', 1);
-						infoJson.Accept(infoWriter);
-
-						// Write to filesystem at the same location the panorama is
-						std::ofstream infoFile(filename + ".json", std::ios::out);
-						infoFile.write(infoSb.GetString(), infoSb.GetLength());
-						infoFile.close();
-					}
-
-					auto stop = std::chrono::high_resolution_clock::now();
-					fmt::print("Downloading {} took {}ms\n", panorama.id,
-						std::chrono::duration_cast<std::chrono::milliseconds>(stop - start)
-							.count());
+			PanoramaColumns columns(sorted_infos);
+			std::vector<uint8_t> selected(columns.Size());
+			select_within_distance_and_date(lat, lng, recursive_radius, year_start, year_end,
+				month_start, month_end, columns, selected.data());
+			for(int i = 0; i < sorted_infos.size(); i++) {
+				if(selected[i]) {
+					// Photometa is downloaded again for tiles dimensions
+					runtime.Spawn(download_async(
+						client_id, sorted_infos[i].id, [](Panorama&) { return true; }));
 				}
 			}
+			runtime.Run();
 		} else {
 			std::chrono::time_point<std::chrono::steady_clock> start;
 			std::chrono::time_point<std::chrono::steady_clock> stop;
@@ -258,79 +927,158 @@ int main(int argc, char** argv) {
 				std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count());
 
 			for(auto& panorama_id : extract_panorama_ids(preview_document)) {
-				start = std::chrono::high_resolution_clock::now();
+				// Check if it is within the range
+				runtime.Spawn(download_async(client_id, panorama_id, [&](Panorama& panorama) {
+					return is_within_date(year_start, year_end, month_start, month_end, panorama);
+				}));
+			}
+			runtime.Run();
+		}
 
-				// Get photometa
-				auto photometa_document = download_photometa(curl_handle, client_id, panorama_id);
+		if(delta.IsLoaded()) {
+			fmt::print("{}", delta.Summary());
+			if(!delta_report_path.empty()) {
+				delta.WriteReport(delta_report_path);
+			}
+		}
 
-				// Get info
-				auto panorama = extract_info(photometa_document);
+		output_writer.Flush();
+		fmt::print("Memory reserved peaked at {}MB of a {}MB budget\n",
+			get_memory_budget().GetHighWater() >> 20, get_memory_budget().GetLimit() >> 20);
+		catalog.Close();
+		curl_easy_cleanup(curl_handle);
+		curl_global_cleanup();
+		fmt::print("{}", get_metrics().Summary());
+	} else if(coordinate_sub) {
+		if(!*coordinate_bbox_option && !*coordinate_polygon_option) {
+			std::cerr << "--bbox or --polygon is required" << std::endl;
+			return 1;
+		}
+		auto parsed_area
+			= *coordinate_bbox_option ? parse_bbox(area_bbox) : parse_polygon(area_polygon);
+		if(!parsed_area) {
+			std::cerr << "Invalid --bbox or --polygon" << std::endl;
+			return 1;
+		}
+		auto& area = *parsed_area;
 
-				// Check if it is within the range
-				if(is_within_date(year_start, year_end, month_start, month_end, panorama)) {
-					// Get panorama
-					auto tile_surface = download_panorama(
-						curl_handle, panorama_id, streetview_zoom, photometa_document);
-
-					// Location
-					auto location = extract_location(photometa_document);
-
-					std::string filename = fmt::format(fmt::runtime(filepath_format),
-						fmt::arg("id", panorama_id), fmt::arg("year", panorama.year),
-						fmt::arg("month", panorama.month), fmt::arg("street", location.street),
-						fmt::arg("city", location.city_and_state), fmt::arg("lat", panorama.lat),
-						fmt::arg("long", panorama.lng));
-					std::filesystem::create_directories(
-						std::filesystem::path(filename).parent_path());
-
-					if(!only_include_json_info) {
-						auto tile_data = tile_surface->encodeToData(SkEncodedImageFormat::kPNG, 95);
-						std::ofstream outfile(filename + ".png", std::ios::out | std::ios::binary);
-						outfile.write((const char*)tile_data->bytes(), tile_data->size());
-						outfile.close();
-					}
+		auto shards = geohash_cover(area, geohash_precision);
+		fmt::print("Split area into {} shards\n", shards.size());
 
-					if(include_json_info || only_include_json_info) {
-						// Include JSON info alongside
-						rapidjson::Document infoJson(rapidjson::kObjectType);
-						infoJson.AddMember("id", panorama_id, infoJson.GetAllocator());
-						infoJson.AddMember("year", panorama.year, infoJson.GetAllocator());
-						infoJson.AddMember("month", panorama.month, infoJson.GetAllocator());
-						infoJson.AddMember(
-							"location", location.city_and_state, infoJson.GetAllocator());
-						infoJson.AddMember("lat", panorama.lat, infoJson.GetAllocator());
-						infoJson.AddMember("long", panorama.lng, infoJson.GetAllocator());
-
-						rapidjson::StringBuffer infoSb;
-						rapidjson::PrettyWriter<rapidjson::StringBuffer> infoWriter(infoSb);
-						infoWriter.SetIndent('\t', 1);
-						infoJson.Accept(infoWriter);
-
-						// Write to filesystem at the same location the panorama is
-						std::ofstream infoFile(filename + ".json", std::ios::out);
-						infoFile.write(infoSb.GetString(), infoSb.GetLength());
-						infoFile.close();
-					}
+		ShardCoordinator coordinator(shards, area, worker_timeout);
+		if(!coordinator.Listen(coordinator_bind, coordinator_port)) {
+			return 1;
+		}
+		coordinator.Run();
 
-					stop = std::chrono::high_resolution_clock::now();
-					fmt::print("Downloading {} took {}ms\n", panorama_id,
-						std::chrono::duration_cast<std::chrono::milliseconds>(stop - start)
-							.count());
-				}
+		// Workers write their own catalogs, assumed reachable from here
+		int num_merged = merge_catalogs(coordinator.GetWorkerCatalogs(), catalog_path,
+			catalog_format_from_string(catalog_format));
+		fmt::print("Merged {} unique panoramas into {}\n", num_merged, catalog_path);
+		curl_global_cleanup();
+	} else if(graph_sub) {
+		PanoramaGraph graph;
+		if(!graph.Load(graph_path)) {
+			std::cerr << "Could not load graph " << graph_path << std::endl;
+			return 1;
+		}
+		auto from = graph.Find(graph_from);
+		if(!from) {
+			std::cerr << graph_from << " is not in the graph" << std::endl;
+			return 1;
+		}
+
+		std::vector<uint32_t> nodes;
+		if(!graph_to.empty()) {
+			auto to = graph.Find(graph_to);
+			if(to) {
+				nodes = graph.ShortestPath(*from, *to);
 			}
+			if(nodes.empty()) {
+				std::cerr << "No path to " << graph_to << std::endl;
+				return 1;
+			}
+		} else if(graph_heading >= 0) {
+			// Turns of up to 45 degrees still follow the road
+			double radians_per_degree = 3.14159265358979323846 / 180.0;
+			nodes = graph.Walk(*from, graph_heading * radians_per_degree,
+				45 * radians_per_degree, graph_steps);
+		} else {
+			nodes = graph.Bfs(*from, graph_depth);
 		}
 
+		for(auto node : nodes) {
+			auto& info = graph.GetNode(node);
+			fmt::print("{} {} {}\n", info.id, info.lat, info.lng);
+		}
+	} else if(export_sfm_sub) {
+		auto records = read_catalog(catalog_path);
+		if(!export_sfm(records, sfm_output, sfm_pairs_from_string(sfm_pairs), sfm_neighbours)) {
+			return 1;
+		}
+	} else if(repair_sub) {
+		auto curl_handle = curl_easy_init();
+		int num_remaining = run_repair_queue(curl_handle, repair_queue_path);
+		fmt::print("{} panoramas still incomplete\n", num_remaining);
 		curl_easy_cleanup(curl_handle);
 		curl_global_cleanup();
+		fmt::print("{}", get_metrics().Summary());
+	} else if(serve_sub) {
+		if(!serve_port && serve_socket.empty()) {
+			std::cerr << "--port or --socket is required" << std::endl;
+			return 1;
+		}
+		PanoramaServer server(serve_threads, streetview_zoom, (size_t)serve_cache_mb << 20);
+		if(serve_port && !server.Listen(serve_port)) {
+			return 1;
+		}
+		if(!serve_socket.empty() && !server.ListenUnix(serve_socket)) {
+			return 1;
+		}
+		server.Run();
 	} else if(render_sub) {
 		auto curl_handle = curl_easy_init();
-		InterfaceWindow window(
-			initial_id, streetview_zoom, curl_handle, year_start, year_end, month_start, month_end);
-		window.PrepareWindow();
-		while(!window.ShouldClose()) {
-			window.DrawFrame();
+		bool render_failed = false;
+		{
+			// Its transition thread uses curl_handle until destroyed
+			InterfaceWindow window(initial_id, streetview_zoom, curl_handle, year_start, year_end,
+				month_start, month_end, fixtures_directory);
+			window.SetCrossfade(crossfade);
+			if(!graph_path.empty() && std::filesystem::exists(graph_path)
+				&& !window.LoadGraph(graph_path)) {
+				// Keep the file instead of replacing it with only this session
+				std::cerr << "Could not load graph " << graph_path << ", not saving it"
+						  << std::endl;
+				graph_path.clear();
+			}
+			if(!save_fixtures_directory.empty()) {
+				window.SaveFixtures(save_fixtures_directory);
+			}
+
+			if(!benchmark_path.empty()) {
+				auto events   = read_viewer_events(benchmark_path);
+				render_failed = !window.PrepareHeadless(benchmark_width, benchmark_height);
+				if(!render_failed) {
+					fmt::print("{}", run_viewer_benchmark(window, events));
+				}
+			} else {
+				render_failed = !window.PrepareWindow()
+								|| (!record_path.empty() && !window.RecordEvents(record_path));
+				if(render_failed) {
+					std::cerr << "Could not open a window" << std::endl;
+				}
+				while(!render_failed && !window.ShouldClose()) {
+					window.DrawFrame();
+				}
+			}
+			if(!graph_path.empty()) {
+				window.SaveGraph(graph_path);
+			}
 		}
 		curl_easy_cleanup(curl_handle);
+		if(render_failed) {
+			return 1;
+		}
 	}
 
 	return 0;
@@ -0,0 +1,271 @@
+#include "metrics.hpp"
+
+#include <fmt/format.h>
+
+#include <bit>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+void MetricsGauge::Set(int64_t new_value) {
+	value = new_value;
+	int64_t current_max = max;
+	while(new_value > current_max && !max.compare_exchange_weak(current_max, new_value)) { }
+}
+
+void MetricsGauge::Add(int64_t amount) {
+	int64_t new_value   = value += amount;
+	int64_t current_max = max;
+	while(new_value > current_max && !max.compare_exchange_weak(current_max, new_value)) { }
+}
+
+int MetricsHistogram::BucketIndex(uint64_t value) {
+	if(value < SUB_BUCKETS) {
+		return value;
+	}
+	// Top 5 bits select the power of two and the linear sub bucket inside it
+	int exponent = 63 - std::countl_zero(value);
+	int sub      = (value >> (exponent - 4)) & (SUB_BUCKETS - 1);
+	return std::min(NUM_BUCKETS - 1, SUB_BUCKETS + (exponent - 4) * SUB_BUCKETS + sub);
+}
+
+uint64_t MetricsHistogram::BucketUpperBound(int index) {
+	if(index < SUB_BUCKETS) {
+		return index;
+	}
+	int exponent = (index - SUB_BUCKETS) / SUB_BUCKETS + 4;
+	int sub      = (index - SUB_BUCKETS) % SUB_BUCKETS;
+	return (((uint64_t)SUB_BUCKETS + sub + 1) << (exponent - 4)) - 1;
+}
+
+void MetricsHistogram::Record(uint64_t value) {
+	buckets[BucketIndex(value)]++;
+	count++;
+	sum += value;
+	uint64_t current_max = max;
+	while(value > current_max && !max.compare_exchange_weak(current_max, value)) { }
+}
+
+uint64_t MetricsHistogram::Percentile(double percentile) {
+	uint64_t total = count;
+	if(total == 0) {
+		return 0;
+	}
+	uint64_t target     = std::max<uint64_t>(1, total * percentile / 100.0);
+	uint64_t cumulative = 0;
+	for(int i = 0; i < NUM_BUCKETS; i++) {
+		cumulative += buckets[i];
+		if(cumulative >= target) {
+			return std::min<uint64_t>(BucketUpperBound(i), max);
+		}
+	}
+	return max;
+}
+
+uint64_t MetricsHistogram::CountAtOrBelow(uint64_t value) {
+	uint64_t cumulative = 0;
+	for(int i = 0; i < NUM_BUCKETS && BucketUpperBound(i) <= value; i++) {
+		cumulative += buckets[i];
+	}
+	return cumulative;
+}
+
+MetricsRegistry::~MetricsRegistry() {
+	run_threads = false;
+	if(server_thread.joinable()) {
+		server_thread.join();
+	}
+	if(stats_file_thread.joinable()) {
+		stats_file_thread.join();
+	}
+}
+
+MetricsCounter& MetricsRegistry::Counter(std::string name, std::string labels) {
+	std::scoped_lock lock { metrics_m };
+	auto& counter = counters[name + labels];
+	if(!counter) {
+		counter = std::make_unique<MetricsCounter>();
+	}
+	return *counter;
+}
+
+MetricsGauge& MetricsRegistry::Gauge(std::string name, std::string labels) {
+	std::scoped_lock lock { metrics_m };
+	auto& gauge = gauges[name + labels];
+	if(!gauge) {
+		gauge = std::make_unique<MetricsGauge>();
+	}
+	return *gauge;
+}
+
+MetricsHistogram& MetricsRegistry::Histogram(std::string name, std::string labels) {
+	std::scoped_lock lock { metrics_m };
+	auto& histogram = histograms[name + labels];
+	if(!histogram) {
+		histogram = std::make_unique<MetricsHistogram>();
+	}
+	return *histogram;
+}
+
+// Splits request_latency_us{type="tile"} into the name and the labels without braces
+static std::pair<std::string, std::string> split_key(const std::string& key) {
+	auto brace = key.find('{');
+	if(brace == std::string::npos) {
+		return std::make_pair(key, "");
+	}
+	return std::make_pair(key.substr(0, brace), key.substr(brace + 1, key.size() - brace - 2));
+}
+
+static std::string with_label(std::string labels, std::string extra) {
+	return "{" + (labels.empty() ? extra : labels + "," + extra) + "}";
+}
+
+std::string MetricsRegistry::PrometheusText() {
+	std::scoped_lock lock { metrics_m };
+	std::string text;
+	std::string last_name;
+
+	for(auto& [key, counter] : counters) {
+		auto [name, labels] = split_key(key);
+		if(name != last_name) {
+			text += fmt::format("# TYPE streetview_{} counter\n", name);
+			last_name = name;
+		}
+		text += fmt::format("streetview_{} {}\n", key, counter->Get());
+	}
+	for(auto& [key, gauge] : gauges) {
+		auto [name, labels] = split_key(key);
+		if(name != last_name) {
+			text += fmt::format("# TYPE streetview_{} gauge\n", name);
+			last_name = name;
+		}
+		text += fmt::format("streetview_{} {}\n", key, gauge->Get());
+	}
+	for(auto& [key, histogram] : histograms) {
+		auto [name, labels] = split_key(key);
+		if(name != last_name) {
+			text += fmt::format("# TYPE streetview_{} histogram\n", name);
+			last_name = name;
+		}
+		// Powers of two line up with bucket edges so these counts are exact
+		for(uint64_t bound = 1 << 7; bound <= (1ull << 30); bound <<= 2) {
+			text += fmt::format("streetview_{}_bucket{} {}\n", name,
+				with_label(labels, fmt::format("le=\"{}\"", bound - 1)),
+				histogram->CountAtOrBelow(bound - 1));
+		}
+		text += fmt::format("streetview_{}_bucket{} {}\n", name, with_label(labels, "le=\"+Inf\""),
+			histogram->Count());
+		text += fmt::format("streetview_{}_sum{} {}\n", name,
+			labels.empty() ? "" : "{" + labels + "}", histogram->Sum());
+		text += fmt::format("streetview_{}_count{} {}\n", name,
+			labels.empty() ? "" : "{" + labels + "}", histogram->Count());
+	}
+	return text;
+}
+
+std::string MetricsRegistry::Summary() {
+	std::scoped_lock lock { metrics_m };
+	std::string text = "Metrics summary\n";
+	for(auto& [key, counter] : counters) {
+		text += fmt::format("  {:<48} {}\n", key, counter->Get());
+	}
+	for(auto& [key, gauge] : gauges) {
+		text += fmt::format("  {:<48} {} (max {})\n", key, gauge->Get(), gauge->GetMax());
+	}
+	for(auto& [key, histogram] : histograms) {
+		if(histogram->Count() == 0) {
+			continue;
+		}
+		bool timing = key.find("_us") != std::string::npos;
+		auto format = [timing](uint64_t value) {
+			return timing ? fmt::format("{:.1f}ms", value / 1000.0) : fmt::format("{}", value);
+		};
+		text += fmt::format("  {:<48} n={} p50={} p90={} p99={} max={}\n", key,
+			histogram->Count(), format(histogram->Percentile(50)),
+			format(histogram->Percentile(90)), format(histogram->Percentile(99)),
+			format(histogram->Max()));
+	}
+	return text;
+}
+
+bool MetricsRegistry::StartServer(int port) {
+	server_fd = socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+	setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	sockaddr_in address {};
+	address.sin_family      = AF_INET;
+	address.sin_port        = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(server_fd, (sockaddr*)&address, sizeof(address)) != 0
+		|| listen(server_fd, 16) != 0) {
+		std::cerr << "Could not serve metrics on port " << port << std::endl;
+		close(server_fd);
+		return false;
+	}
+
+	server_thread = std::thread(&MetricsRegistry::ServerThread, this);
+	return true;
+}
+
+void MetricsRegistry::ServerThread() {
+	while(run_threads) {
+		pollfd server_poll { .fd = server_fd, .events = POLLIN };
+		if(poll(&server_poll, 1, 250) <= 0) {
+			continue;
+		}
+
+		int fd = accept(server_fd, nullptr, nullptr);
+		if(fd == -1) {
+			continue;
+		}
+
+		// Every path returns the metrics, so the request itself is not parsed
+		char request[4096];
+		pollfd client_poll { .fd = fd, .events = POLLIN };
+		if(poll(&client_poll, 1, 1000) > 0) {
+			read(fd, request, sizeof(request));
+		}
+
+		auto body     = PrometheusText();
+		auto response = fmt::format("HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+									"Content-Length: {}\r\nConnection: close\r\n\r\n{}",
+			body.size(), body);
+		send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+		close(fd);
+	}
+	close(server_fd);
+}
+
+void MetricsRegistry::StartStatsFile(std::string path, int interval_seconds) {
+	stats_file_thread
+		= std::thread(&MetricsRegistry::StatsFileThread, this, path, interval_seconds);
+}
+
+void MetricsRegistry::StatsFileThread(std::string path, int interval_seconds) {
+	auto next_write = std::chrono::steady_clock::now();
+	while(run_threads) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(250));
+		if(std::chrono::steady_clock::now() < next_write && run_threads) {
+			continue;
+		}
+		next_write += std::chrono::seconds(interval_seconds);
+
+		// Replace atomically so readers never see a partial file
+		auto text = PrometheusText();
+		std::ofstream stats_file(path + ".tmp", std::ios::out | std::ios::trunc);
+		stats_file.write(text.data(), text.size());
+		stats_file.close();
+		std::rename((path + ".tmp").c_str(), path.c_str());
+	}
+}
+
+MetricsRegistry& get_metrics() {
+	static MetricsRegistry metrics;
+	return metrics;
+}
\ No newline at end of file
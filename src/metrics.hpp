@@ -0,0 +1,119 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class MetricsCounter {
+public:
+	void Add(uint64_t amount = 1) {
+		value += amount;
+	}
+	uint64_t Get() {
+		return value;
+	}
+
+private:
+	std::atomic<uint64_t> value = 0;
+};
+
+class MetricsGauge {
+public:
+	void Set(int64_t new_value);
+	void Add(int64_t amount);
+	int64_t Get() {
+		return value;
+	}
+	int64_t GetMax() {
+		return max;
+	}
+
+private:
+	std::atomic<int64_t> value = 0;
+	std::atomic<int64_t> max   = 0;
+};
+
+// HDR style histogram, 16 linear sub buckets per power of two. Relative error is at most
+// 1/16 across the whole range and recording is a few atomic adds
+class MetricsHistogram {
+public:
+	void Record(uint64_t value);
+	uint64_t Count() {
+		return count;
+	}
+	uint64_t Sum() {
+		return sum;
+	}
+	uint64_t Max() {
+		return max;
+	}
+	uint64_t Percentile(double percentile);
+	uint64_t CountAtOrBelow(uint64_t value);
+
+private:
+	static constexpr int SUB_BUCKETS = 16;
+	static constexpr int NUM_BUCKETS = SUB_BUCKETS + 60 * SUB_BUCKETS;
+	static int BucketIndex(uint64_t value);
+	static uint64_t BucketUpperBound(int index);
+
+	std::array<std::atomic<uint64_t>, NUM_BUCKETS> buckets {};
+	std::atomic<uint64_t> count = 0;
+	std::atomic<uint64_t> sum   = 0;
+	std::atomic<uint64_t> max   = 0;
+};
+
+// Metrics are keyed by name plus Prometheus labels, e.g. request_latency_us{type="tile"}.
+// Histograms named *_us are timings in microseconds. Looking a metric up takes a lock, hot paths
+// keep the returned reference, it stays valid for the life of the registry
+class MetricsRegistry {
+public:
+	~MetricsRegistry();
+
+	MetricsCounter& Counter(std::string name, std::string labels = "");
+	MetricsGauge& Gauge(std::string name, std::string labels = "");
+	MetricsHistogram& Histogram(std::string name, std::string labels = "");
+
+	std::string PrometheusText();
+	std::string Summary();
+	bool StartServer(int port);
+	void StartStatsFile(std::string path, int interval_seconds);
+
+private:
+	void ServerThread();
+	void StatsFileThread(std::string path, int interval_seconds);
+
+	std::map<std::string, std::unique_ptr<MetricsCounter>> counters;
+	std::map<std::string, std::unique_ptr<MetricsGauge>> gauges;
+	std::map<std::string, std::unique_ptr<MetricsHistogram>> histograms;
+	std::mutex metrics_m;
+
+	std::atomic<bool> run_threads = true;
+	int server_fd                 = -1;
+	std::thread server_thread;
+	std::thread stats_file_thread;
+};
+
+MetricsRegistry& get_metrics();
+
+// Records the time between construction and destruction into a *_us histogram
+class MetricsTimer {
+public:
+	MetricsTimer(MetricsHistogram& histogram)
+		: histogram(histogram)
+		, start(std::chrono::steady_clock::now()) { }
+	~MetricsTimer() {
+		histogram.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start)
+							 .count());
+	}
+
+private:
+	MetricsHistogram& histogram;
+	std::chrono::steady_clock::time_point start;
+};
\ No newline at end of file
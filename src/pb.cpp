@@ -0,0 +1,97 @@
+#include "pb.hpp"
+
+#include <fmt/format.h>
+
+std::string pb_escape(std::string value) {
+	std::string escaped;
+	escaped.reserve(value.size());
+	for(char c : value) {
+		if(c == '!') {
+			escaped += "*21";
+		} else if(c == '*') {
+			escaped += "*2A";
+		} else {
+			escaped.push_back(c);
+		}
+	}
+	return escaped;
+}
+
+void PbMessage::Append(int field, char type, std::string value) {
+	pieces.back() += fmt::format("!{}{}{}", field, type, value);
+	num_tokens++;
+}
+
+PbMessage& PbMessage::Message(int field, const PbMessage& message) {
+	Append(field, 'm', std::to_string(message.num_tokens));
+	pieces.back() += message.pieces[0];
+	for(int i = 0; i < message.slots.size(); i++) {
+		slots.push_back(message.slots[i]);
+		pieces.push_back(message.pieces[i + 1]);
+	}
+	num_tokens += message.num_tokens;
+	return *this;
+}
+
+PbMessage& PbMessage::String(int field, std::string value) {
+	Append(field, 's', pb_escape(value));
+	return *this;
+}
+
+PbMessage& PbMessage::Int(int field, int64_t value) {
+	Append(field, 'i', std::to_string(value));
+	return *this;
+}
+
+PbMessage& PbMessage::Enum(int field, int value) {
+	Append(field, 'e', std::to_string(value));
+	return *this;
+}
+
+PbMessage& PbMessage::Bool(int field, bool value) {
+	Append(field, 'b', value ? "1" : "0");
+	return *this;
+}
+
+PbMessage& PbMessage::Double(int field, double value) {
+	Append(field, 'd', fmt::format("{}", value));
+	return *this;
+}
+
+PbMessage& PbMessage::Placeholder(int field, char type) {
+	Append(field, type, "");
+	slots.push_back(type);
+	pieces.push_back("");
+	return *this;
+}
+
+PbTemplate::PbTemplate(std::string prefix, const PbMessage& message)
+	: pieces(message.pieces)
+	, slots(message.slots) {
+	pieces[0] = prefix + pieces[0];
+	for(auto& piece : pieces) {
+		fixed_size += piece.size();
+	}
+}
+
+std::string PbTemplate::Fill(std::vector<PbValue> values) const {
+	std::string url;
+	url.reserve(fixed_size + values.size() * 24);
+	url += pieces[0];
+	for(int i = 0; i < slots.size(); i++) {
+		if(i < values.size()) {
+			auto& value = values[i];
+			if(auto string = std::get_if<std::string>(&value)) {
+				url += pb_escape(*string);
+			} else if(auto integer = std::get_if<int64_t>(&value)) {
+				url += std::to_string(*integer);
+			} else if(auto number = std::get_if<double>(&value)) {
+				url += fmt::format("{}", *number);
+			} else {
+				url += std::get<bool>(value) ? "1" : "0";
+			}
+		}
+		url += pieces[i + 1];
+	}
+	return url;
+}
\ No newline at end of file
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <variant>
+#include <vector>
+
+// Encoder for the "pb" URL parameter used by Maps endpoints, protobuf fields flattened into
+// !<field><type><value> tokens. Types are m (message), s (string), i (integer), e (enum),
+// b (bool) and d (double). A message is written as !<field>m<count> followed by its fields,
+// where count is the number of tokens nested inside it
+class PbMessage {
+public:
+	PbMessage& Message(int field, const PbMessage& message);
+	PbMessage& String(int field, std::string value);
+	PbMessage& Int(int field, int64_t value);
+	PbMessage& Enum(int field, int value);
+	PbMessage& Bool(int field, bool value);
+	PbMessage& Double(int field, double value);
+	// Value given later to PbTemplate::Fill, in order of appearance
+	PbMessage& Placeholder(int field, char type);
+
+	int NumTokens() const {
+		return num_tokens;
+	}
+
+private:
+	friend class PbTemplate;
+
+	void Append(int field, char type, std::string value);
+
+	// Encoded text between placeholders, always one more than slots
+	std::vector<std::string> pieces { "" };
+	std::vector<char> slots;
+	int num_tokens = 0;
+};
+
+using PbValue = std::variant<std::string, int64_t, double, bool>;
+
+// A message encoded once with its placeholders, filling it only concatenates strings
+class PbTemplate {
+public:
+	PbTemplate(std::string prefix, const PbMessage& message);
+
+	std::string Fill(std::vector<PbValue> values) const;
+
+private:
+	std::vector<std::string> pieces;
+	std::vector<char> slots;
+	size_t fixed_size = 0;
+};
+
+// Strings can't contain the token separator, ! and * are escaped as *21 and *2A
+std::string pb_escape(std::string value);
\ No newline at end of file
@@ -1,9 +1,26 @@
 #include "preloader.hpp"
 
+#include <core/SkData.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
 #include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 
 #include "download.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+PanoramaPreloader::~PanoramaPreloader() {
+	run_threads = false;
+	for(auto& thread : threads) {
+		thread.join();
+	}
+}
 
 void PanoramaPreloader::Start(int num_threads) {
 	// Create all the threads
@@ -15,32 +32,62 @@ void PanoramaPreloader::Start(int num_threads) {
 void PanoramaPreloader::QueuePanorama(std::string id) {
 	std::scoped_lock lock { queued_panoramas_m, panoramas_m };
 	// Panorama must not already be downloaded and the queue must be smaller than 100
-	if(!panoramas.count(id) && queued_panoramas.size() < 100) {
+	if(!panoramas.count(id) && !downloading.count(id) && queued_panoramas.size() < 100) {
 		queued_panoramas.emplace_back(id);
+		get_metrics().Gauge("preloader_queue_depth").Set(queued_panoramas.size());
+	}
+}
+
+void PanoramaPreloader::ReplaceQueue(std::vector<std::string> ids) {
+	std::scoped_lock lock { queued_panoramas_m, panoramas_m };
+	queued_panoramas.clear();
+	for(auto& id : ids) {
+		if(!panoramas.count(id) && !downloading.count(id) && queued_panoramas.size() < 100) {
+			queued_panoramas.emplace_back(id);
+		}
 	}
+	get_metrics().Gauge("preloader_queue_depth").Set(queued_panoramas.size());
 }
 
-std::shared_ptr<PanoramaDownload> PanoramaPreloader::GetPanorama(std::string id, bool force) {
-	panoramas_m.lock();
-	bool have_panorama = panoramas.count(id);
+std::shared_ptr<PanoramaDownload> PanoramaPreloader::GetPanorama(
+	std::string id, bool force, CURL* handle) {
+	std::unique_lock lock { panoramas_m };
+	if(force && downloading.count(id)) {
+		// Prefetch already started, finishing it is faster than starting over
+		get_metrics().Counter("preloader_cache", "{result=\"wait\"}").Add();
+		panoramas_cv.wait(lock, [&] { return !downloading.count(id); });
+	}
 
+	auto entry         = panoramas.find(id);
+	bool have_panorama = entry != panoramas.end();
+	get_metrics()
+		.Counter("preloader_cache", have_panorama ? "{result=\"hit\"}" : "{result=\"miss\"}")
+		.Add();
 	if(have_panorama) {
-		auto info = panoramas[id];
-		panoramas_m.unlock();
+		entry->second.last_used = use_counter++;
+		return entry->second.download;
+	} else if(force) {
+		// Download regardless on the current thread
+		downloading.insert(id);
+		lock.unlock();
+		auto info = DownloadPanorama(id, handle ? handle : curl_handle);
+		lock.lock();
+		downloading.erase(id);
+		AddToCache(id, info);
+		panoramas_cv.notify_all();
 		return info;
 	} else {
-		panoramas_m.unlock();
-		if(force) {
-			// Download regardless on the current thread
-			auto info = DownloadPanorama(id, curl_handle);
-			return info;
-		} else {
-			// Don't force download
-			return nullptr;
-		}
+		// Don't force download
+		return nullptr;
 	}
 }
 
+std::shared_ptr<PanoramaDownload> PanoramaPreloader::PeekPanorama(std::string id) {
+	std::scoped_lock lock { panoramas_m };
+	auto entry = panoramas.find(id);
+	return entry != panoramas.end() ? entry->second.download : nullptr;
+}
+
 void PanoramaPreloader::PanoramaThread() {
 	CURL* curl_handle = curl_easy_init();
 
@@ -54,21 +101,26 @@ void PanoramaPreloader::PanoramaThread() {
 		}
 		std::string id = queued_panoramas.front();
 		queued_panoramas.pop_front();
+		get_metrics().Gauge("preloader_queue_depth").Set(queued_panoramas.size());
 		queued_panoramas_m.unlock();
 
 		panoramas_m.lock();
-		if(panoramas.count(id)) {
+		if(panoramas.count(id) || downloading.count(id)) {
 			// Ignore this panorama, we already downloaded it
 			panoramas_m.unlock();
 			continue;
 		}
+		downloading.insert(id);
 		panoramas_m.unlock();
 
+		TraceSpan span("preloader", "preload " + id);
 		auto info = DownloadPanorama(id, curl_handle);
 
 		panoramas_m.lock();
-		panoramas[id] = info;
+		downloading.erase(id);
+		AddToCache(id, info);
 		panoramas_m.unlock();
+		panoramas_cv.notify_all();
 	}
 
 	curl_easy_cleanup(curl_handle);
@@ -76,7 +128,16 @@ void PanoramaPreloader::PanoramaThread() {
 
 std::shared_ptr<PanoramaDownload> PanoramaPreloader::DownloadPanorama(
 	std::string id, CURL* handle) {
-	std::scoped_lock lock { info_m };
+	// Copy settings so preloader threads don't download one at a time
+	info_m.lock();
+	auto client_id         = this->client_id;
+	auto streetview_zoom   = this->streetview_zoom;
+	auto fixture_directory = this->fixture_directory;
+	info_m.unlock();
+
+	if(!fixture_directory.empty()) {
+		return load_fixture(fixture_directory, id);
+	}
 
 	// Get photometa
 	auto photmeta_document = download_photometa(handle, client_id, id);
@@ -89,4 +150,82 @@ std::shared_ptr<PanoramaDownload> PanoramaPreloader::DownloadPanorama(
 	info->image = image;
 	info->photometa.Swap(photmeta_document);
 	return info;
+}
+
+void PanoramaPreloader::AddToCache(std::string id, std::shared_ptr<PanoramaDownload> download) {
+	if(!download->image) {
+		// Failures take no bytes and would never be evicted, the next request tries again
+		get_metrics().Counter("preloader_failures").Add();
+		return;
+	}
+	size_t bytes = download->image->imageInfo().computeMinByteSize();
+	panoramas[id] = CacheEntry {
+		.download  = download,
+		.bytes     = bytes,
+		.last_used = use_counter++,
+	};
+	cache_bytes += bytes;
+
+	// Never drops the panorama just added
+	while(cache_bytes > cache_budget && panoramas.size() > 1) {
+		auto oldest = std::min_element(panoramas.begin(), panoramas.end(),
+			[](auto& a, auto& b) { return a.second.last_used < b.second.last_used; });
+		cache_bytes -= oldest->second.bytes;
+		panoramas.erase(oldest);
+		get_metrics().Counter("preloader_evictions").Add();
+	}
+	get_metrics().Gauge("preloader_cache_bytes").Set(cache_bytes);
+}
+
+bool save_fixture(std::string directory, PanoramaDownload& download) {
+	std::error_code error;
+	std::filesystem::create_directories(directory, error);
+	auto base_path = std::filesystem::path(directory) / download.id;
+
+	rapidjson::StringBuffer photometa_sb;
+	rapidjson::Writer<rapidjson::StringBuffer> photometa_writer(photometa_sb);
+	download.photometa.Accept(photometa_writer);
+	std::ofstream photometa_file(base_path.string() + ".json", std::ios::out);
+	photometa_file.write(photometa_sb.GetString(), photometa_sb.GetSize());
+
+	auto png_data = download.image->encodeToData(SkEncodedImageFormat::kPNG, 95);
+	std::ofstream png_file(base_path.string() + ".png", std::ios::out | std::ios::binary);
+	if(png_data) {
+		png_file.write((const char*)png_data->data(), png_data->size());
+	}
+
+	if(error || !photometa_file || !png_data || !png_file) {
+		std::cerr << "Could not save fixture " << base_path.string() << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool load_fixture_photometa(std::string directory, std::string id, rapidjson::Document& photometa) {
+	std::ifstream photometa_file(
+		(std::filesystem::path(directory) / id).string() + ".json", std::ios::in);
+	if(!photometa_file) {
+		return false;
+	}
+	std::stringstream photometa_stream;
+	photometa_stream << photometa_file.rdbuf();
+	photometa.Parse(photometa_stream.str());
+	return !photometa.HasParseError();
+}
+
+std::shared_ptr<PanoramaDownload> load_fixture(std::string directory, std::string id) {
+	auto base_path = std::filesystem::path(directory) / id;
+	auto info      = std::make_shared<PanoramaDownload>();
+	info->id       = id;
+
+	if(!load_fixture_photometa(directory, id, info->photometa)) {
+		// Prefetching asks for adjacent panoramas that were never visited
+		return info;
+	}
+
+	auto image = SkImage::MakeFromEncoded(
+		SkData::MakeFromFileName((base_path.string() + ".png").c_str()));
+	// Decoded now like a download, not on the first frame that draws it
+	info->image = image ? image->makeRasterImage() : nullptr;
+	return info;
 }
\ No newline at end of file
@@ -4,11 +4,16 @@
 #include <curl/curl.h>
 #include <rapidjson/document.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <deque>
 #include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 struct PanoramaDownload {
 	sk_sp<SkImage> image;
@@ -16,11 +21,21 @@ struct PanoramaDownload {
 	rapidjson::Document photometa;
 };
 
+// Downloads panoramas ahead of time on a few threads. Finished panoramas are kept until the
+// cache exceeds its budget, after which the least recently used are dropped
 class PanoramaPreloader {
 public:
+	~PanoramaPreloader();
 	void Start(int num_threads);
 
 	void QueuePanorama(std::string id);
+	// Replaces everything still queued, most wanted first. Panoramas that are already
+	// downloaded or downloading are skipped
+	void ReplaceQueue(std::vector<std::string> ids);
+	void SetCacheBudget(size_t bytes) {
+		std::scoped_lock lock { panoramas_m };
+		cache_budget = bytes;
+	}
 	void SetZoom(int zoom) {
 		std::scoped_lock lock { info_m };
 		streetview_zoom = zoom;
@@ -32,23 +47,55 @@ public:
 	void SetCurlHandle(CURL* handle) {
 		curl_handle = handle;
 	}
-	std::shared_ptr<PanoramaDownload> GetPanorama(std::string id, bool force);
+	// Panoramas are read from fixtures in this directory instead of downloaded
+	void SetFixtureDirectory(std::string directory) {
+		std::scoped_lock lock { info_m };
+		fixture_directory = directory;
+	}
+	// Waits for a panorama that is already downloading instead of downloading it twice. Forced
+	// downloads use handle, or the one set with SetCurlHandle
+	std::shared_ptr<PanoramaDownload> GetPanorama(
+		std::string id, bool force, CURL* handle = nullptr);
+	// Already downloaded panorama without counting a cache hit or miss, nullptr otherwise
+	std::shared_ptr<PanoramaDownload> PeekPanorama(std::string id);
 
 private:
+	struct CacheEntry {
+		std::shared_ptr<PanoramaDownload> download;
+		size_t bytes;
+		uint64_t last_used;
+	};
+
 	void PanoramaThread();
 	std::shared_ptr<PanoramaDownload> DownloadPanorama(std::string id, CURL* handle);
+	// Must hold panoramas_m. Failed downloads are not kept
+	void AddToCache(std::string id, std::shared_ptr<PanoramaDownload> download);
 
 	CURL* curl_handle;
 
 	std::deque<std::string> queued_panoramas;
 	std::mutex queued_panoramas_m;
-	std::unordered_map<std::string, std::shared_ptr<PanoramaDownload>> panoramas;
+	std::unordered_map<std::string, CacheEntry> panoramas;
+	std::unordered_set<std::string> downloading;
+	uint64_t use_counter = 0;
+	size_t cache_bytes   = 0;
+	size_t cache_budget  = (size_t)1 << 30;
 	std::mutex panoramas_m;
+	std::condition_variable panoramas_cv;
 
-	bool run_threads = true;
+	std::atomic<bool> run_threads = true;
 	std::vector<std::thread> threads;
 
 	int streetview_zoom = 2;
 	std::string client_id;
+	std::string fixture_directory;
 	std::mutex info_m;
-};
\ No newline at end of file
+};
+
+// A fixture is <id>.json with the photometa and <id>.png with the stitched panorama, saved while
+// viewing so the same panoramas can be rendered later without a network
+bool save_fixture(std::string directory, PanoramaDownload& download);
+// The image is empty if the fixture is missing
+std::shared_ptr<PanoramaDownload> load_fixture(std::string directory, std::string id);
+// Only the photometa, without decoding the image
+bool load_fixture_photometa(std::string directory, std::string id, rapidjson::Document& photometa);
\ No newline at end of file
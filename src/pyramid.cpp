@@ -0,0 +1,127 @@
+#include "pyramid.hpp"
+
+#include <core/SkBitmap.h>
+#include <core/SkPixmap.h>
+#include <core/SkSamplingOptions.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+
+#include "async.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+// Rows per job, small enough to balance cores and large enough to not matter
+#define ROWS_PER_BAND 64
+
+// Premultiplied 8 bit channels, averaging premultiplied values keeps masked tiles correct.
+// Both loops are plain arithmetic over contiguous bytes so the compiler vectorizes them
+static void halve_rows(const SkPixmap& src, const SkPixmap& dst, int row_start, int row_end) {
+	int src_width = src.width();
+	int dst_width = dst.width();
+	std::vector<uint16_t> sums(src_width * 4);
+
+	for(int y = row_start; y < row_end; y++) {
+		auto top    = static_cast<const uint8_t*>(src.addr()) + src.rowBytes() * (y * 2);
+		auto bottom = static_cast<const uint8_t*>(src.addr())
+					  + src.rowBytes() * std::min(y * 2 + 1, src.height() - 1);
+		for(int i = 0; i < src_width * 4; i++) {
+			sums[i] = top[i] + bottom[i];
+		}
+
+		auto out  = static_cast<uint8_t*>(dst.writable_addr()) + dst.rowBytes() * y;
+		int pairs = src_width / 2;
+		for(int x = 0; x < pairs; x++) {
+			for(int c = 0; c < 4; c++) {
+				out[x * 4 + c] = (sums[x * 8 + c] + sums[x * 8 + 4 + c] + 2) >> 2;
+			}
+		}
+		// Odd width, last column only has itself to average with
+		if(dst_width > pairs) {
+			for(int c = 0; c < 4; c++) {
+				out[pairs * 4 + c] = (sums[pairs * 8 + c] + 1) >> 1;
+			}
+		}
+	}
+}
+
+static SkBitmap halve(SkBitmap& src) {
+	MetricsTimer timer(get_metrics().Histogram("pyramid_halve_us"));
+	SkBitmap dst;
+	dst.allocPixels(src.info().makeWH((src.width() + 1) / 2, (src.height() + 1) / 2));
+
+	// Bands of rows across every core, the CPU pool already keeps every core busy with other
+	// panoramas
+	if(AsyncRuntime::OnCpuPool()) {
+		halve_rows(src.pixmap(), dst.pixmap(), 0, dst.height());
+		return dst;
+	}
+	int num_bands   = (dst.height() + ROWS_PER_BAND - 1) / ROWS_PER_BAND;
+	int num_threads = std::min<int>(num_bands, std::max(1u, std::thread::hardware_concurrency()));
+	std::vector<std::thread> threads;
+	for(int t = 0; t < num_threads; t++) {
+		threads.push_back(std::thread([&, t] {
+			for(int band = t; band < num_bands; band += num_threads) {
+				halve_rows(src.pixmap(), dst.pixmap(), band * ROWS_PER_BAND,
+					std::min(dst.height(), (band + 1) * ROWS_PER_BAND));
+			}
+		}));
+	}
+	for(auto& thread : threads) {
+		thread.join();
+	}
+	return dst;
+}
+
+std::vector<sk_sp<SkImage>> build_pyramid(
+	sk_sp<SkImage> image, std::vector<std::pair<int, int>>& sizes) {
+	TraceSpan span("pipeline", "pyramid");
+	span.Arg("levels", sizes.size());
+
+	// Halve straight from the stitched pixels when they are already N32, they may be a large
+	// scratch file mapping that shouldn't be copied to the heap
+	SkBitmap full;
+	SkPixmap stitched;
+	if(!image->peekPixels(&stitched) || stitched.info().colorType() != kN32_SkColorType
+		|| stitched.info().alphaType() != kPremul_SkAlphaType || !full.installPixels(stitched)) {
+		full.allocPixels(SkImageInfo::MakeN32Premul(image->width(), image->height()));
+		image->readPixels(full.pixmap(), 0, 0);
+	}
+
+	// Largest first so every level continues halving from the previous one
+	std::vector<int> order(sizes.size());
+	for(int i = 0; i < sizes.size(); i++) {
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(),
+		[&](int a, int b) { return sizes[a].first > sizes[b].first; });
+
+	std::vector<sk_sp<SkImage>> levels(sizes.size());
+	SkBitmap current = full;
+	for(int i : order) {
+		auto [width, height] = sizes[i];
+		if(width >= full.width() && height >= full.height()) {
+			levels[i] = image;
+			continue;
+		}
+
+		while(current.width() / 2 >= width && current.height() / 2 >= height) {
+			current = halve(current);
+		}
+
+		if(current.width() == width && current.height() == height) {
+			current.setImmutable();
+			levels[i] = current.asImage();
+		} else {
+			// Less than a factor of two left
+			SkBitmap scaled;
+			scaled.allocPixels(current.info().makeWH(width, height));
+			current.pixmap().scalePixels(
+				scaled.pixmap(), SkSamplingOptions(SkCubicResampler::CatmullRom()));
+			scaled.setImmutable();
+			levels[i] = scaled.asImage();
+		}
+	}
+	return levels;
+}
\ No newline at end of file
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <core/SkImage.h>
+
+#include <utility>
+#include <vector>
+
+// Lower zoom levels derived from one downloaded panorama instead of downloading each zoom.
+// Halves with a 2x2 box filter while that stays at or above the target size, the remaining
+// non power of two step uses Catmull-Rom. Returns one image per size, in the same order
+std::vector<sk_sp<SkImage>> build_pyramid(
+	sk_sp<SkImage> image, std::vector<std::pair<int, int>>& sizes);
\ No newline at end of file
@@ -0,0 +1,150 @@
+#include "rate.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#define MAX_CONCURRENCY 64.0
+#define MAX_RATE 200.0
+#define MIN_RATE 0.5
+#define BACKOFF_BASE_MS 250.0
+#define BACKOFF_CAP_MS 30000.0
+// Latency above this multiple of the fastest seen latency counts as congestion
+#define LATENCY_SPIKE_FACTOR 2.5
+// Concurrency is reduced for a latency spike at most once per round trip, and never more often
+// than this. Responses already in flight when it was reduced still carry the old latency
+#define LATENCY_DECREASE_MIN_INTERVAL_MS 250.0
+
+void RateController::Acquire(std::string host) {
+	std::unique_lock lock { hosts_m };
+	std::chrono::steady_clock::duration wait;
+	// Woken up early by Release
+	while(!TryAcquire(hosts[host], std::chrono::steady_clock::now(), wait)) {
+		if(wait == std::chrono::steady_clock::duration::zero()) {
+			hosts_cv.wait(lock);
+		} else {
+			hosts_cv.wait_for(lock, wait);
+		}
+	}
+}
+
+bool RateController::TryAcquire(std::string host, std::chrono::steady_clock::duration& wait) {
+	std::scoped_lock lock { hosts_m };
+	return TryAcquire(hosts[host], std::chrono::steady_clock::now(), wait);
+}
+
+bool RateController::Release(std::string host, std::string type, long http_code,
+	bool transport_error, std::chrono::milliseconds latency, long retry_after_seconds) {
+	std::scoped_lock lock { hosts_m };
+	auto now    = std::chrono::steady_clock::now();
+	auto& state = hosts[host];
+	state.in_flight--;
+
+	bool throttled = http_code == 429 || http_code >= 500 || transport_error;
+	if(throttled) {
+		state.consecutive_failures++;
+		Decrease(state, now, retry_after_seconds);
+	} else {
+		state.consecutive_failures = 0;
+
+		double latency_ms = latency.count();
+		auto& type_latency = state.latency[type];
+		type_latency.ewma
+			= type_latency.ewma == 0.0 ? latency_ms : type_latency.ewma * 0.8 + latency_ms * 0.2;
+		// Let the baseline drift up slowly so one lucky fast response doesn't pin it forever
+		type_latency.baseline = type_latency.baseline == 0.0
+									? latency_ms
+									: std::min(latency_ms, type_latency.baseline * 1.001);
+
+		if(type_latency.ewma > type_latency.baseline * LATENCY_SPIKE_FACTOR) {
+			// Server is queueing our requests, back off concurrency without pausing
+			double interval_ms = std::max(LATENCY_DECREASE_MIN_INTERVAL_MS, type_latency.ewma);
+			if(now - state.last_latency_decrease
+				>= std::chrono::duration<double, std::milli>(interval_ms)) {
+				state.concurrency_limit     = std::max(1.0, state.concurrency_limit * 0.75);
+				state.last_latency_decrease = now;
+			}
+		} else {
+			// Additive increase, roughly one more request in flight per round trip
+			state.concurrency_limit
+				= std::min(MAX_CONCURRENCY, state.concurrency_limit + 1.0 / state.concurrency_limit);
+			state.rate = std::min(MAX_RATE, state.rate + 1.0);
+		}
+	}
+
+	hosts_cv.notify_all();
+	return throttled;
+}
+
+void RateController::Abandon(std::string host) {
+	std::scoped_lock lock { hosts_m };
+	hosts[host].in_flight--;
+	hosts_cv.notify_all();
+}
+
+int RateController::GetFreeSlots(std::string host) {
+	std::scoped_lock lock { hosts_m };
+	auto& state = hosts[host];
+	return std::max(0, (int)state.concurrency_limit - state.in_flight);
+}
+
+double RateController::GetConcurrencyLimit(std::string host) {
+	std::scoped_lock lock { hosts_m };
+	return hosts[host].concurrency_limit;
+}
+
+double RateController::GetRate(std::string host) {
+	std::scoped_lock lock { hosts_m };
+	return hosts[host].rate;
+}
+
+bool RateController::TryAcquire(HostState& state, std::chrono::steady_clock::time_point now,
+	std::chrono::steady_clock::duration& wait) {
+	Refill(state, now);
+
+	if(now < state.paused_until) {
+		// Backing off after 429 or 5xx
+		wait = state.paused_until - now;
+	} else if(state.in_flight >= (int)state.concurrency_limit) {
+		// Until a request in flight is released
+		wait = std::chrono::steady_clock::duration::zero();
+	} else if(state.tokens < 1.0) {
+		wait = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>((1.0 - state.tokens) / state.rate));
+	} else {
+		state.tokens -= 1.0;
+		state.in_flight++;
+		return true;
+	}
+	return false;
+}
+
+void RateController::Refill(HostState& state, std::chrono::steady_clock::time_point now) {
+	double elapsed    = std::chrono::duration<double>(now - state.last_refill).count();
+	double burst      = std::max(1.0, state.concurrency_limit);
+	state.tokens      = std::min(burst, state.tokens + elapsed * state.rate);
+	state.last_refill = now;
+}
+
+void RateController::Decrease(
+	HostState& state, std::chrono::steady_clock::time_point now, long retry_after_seconds) {
+	state.concurrency_limit = std::max(1.0, state.concurrency_limit / 2.0);
+	state.rate              = std::max(MIN_RATE, state.rate / 2.0);
+	state.tokens            = std::min(state.tokens, 0.0);
+
+	// Full jitter so parallel requests don't retry in lockstep
+	std::chrono::milliseconds backoff;
+	if(retry_after_seconds > 0) {
+		backoff = std::chrono::seconds(retry_after_seconds);
+	} else {
+		double ceiling = std::min(
+			BACKOFF_CAP_MS, BACKOFF_BASE_MS * std::pow(2.0, state.consecutive_failures - 1));
+		std::uniform_real_distribution<double> jitter(0.0, ceiling);
+		backoff = std::chrono::milliseconds((long)jitter(jitter_generator));
+	}
+	state.paused_until = std::max(state.paused_until, now + backoff);
+}
+
+RateController& get_rate_controller() {
+	static RateController rate_controller;
+	return rate_controller;
+}
\ No newline at end of file
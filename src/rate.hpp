@@ -0,0 +1,64 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+
+// Shared by every request, see download_from_url. Each host gets a token bucket limiting
+// requests per second and an AIMD concurrency limit. Both grow slowly while responses are
+// fast and successful and are halved on 429, 5xx or a latency spike, after which the host
+// is paused for a jittered exponential backoff.
+class RateController {
+public:
+	void Acquire(std::string host);
+	// Non-blocking Acquire for the event loop, otherwise sets how long to wait before trying again.
+	// The wait is zero when the host is at its concurrency limit, only a Release frees a slot
+	bool TryAcquire(std::string host, std::chrono::steady_clock::duration& wait);
+	// Returns true if the request should be retried. Latency is compared against earlier
+	// requests of the same type, a tile and the main page take very different times
+	bool Release(std::string host, std::string type, long http_code, bool transport_error,
+		std::chrono::milliseconds latency, long retry_after_seconds);
+	// For a request aborted on purpose, like the slower of two hedged ones. Only frees its slot,
+	// its truncated latency says nothing about the host
+	void Abandon(std::string host);
+
+	// Requests that could start before the concurrency limit is reached
+	int GetFreeSlots(std::string host);
+	double GetConcurrencyLimit(std::string host);
+	double GetRate(std::string host);
+
+private:
+	struct LatencyState {
+		double ewma     = 0.0;
+		double baseline = 0.0;
+	};
+
+	struct HostState {
+		double tokens            = 4.0;
+		double rate              = 4.0;
+		double concurrency_limit = 4.0;
+		int in_flight            = 0;
+		int consecutive_failures = 0;
+		// By request type
+		std::unordered_map<std::string, LatencyState> latency;
+		std::chrono::steady_clock::time_point last_refill = std::chrono::steady_clock::now();
+		std::chrono::steady_clock::time_point paused_until;
+		std::chrono::steady_clock::time_point last_latency_decrease;
+	};
+
+	bool TryAcquire(HostState& state, std::chrono::steady_clock::time_point now,
+		std::chrono::steady_clock::duration& wait);
+	void Refill(HostState& state, std::chrono::steady_clock::time_point now);
+	void Decrease(HostState& state, std::chrono::steady_clock::time_point now,
+		long retry_after_seconds);
+
+	std::unordered_map<std::string, HostState> hosts;
+	std::mutex hosts_m;
+	std::condition_variable hosts_cv;
+	std::mt19937 jitter_generator { std::random_device {}() };
+};
+
+RateController& get_rate_controller();
\ No newline at end of file
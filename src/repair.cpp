@@ -0,0 +1,171 @@
+#include "repair.hpp"
+
+#include <core/SkData.h>
+#include <core/SkImage.h>
+#include <fmt/format.h>
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <climits>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+
+// Bounds for entries read back, anything larger is a corrupt line
+#define MAX_REPAIR_ZOOM 10
+#define MAX_REPAIR_TILES 1024
+
+static std::mutex repair_queue_m;
+
+MissingTilePolicy missing_tile_policy_from_string(std::string policy) {
+	if(policy == "fail") {
+		return MissingTilePolicy::FAIL;
+	} else if(policy == "mask") {
+		return MissingTilePolicy::MASK;
+	} else if(policy == "repair") {
+		return MissingTilePolicy::REPAIR;
+	}
+	return MissingTilePolicy::WHITE;
+}
+
+void append_repair_entry(std::string queue_path, RepairEntry& entry) {
+	rapidjson::StringBuffer entry_sb;
+	rapidjson::Writer<rapidjson::StringBuffer> entry_writer(entry_sb);
+	entry_writer.StartObject();
+	entry_writer.Key("id");
+	entry_writer.String(entry.id);
+	entry_writer.Key("zoom");
+	entry_writer.Int(entry.completeness.zoom);
+	entry_writer.Key("path");
+	entry_writer.String(entry.path);
+	entry_writer.Key("tile_width");
+	entry_writer.Int(entry.completeness.tile_width);
+	entry_writer.Key("tile_height");
+	entry_writer.Int(entry.completeness.tile_height);
+	entry_writer.Key("tiles_width");
+	entry_writer.Int(entry.completeness.tiles_width);
+	entry_writer.Key("tiles_height");
+	entry_writer.Int(entry.completeness.tiles_height);
+	entry_writer.Key("missing");
+	entry_writer.StartArray();
+	for(auto [x, y] : entry.completeness.Missing()) {
+		entry_writer.StartArray();
+		entry_writer.Int(x);
+		entry_writer.Int(y);
+		entry_writer.EndArray();
+	}
+	entry_writer.EndArray();
+	entry_writer.EndObject();
+
+	std::scoped_lock lock { repair_queue_m };
+	std::ofstream queue_file(queue_path, std::ios::out | std::ios::app);
+	queue_file.write(entry_sb.GetString(), entry_sb.GetLength());
+	queue_file.put('\n');
+}
+
+static bool parse_repair_entry(std::string& line, RepairEntry& entry) {
+	rapidjson::Document entry_json;
+	entry_json.Parse(line);
+	if(entry_json.HasParseError() || !entry_json.IsObject()) {
+		return false;
+	}
+	auto is_string = [&](const char* name) {
+		return entry_json.HasMember(name) && entry_json[name].IsString();
+	};
+	// Within 0 and max
+	auto get_int = [&](const char* name, int max, int& value) {
+		if(!entry_json.HasMember(name) || !entry_json[name].IsInt()) {
+			return false;
+		}
+		value = entry_json[name].GetInt();
+		return value >= 0 && value <= max;
+	};
+
+	auto& completeness = entry.completeness;
+	if(!is_string("id") || !is_string("path")
+		|| !get_int("zoom", MAX_REPAIR_ZOOM, completeness.zoom)
+		|| !get_int("tiles_width", MAX_REPAIR_TILES, completeness.tiles_width)
+		|| !get_int("tiles_height", MAX_REPAIR_TILES, completeness.tiles_height)
+		|| !entry_json.HasMember("missing") || !entry_json["missing"].IsArray()) {
+		return false;
+	}
+	entry.id   = entry_json["id"].GetString();
+	entry.path = entry_json["path"].GetString();
+	if(entry_json.HasMember("tile_width")
+		&& (!get_int("tile_width", INT_MAX, completeness.tile_width)
+			|| !get_int("tile_height", INT_MAX, completeness.tile_height)
+			|| completeness.tile_width == 0 || completeness.tile_height == 0)) {
+		return false;
+	}
+
+	completeness.tiles.assign(completeness.tiles_width * completeness.tiles_height, true);
+	for(auto& tile : entry_json["missing"].GetArray()) {
+		if(!tile.IsArray() || tile.Size() != 2 || !tile[0].IsInt() || !tile[1].IsInt()) {
+			return false;
+		}
+		int x = tile[0].GetInt();
+		int y = tile[1].GetInt();
+		if(x < 0 || y < 0 || x >= completeness.tiles_width || y >= completeness.tiles_height) {
+			return false;
+		}
+		completeness.tiles[y * completeness.tiles_width + x] = false;
+	}
+	return true;
+}
+
+std::vector<RepairEntry> read_repair_queue(std::string queue_path) {
+	std::vector<RepairEntry> entries;
+	std::ifstream queue_file(queue_path, std::ios::in);
+	std::string line;
+	int line_number = 0;
+	while(std::getline(queue_file, line)) {
+		line_number++;
+		if(line.empty()) {
+			continue;
+		}
+		RepairEntry entry;
+		if(!parse_repair_entry(line, entry)) {
+			std::cerr << "Skipped malformed repair entry on line " << line_number << " of "
+					  << queue_path << std::endl;
+			continue;
+		}
+		entries.push_back(entry);
+	}
+	return entries;
+}
+
+int run_repair_queue(CURL* curl_handle, std::string queue_path) {
+	auto entries = read_repair_queue(queue_path);
+	std::vector<RepairEntry> remaining;
+
+	for(auto& entry : entries) {
+		auto image = SkImage::MakeFromEncoded(SkData::MakeFromFileName(entry.path.c_str()));
+		if(!image) {
+			std::cerr << "Could not read " << entry.path << std::endl;
+			remaining.push_back(entry);
+			continue;
+		}
+
+		int num_missing = entry.completeness.NumMissing();
+		auto repaired = repair_panorama(curl_handle, entry.id, image, entry.completeness);
+
+		auto tile_data = repaired->encodeToData(SkEncodedImageFormat::kPNG, 95);
+		std::ofstream outfile(entry.path, std::ios::out | std::ios::binary);
+		outfile.write((const char*)tile_data->bytes(), tile_data->size());
+		outfile.close();
+
+		fmt::print("Repaired {} of {} missing tiles in {}\n",
+			num_missing - entry.completeness.NumMissing(), num_missing, entry.id);
+		if(!entry.completeness.IsComplete()) {
+			remaining.push_back(entry);
+		}
+	}
+
+	// Rewrite the queue with only the panoramas that are still incomplete
+	std::ofstream(queue_path, std::ios::out | std::ios::trunc).close();
+	for(auto& entry : remaining) {
+		append_repair_entry(queue_path, entry);
+	}
+	return remaining.size();
+}
\ No newline at end of file
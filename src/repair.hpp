@@ -0,0 +1,28 @@
+#pragma once
+
+#include <curl/curl.h>
+
+#include <string>
+#include <vector>
+
+#include "download.hpp"
+
+enum class MissingTilePolicy {
+	// Write the panorama with missing tiles left white
+	WHITE,
+	FAIL,
+	MASK,
+	REPAIR,
+};
+
+// A written panorama that still has missing tiles, stored one per line in the repair queue
+struct RepairEntry {
+	std::string id;
+	std::string path;
+	TileCompleteness completeness;
+};
+
+MissingTilePolicy missing_tile_policy_from_string(std::string policy);
+void append_repair_entry(std::string queue_path, RepairEntry& entry);
+std::vector<RepairEntry> read_repair_queue(std::string queue_path);
+int run_repair_queue(CURL* curl_handle, std::string queue_path);
\ No newline at end of file
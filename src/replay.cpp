@@ -0,0 +1,136 @@
+#include "replay.hpp"
+
+#include <fmt/format.h>
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+#include "interface.hpp"
+#include "metrics.hpp"
+
+std::string viewer_event_json(ViewerEvent& event) {
+	rapidjson::StringBuffer event_sb;
+	rapidjson::Writer<rapidjson::StringBuffer> event_writer(event_sb);
+	event_writer.StartObject();
+	event_writer.Key("t");
+	event_writer.Double(event.time);
+	event_writer.Key("type");
+	if(event.type == ViewerEventType::VIEW) {
+		event_writer.String("view");
+		event_writer.Key("x");
+		event_writer.Double(event.offset_x);
+		event_writer.Key("y");
+		event_writer.Double(event.offset_y);
+		event_writer.Key("zoom");
+		event_writer.Double(event.zoom);
+	} else {
+		event_writer.String("move");
+		event_writer.Key("id");
+		event_writer.String(event.id.c_str());
+	}
+	event_writer.EndObject();
+	return event_sb.GetString();
+}
+
+std::vector<ViewerEvent> read_viewer_events(std::string path) {
+	std::ifstream events_file(path, std::ios::in);
+	if(!events_file) {
+		std::cerr << "Could not open recorded events " << path << std::endl;
+		return {};
+	}
+
+	std::vector<ViewerEvent> events;
+	std::string line;
+	int line_number = 0;
+	while(std::getline(events_file, line)) {
+		line_number++;
+		if(line.empty()) {
+			continue;
+		}
+		rapidjson::Document event_json;
+		event_json.Parse(line);
+		if(event_json.HasParseError() || !event_json.IsObject() || !event_json.HasMember("t")
+			|| !event_json["t"].IsNumber() || !event_json.HasMember("type")
+			|| !event_json["type"].IsString()) {
+			std::cerr << "Skipping event on line " << line_number << std::endl;
+			continue;
+		}
+
+		ViewerEvent event;
+		event.time = event_json["t"].GetDouble();
+		std::string type = event_json["type"].GetString();
+		if(type == "view") {
+			event.type = ViewerEventType::VIEW;
+			if(event_json.HasMember("x") && event_json["x"].IsNumber()) {
+				event.offset_x = event_json["x"].GetDouble();
+			}
+			if(event_json.HasMember("y") && event_json["y"].IsNumber()) {
+				event.offset_y = event_json["y"].GetDouble();
+			}
+			if(event_json.HasMember("zoom") && event_json["zoom"].IsNumber()) {
+				event.zoom = event_json["zoom"].GetDouble();
+			}
+		} else if(type == "move" && event_json.HasMember("id") && event_json["id"].IsString()) {
+			event.type = ViewerEventType::MOVE;
+			event.id   = event_json["id"].GetString();
+		} else {
+			std::cerr << "Skipping event on line " << line_number << std::endl;
+			continue;
+		}
+		events.push_back(event);
+	}
+	return events;
+}
+
+static std::string percentiles(std::string name, std::string labels = "") {
+	auto& histogram = get_metrics().Histogram(name, labels);
+	if(histogram.Count() == 0) {
+		return "none\n";
+	}
+	return fmt::format("n={} p50={:.2f}ms p90={:.2f}ms p99={:.2f}ms max={:.2f}ms\n",
+		histogram.Count(), histogram.Percentile(50) / 1000.0, histogram.Percentile(90) / 1000.0,
+		histogram.Percentile(99) / 1000.0, histogram.Max() / 1000.0);
+}
+
+std::string run_viewer_benchmark(InterfaceWindow& window, std::vector<ViewerEvent>& events) {
+	auto start  = std::chrono::steady_clock::now();
+	size_t next = 0;
+	while(true) {
+		double elapsed
+			= std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		for(; next < events.size() && events[next].time <= elapsed; next++) {
+			auto& event = events[next];
+			if(event.type == ViewerEventType::VIEW) {
+				window.glfw_events.screen_offset_x = event.offset_x;
+				window.glfw_events.screen_offset_y = event.offset_y;
+				window.glfw_events.zoom            = event.zoom;
+			} else {
+				window.ChangePanorama(event.id);
+			}
+		}
+
+		window.DrawFrame();
+		if(next == events.size() && !window.IsLoading()) {
+			break;
+		}
+	}
+	double seconds
+		= std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	auto& frames = get_metrics().Histogram("viewer_frame_us");
+	std::string report = fmt::format("{} frames in {:.2f}s, {:.1f} fps, {} events replayed\n",
+		frames.Count(), seconds, frames.Count() / seconds, events.size());
+	report += "  frame              " + percentiles("viewer_frame_us");
+	report += "  panorama           " + percentiles("viewer_render_us", "{stage=\"panorama\"}");
+	report += "  map                " + percentiles("viewer_render_us", "{stage=\"map\"}");
+	report += "  shader compile     " + percentiles("viewer_shader_us", "{step=\"compile\"}");
+	report += "  shader rebind      " + percentiles("viewer_shader_us", "{step=\"bind\"}");
+	report += "  transition stall   " + percentiles("viewer_transition_stall_us");
+	report += fmt::format("  frames drawn while loading: {}\n",
+		get_metrics().Counter("viewer_loading_frames").Get());
+	return report;
+}
\ No newline at end of file
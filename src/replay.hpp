@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+class InterfaceWindow;
+
+enum class ViewerEventType {
+	// Dragged or scrolled, the view after the change
+	VIEW,
+	// Started moving to another panorama
+	MOVE,
+};
+
+// Input recorded in the viewer with --record, one JSON object per line
+//   {"t":1.25,"type":"view","x":310,"y":-42,"zoom":5.33}
+//   {"t":3.5,"type":"move","id":"<panorama id>"}
+// Moves keep the ID chosen at the time, so a replay visits the same panoramas even if loading
+// takes longer
+struct ViewerEvent {
+	// Seconds since recording started
+	double time = 0.0;
+	ViewerEventType type;
+	double offset_x = 0.0;
+	double offset_y = 0.0;
+	double zoom     = 5.0;
+	std::string id;
+};
+
+std::string viewer_event_json(ViewerEvent& event);
+std::vector<ViewerEvent> read_viewer_events(std::string path);
+
+// Draws frames back to back on a window prepared with PrepareHeadless, applying each event on the
+// first frame after its recorded time, until every event is applied and the last move finished.
+// Returns the report of frame times, shader rebuilds and transition stalls
+std::string run_viewer_benchmark(InterfaceWindow& window, std::vector<ViewerEvent>& events);
\ No newline at end of file
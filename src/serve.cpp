@@ -0,0 +1,490 @@
+#include "serve.hpp"
+
+#include <core/SkData.h>
+#include <core/SkImage.h>
+#include <fmt/format.h>
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <iostream>
+#include <sstream>
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "download.hpp"
+#include "extract.hpp"
+#include "headers.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+#define CLIENT_ID_MAX_AGE std::chrono::hours(1)
+#define RESPONSE_CACHE_BYTES ((size_t)256 << 20)
+#define MAX_REQUEST_BYTES 8192
+#define REQUEST_TIMEOUT_MS 5000
+#define PREFETCH_THREADS 4
+
+// Panorama IDs end up in request URLs, anything else is rejected
+static bool valid_panorama_id(std::string& id) {
+	return !id.empty() && id.size() <= 64
+		   && std::all_of(id.begin(), id.end(),
+			   [](char c) { return std::isalnum((unsigned char)c) || c == '_' || c == '-'; });
+}
+
+static const char* status_text(int status) {
+	switch(status) {
+	case 200:
+		return "OK";
+	case 400:
+		return "Bad Request";
+	case 404:
+		return "Not Found";
+	case 405:
+		return "Method Not Allowed";
+	default:
+		return "Bad Gateway";
+	}
+}
+
+// Stitched panoramas are far larger than one send
+static bool send_all(int fd, std::string& data) {
+	size_t sent = 0;
+	while(sent < data.size()) {
+		ssize_t result = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+		if(result == -1 && errno == EINTR) {
+			continue;
+		} else if(result <= 0) {
+			return false;
+		}
+		sent += result;
+	}
+	return true;
+}
+
+static std::string error_json(std::string message) {
+	rapidjson::StringBuffer buffer;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+	writer.StartObject();
+	writer.Key("error");
+	writer.String(message.c_str());
+	writer.EndObject();
+	return buffer.GetString();
+}
+
+PanoramaServer::PanoramaServer(int num_threads, int streetview_zoom, size_t cache_bytes) {
+	preloader.SetZoom(streetview_zoom);
+	preloader.SetCacheBudget(cache_bytes);
+	preloader.Start(PREFETCH_THREADS);
+	for(int i = 0; i < num_threads; i++) {
+		threads.push_back(std::thread(&PanoramaServer::HandlerThread, this));
+	}
+}
+
+PanoramaServer::~PanoramaServer() {
+	connections_m.lock();
+	running = false;
+	connections_m.unlock();
+	connections_cv.notify_all();
+	for(auto& thread : threads) {
+		thread.join();
+	}
+	for(int fd : listen_fds) {
+		close(fd);
+	}
+	if(!unix_path.empty()) {
+		unlink(unix_path.c_str());
+	}
+}
+
+bool PanoramaServer::Listen(int port) {
+	int fd    = socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	// Only local tools, never exposed to the network
+	sockaddr_in address {};
+	address.sin_family      = AF_INET;
+	address.sin_port        = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 64) != 0) {
+		std::cerr << "Could not listen on port " << port << std::endl;
+		close(fd);
+		return false;
+	}
+	listen_fds.push_back(fd);
+	fmt::print("Serving on http://127.0.0.1:{}\n", port);
+	return true;
+}
+
+bool PanoramaServer::ListenUnix(std::string path) {
+	sockaddr_un address {};
+	if(path.size() >= sizeof(address.sun_path)) {
+		std::cerr << "Socket path " << path << " is too long" << std::endl;
+		return false;
+	}
+	address.sun_family = AF_UNIX;
+	path.copy(address.sun_path, path.size());
+
+	// Left behind by an earlier server that was killed
+	unlink(path.c_str());
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(bind(fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 64) != 0) {
+		std::cerr << "Could not listen on " << path << std::endl;
+		close(fd);
+		return false;
+	}
+	listen_fds.push_back(fd);
+	unix_path = path;
+	fmt::print("Serving on {}\n", path);
+	return true;
+}
+
+void PanoramaServer::Run() {
+	while(true) {
+		std::vector<pollfd> fds;
+		for(int fd : listen_fds) {
+			fds.push_back(pollfd { .fd = fd, .events = POLLIN });
+		}
+		if(poll(fds.data(), fds.size(), 1000) <= 0) {
+			continue;
+		}
+
+		for(auto& listen_poll : fds) {
+			if(!(listen_poll.revents & POLLIN)) {
+				continue;
+			}
+			int fd = accept(listen_poll.fd, nullptr, nullptr);
+			if(fd == -1) {
+				continue;
+			}
+			connections_m.lock();
+			connections.push_back(fd);
+			get_metrics().Gauge("serve_queue_depth").Set(connections.size());
+			connections_m.unlock();
+			connections_cv.notify_one();
+		}
+	}
+}
+
+void PanoramaServer::HandlerThread() {
+	// Each thread keeps its own connections to Google alive between requests
+	CURL* curl_handle = curl_easy_init();
+	while(true) {
+		std::unique_lock lock { connections_m };
+		connections_cv.wait(lock, [this] { return !running || !connections.empty(); });
+		if(!running) {
+			break;
+		}
+		int fd = connections.front();
+		connections.pop_front();
+		get_metrics().Gauge("serve_queue_depth").Set(connections.size());
+		lock.unlock();
+
+		HandleConnection(fd, curl_handle);
+		close(fd);
+	}
+	curl_easy_cleanup(curl_handle);
+}
+
+void PanoramaServer::HandleConnection(int fd, CURL* handle) {
+	auto start = std::chrono::steady_clock::now();
+
+	// Requests are a single line and a few headers, bodies are never sent
+	std::string raw_request;
+	char buffer[4096];
+	while(raw_request.find("\r\n\r\n") == std::string::npos
+		  && raw_request.size() < MAX_REQUEST_BYTES) {
+		pollfd client_poll { .fd = fd, .events = POLLIN };
+		if(poll(&client_poll, 1, REQUEST_TIMEOUT_MS) <= 0) {
+			return;
+		}
+		ssize_t received = read(fd, buffer, sizeof(buffer));
+		if(received <= 0) {
+			return;
+		}
+		raw_request.append(buffer, received);
+	}
+
+	std::string method;
+	std::string target;
+	std::stringstream request_stream(raw_request.substr(0, raw_request.find("\r\n")));
+	request_stream >> method >> target;
+
+	Response response;
+	if(method != "GET") {
+		response = Response { .status = 405,
+			.content_type             = "application/json",
+			.body                     = error_json("Only GET is supported") };
+	} else {
+		Request request;
+		auto query_start = target.find('?');
+		std::stringstream path_stream(target.substr(0, query_start));
+		std::string segment;
+		while(std::getline(path_stream, segment, '/')) {
+			if(!segment.empty()) {
+				request.path.push_back(segment);
+			}
+		}
+		if(query_start != std::string::npos) {
+			std::stringstream query_stream(target.substr(query_start + 1));
+			std::string parameter;
+			while(std::getline(query_stream, parameter, '&')) {
+				auto equals = parameter.find('=');
+				if(equals != std::string::npos) {
+					request.query[parameter.substr(0, equals)] = parameter.substr(equals + 1);
+				}
+			}
+		}
+
+		TraceSpan span("serve", target);
+		try {
+			response = Route(request, handle);
+		} catch(std::exception&) {
+			// Malformed numbers in the path or query
+			response = Response { .status = 400,
+				.content_type             = "application/json",
+				.body                     = error_json("Invalid request") };
+		}
+	}
+
+	auto header = fmt::format("HTTP/1.1 {} {}\r\nContent-Type: {}\r\nContent-Length: {}\r\n"
+							  "Connection: close\r\n\r\n",
+		response.status, status_text(response.status), response.content_type,
+		response.body.size());
+	if(send_all(fd, header) && send_all(fd, response.body)) {
+		get_metrics()
+			.Counter("serve_requests", fmt::format("{{status=\"{}\"}}", response.status))
+			.Add();
+	}
+	get_metrics().Histogram("serve_latency_us").Record(
+		std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start)
+			.count());
+}
+
+PanoramaServer::Response PanoramaServer::Route(Request& request, CURL* handle) {
+	auto& path = request.path;
+	if(path.size() >= 2 && path[0] == "panorama" && valid_panorama_id(path[1])) {
+		if(path.size() == 2) {
+			return Metadata(path[1], handle, false);
+		} else if(path.size() == 3 && path[2] == "adjacent") {
+			return Metadata(path[1], handle, true);
+		} else if(path.size() == 3 && path[2] == "image.png") {
+			return Image(path[1], handle);
+		}
+	} else if(path.size() == 5 && path[0] == "tile" && valid_panorama_id(path[1])) {
+		return Tile(path[1], std::stoi(path[2]), std::stoi(path[3]), std::stoi(path[4]), handle);
+	} else if(path.size() == 1 && path[0] == "nearby" && request.query.count("lat")
+			  && request.query.count("long")) {
+		int num_previews = request.query.count("n") ? std::stoi(request.query["n"]) : 100;
+		return Nearby(std::stod(request.query["lat"]), std::stod(request.query["long"]),
+			num_previews, handle);
+	}
+	return Response {
+		.status = 404, .content_type = "application/json", .body = error_json("Unknown path")
+	};
+}
+
+PanoramaServer::Response PanoramaServer::Metadata(std::string id, CURL* handle, bool adjacent) {
+	auto key = (adjacent ? "adjacent/" : "metadata/") + id;
+	if(auto cached = CacheGet(key)) {
+		return Response { .content_type = "application/json", .body = *cached };
+	}
+
+	// A panorama stitched earlier has everything already
+	auto download = preloader.PeekPanorama(id);
+	rapidjson::Document downloaded_photometa;
+	if(!download) {
+		auto photometa_document = download_photometa(handle, GetClientId(handle), id,
+			PHOTOMETA_INFO | PHOTOMETA_LINKS | PHOTOMETA_LOCATION);
+		downloaded_photometa.Swap(photometa_document);
+	}
+	auto& photometa_document = download ? download->photometa : downloaded_photometa;
+	if(!photometa_has_fields(
+		   photometa_document, PHOTOMETA_INFO | PHOTOMETA_LINKS | PHOTOMETA_LOCATION)) {
+		return Response { .status = 404,
+			.content_type         = "application/json",
+			.body                 = error_json("Panorama not found") };
+	}
+
+	// Both are built at once, tools usually ask for one after the other
+	auto panorama = extract_info(photometa_document);
+	auto location = extract_location(photometa_document);
+	rapidjson::StringBuffer metadata_buffer;
+	rapidjson::Writer<rapidjson::StringBuffer> metadata_writer(metadata_buffer);
+	metadata_writer.StartObject();
+	metadata_writer.Key("id");
+	metadata_writer.String(panorama.id.c_str());
+	metadata_writer.Key("year");
+	metadata_writer.Int(panorama.year);
+	metadata_writer.Key("month");
+	metadata_writer.Int(panorama.month);
+	metadata_writer.Key("lat");
+	metadata_writer.Double(panorama.lat);
+	metadata_writer.Key("long");
+	metadata_writer.Double(panorama.lng);
+	metadata_writer.Key("yaw");
+	metadata_writer.Double(panorama.yaw);
+	metadata_writer.Key("pitch");
+	metadata_writer.Double(panorama.pitch);
+	metadata_writer.Key("roll");
+	metadata_writer.Double(panorama.roll);
+	metadata_writer.Key("street");
+	metadata_writer.String(location.street.c_str());
+	metadata_writer.Key("city");
+	metadata_writer.String(location.city_and_state.c_str());
+	metadata_writer.EndObject();
+
+	rapidjson::StringBuffer adjacent_buffer;
+	rapidjson::Writer<rapidjson::StringBuffer> adjacent_writer(adjacent_buffer);
+	adjacent_writer.StartArray();
+	for(auto& adjacent_panorama : extract_adjacent_panoramas(photometa_document)) {
+		adjacent_writer.StartObject();
+		adjacent_writer.Key("id");
+		adjacent_writer.String(adjacent_panorama.id.c_str());
+		adjacent_writer.Key("lat");
+		adjacent_writer.Double(adjacent_panorama.lat);
+		adjacent_writer.Key("long");
+		adjacent_writer.Double(adjacent_panorama.lng);
+		adjacent_writer.EndObject();
+	}
+	adjacent_writer.EndArray();
+
+	CachePut("metadata/" + id, metadata_buffer.GetString());
+	CachePut("adjacent/" + id, adjacent_buffer.GetString());
+	return Response { .content_type = "application/json",
+		.body = adjacent ? adjacent_buffer.GetString() : metadata_buffer.GetString() };
+}
+
+PanoramaServer::Response PanoramaServer::Image(std::string id, CURL* handle) {
+	auto key = "image/" + id;
+	if(auto cached = CacheGet(key)) {
+		return Response { .content_type = "image/png", .body = *cached };
+	}
+
+	// Also hands the client ID to the preloader before its first download
+	GetClientId(handle);
+	auto download = preloader.GetPanorama(id, true, handle);
+	if(!download || !download->image || !valid_photometa(download->photometa)) {
+		return Response { .status = 404,
+			.content_type         = "application/json",
+			.body                 = error_json("Panorama not found") };
+	}
+
+	// Likely to be asked for next
+	for(auto& adjacent : extract_adjacent_panoramas(download->photometa)) {
+		preloader.QueuePanorama(adjacent.id);
+	}
+
+	sk_sp<SkData> png_data;
+	{
+		MetricsTimer encode_timer(get_metrics().Histogram("encode_us"));
+		png_data = download->image->encodeToData(SkEncodedImageFormat::kPNG, 95);
+	}
+	if(!png_data) {
+		return Response { .status = 502,
+			.content_type         = "application/json",
+			.body                 = error_json("Could not encode panorama") };
+	}
+	std::string body((const char*)png_data->data(), png_data->size());
+	CachePut(key, body);
+	return Response { .content_type = "image/png", .body = body };
+}
+
+PanoramaServer::Response PanoramaServer::Tile(
+	std::string id, int zoom, int x, int y, CURL* handle) {
+	auto key = fmt::format("tile/{}/{}/{}/{}", id, zoom, x, y);
+	if(auto cached = CacheGet(key)) {
+		return Response { .content_type = "image/jpeg", .body = *cached };
+	}
+
+	static curl_slist* headers = get_panorama_headers();
+	CURLcode res;
+	auto tile_data = download_from_url(tile_url(id, x, y, zoom), handle, &res, headers);
+	long http_code = 0;
+	curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &http_code);
+	if(res != CURLE_OK || http_code != 200 || tile_data.empty()) {
+		int status = http_code == 404 || http_code == 400 ? 404 : 502;
+		return Response { .status = status,
+			.content_type         = "application/json",
+			.body                 = error_json("Tile not available") };
+	}
+	CachePut(key, tile_data);
+	return Response { .content_type = "image/jpeg", .body = tile_data };
+}
+
+PanoramaServer::Response PanoramaServer::Nearby(
+	double lat, double lng, int num_previews, CURL* handle) {
+	// Not cached, new panoramas show up over time
+	std::vector<std::string> ids;
+	for(int attempt = 0; attempt < 2; attempt++) {
+		// An expired client ID gets an empty response, fetch a new one and try again
+		auto preview_document = download_preview_document(
+			handle, GetClientId(handle, attempt > 0), num_previews, lat, lng, 10000);
+		if(preview_document.IsArray() && preview_document.Size() > 0
+			&& preview_document[0].IsArray()) {
+			ids = extract_panorama_ids(preview_document);
+			break;
+		}
+	}
+
+	rapidjson::StringBuffer buffer;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+	writer.StartArray();
+	for(auto& id : ids) {
+		writer.String(id.c_str());
+	}
+	writer.EndArray();
+	return Response { .content_type = "application/json", .body = buffer.GetString() };
+}
+
+std::string PanoramaServer::GetClientId(CURL* handle, bool refresh) {
+	std::scoped_lock lock { client_id_m };
+	auto now = std::chrono::steady_clock::now();
+	if(refresh || client_id.empty() || now - client_id_fetched > CLIENT_ID_MAX_AGE) {
+		client_id         = download_client_id(handle);
+		client_id_fetched = now;
+		preloader.SetClientId(client_id);
+		get_metrics().Counter("serve_client_id_refreshes").Add();
+	}
+	return client_id;
+}
+
+std::optional<std::string> PanoramaServer::CacheGet(std::string key) {
+	std::scoped_lock lock { cache_m };
+	auto entry = cache.find(key);
+	get_metrics()
+		.Counter("serve_cache", entry != cache.end() ? "{result=\"hit\"}" : "{result=\"miss\"}")
+		.Add();
+	if(entry == cache.end()) {
+		return std::nullopt;
+	}
+	entry->second.last_used = use_counter++;
+	return entry->second.data;
+}
+
+void PanoramaServer::CachePut(std::string key, std::string data) {
+	std::scoped_lock lock { cache_m };
+	auto existing = cache.find(key);
+	if(existing != cache.end()) {
+		cache_bytes -= existing->second.data.size();
+	}
+	cache_bytes += data.size();
+	cache[key] = CacheEntry { .data = std::move(data), .last_used = use_counter++ };
+
+	// Same least recently used policy as the preloader, never drops what was just added
+	while(cache_bytes > RESPONSE_CACHE_BYTES && cache.size() > 1) {
+		auto oldest = std::min_element(cache.begin(), cache.end(),
+			[](auto& a, auto& b) { return a.second.last_used < b.second.last_used; });
+		cache_bytes -= oldest->second.data.size();
+		cache.erase(oldest);
+	}
+	get_metrics().Gauge("serve_cache_bytes").Set(cache_bytes);
+}
\ No newline at end of file
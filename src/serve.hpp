@@ -0,0 +1,86 @@
+#pragma once
+
+#include <curl/curl.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "preloader.hpp"
+
+// Resident process answering panorama requests over HTTP on localhost or a Unix socket, with the
+// client ID, connections and caches kept warm between requests
+//   GET /panorama/<id>                           metadata as JSON
+//   GET /panorama/<id>/adjacent                  adjacent panoramas as JSON
+//   GET /panorama/<id>/image.png                 stitched panorama at the server zoom
+//   GET /tile/<id>/<zoom>/<x>/<y>                one JPEG tile
+//   GET /nearby?lat=<lat>&long=<long>[&n=<n>]    IDs of panoramas around a location
+// Stitched panoramas are downloaded by a PanoramaPreloader, which also prefetches their adjacent
+// panoramas. Encoded responses are kept in a separate cache
+class PanoramaServer {
+public:
+	PanoramaServer(int num_threads, int streetview_zoom, size_t cache_bytes);
+	~PanoramaServer();
+
+	bool Listen(int port);
+	bool ListenUnix(std::string path);
+	// Accepts connections until the process is stopped
+	void Run();
+
+private:
+	struct Request {
+		std::vector<std::string> path;
+		std::unordered_map<std::string, std::string> query;
+	};
+
+	struct Response {
+		int status = 200;
+		std::string content_type;
+		std::string body;
+	};
+
+	struct CacheEntry {
+		std::string data;
+		uint64_t last_used;
+	};
+
+	void HandlerThread();
+	void HandleConnection(int fd, CURL* handle);
+	Response Route(Request& request, CURL* handle);
+	Response Metadata(std::string id, CURL* handle, bool adjacent);
+	Response Image(std::string id, CURL* handle);
+	Response Tile(std::string id, int zoom, int x, int y, CURL* handle);
+	Response Nearby(double lat, double lng, int num_previews, CURL* handle);
+
+	// Fetched again once it is older than CLIENT_ID_MAX_AGE or when refresh is set
+	std::string GetClientId(CURL* handle, bool refresh = false);
+
+	std::optional<std::string> CacheGet(std::string key);
+	void CachePut(std::string key, std::string data);
+
+	PanoramaPreloader preloader;
+
+	std::string client_id;
+	std::chrono::steady_clock::time_point client_id_fetched;
+	std::mutex client_id_m;
+
+	std::unordered_map<std::string, CacheEntry> cache;
+	uint64_t use_counter = 0;
+	size_t cache_bytes   = 0;
+	std::mutex cache_m;
+
+	std::vector<int> listen_fds;
+	std::string unix_path;
+
+	std::deque<int> connections;
+	bool running = true;
+	std::mutex connections_m;
+	std::condition_variable connections_cv;
+	std::vector<std::thread> threads;
+};
\ No newline at end of file
@@ -0,0 +1,401 @@
+#include "sfm.hpp"
+
+#include <fmt/format.h>
+#include <rapidjson/prettywriter.h>
+#include <rapidjson/stringbuffer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <unordered_map>
+
+#define DEG_RAD 0.0174533
+// WGS84, openMVG uses ECEF for GPS priors by default
+#define WGS84_A 6378137.0
+#define WGS84_E2 0.00669437999014
+// cereal marks the first occurrence of a pointer or polymorphic type with the high bit
+#define CEREAL_NEW_ID 0x80000000u
+// Smallest cube of the neighbour grid in meters, keeps the cell keys within 21 bits per axis
+#define MIN_GRID_CELL 10.0
+#define GRID_AXIS_MASK 0x1FFFFF
+
+struct EcefPosition {
+	double x;
+	double y;
+	double z;
+};
+
+// Street View altitude is not known, panoramas are placed on the ellipsoid
+static EcefPosition lat_lng_to_ecef(double lat, double lng) {
+	double lat_rad = lat * DEG_RAD;
+	double lng_rad = lng * DEG_RAD;
+	double n       = WGS84_A / std::sqrt(1.0 - WGS84_E2 * std::sin(lat_rad) * std::sin(lat_rad));
+	return EcefPosition {
+		.x = n * std::cos(lat_rad) * std::cos(lng_rad),
+		.y = n * std::cos(lat_rad) * std::sin(lng_rad),
+		.z = n * (1.0 - WGS84_E2) * std::sin(lat_rad),
+	};
+}
+
+// Buckets positions in cubes so neighbours are found by searching outward from a position's own
+// cube, instead of measuring the distance to every other position
+class PositionGrid {
+public:
+	// Cubes are sized to hold about num_neighbours positions each. Panoramas lie on a surface, so
+	// their count grows with the square of the extent
+	PositionGrid(std::vector<EcefPosition>& positions, int num_neighbours)
+		: positions(positions) {
+		if(positions.empty()) {
+			return;
+		}
+		auto low  = positions[0];
+		auto high = positions[0];
+		for(auto& position : positions) {
+			low.x  = std::min(low.x, position.x);
+			low.y  = std::min(low.y, position.y);
+			low.z  = std::min(low.z, position.z);
+			high.x = std::max(high.x, position.x);
+			high.y = std::max(high.y, position.y);
+			high.z = std::max(high.z, position.z);
+		}
+		double extent = std::max({ high.x - low.x, high.y - low.y, high.z - low.z });
+		cell_size     = std::max(
+			MIN_GRID_CELL, extent * std::sqrt((double)num_neighbours / positions.size()));
+
+		for(int i = 0; i < positions.size(); i++) {
+			int cx, cy, cz;
+			CellOf(positions[i], cx, cy, cz);
+			cells[CellKey(cx, cy, cz)].push_back(i);
+		}
+	}
+
+	// Closest positions other than i itself, nearest first
+	std::vector<int> Nearest(int i, int k) {
+		k = std::min<int>(k, positions.size() - 1);
+		std::vector<std::pair<double, int>> found;
+		if(k <= 0) {
+			return {};
+		}
+
+		int cx, cy, cz;
+		CellOf(positions[i], cx, cy, cz);
+		auto add_cell = [&](std::vector<int>& cell) {
+			for(int j : cell) {
+				if(j != i) {
+					found.push_back(std::make_pair(Distance(i, j), j));
+				}
+			}
+		};
+
+		for(int ring = 0;; ring++) {
+			// A shell with more cubes than there are occupied ones is cheaper to search by
+			// going through the occupied cubes, which also covers every remaining position
+			int64_t side = 2 * ring + 1;
+			if(side * side * side > (int64_t)cells.size()) {
+				for(auto& [key, cell] : cells) {
+					int x, y, z;
+					CellFromKey(key, x, y, z);
+					if(std::max({ std::abs(x - cx), std::abs(y - cy), std::abs(z - cz) }) >= ring) {
+						add_cell(cell);
+					}
+				}
+				break;
+			}
+
+			for(int dx = -ring; dx <= ring; dx++) {
+				for(int dy = -ring; dy <= ring; dy++) {
+					for(int dz = -ring; dz <= ring; dz++) {
+						// Only the surface of the shell, the inside was searched before
+						if(std::max({ std::abs(dx), std::abs(dy), std::abs(dz) }) != ring) {
+							continue;
+						}
+						auto cell = cells.find(CellKey(cx + dx, cy + dy, cz + dz));
+						if(cell != cells.end()) {
+							add_cell(cell->second);
+						}
+					}
+				}
+			}
+
+			// Anything outside the searched cubes is at least ring cells away
+			if(found.size() >= k) {
+				std::nth_element(found.begin(), found.begin() + k - 1, found.end());
+				double reach = ring * cell_size;
+				if(found[k - 1].first <= reach * reach) {
+					break;
+				}
+			}
+		}
+
+		std::partial_sort(found.begin(), found.begin() + k, found.end());
+		std::vector<int> nearest;
+		for(int n = 0; n < k; n++) {
+			nearest.push_back(found[n].second);
+		}
+		return nearest;
+	}
+
+private:
+	double Distance(int a, int b) {
+		double dx = positions[a].x - positions[b].x;
+		double dy = positions[a].y - positions[b].y;
+		double dz = positions[a].z - positions[b].z;
+		return dx * dx + dy * dy + dz * dz;
+	}
+
+	void CellOf(EcefPosition& position, int& x, int& y, int& z) {
+		x = std::floor(position.x / cell_size);
+		y = std::floor(position.y / cell_size);
+		z = std::floor(position.z / cell_size);
+	}
+
+	// 21 bits per axis, enough for the whole planet in cubes of MIN_GRID_CELL
+	int64_t CellKey(int x, int y, int z) {
+		return ((int64_t)(x & GRID_AXIS_MASK) << 42) | ((int64_t)(y & GRID_AXIS_MASK) << 21)
+			   | (z & GRID_AXIS_MASK);
+	}
+
+	void CellFromKey(int64_t key, int& x, int& y, int& z) {
+		// Sign extend each axis back from 21 bits
+		auto axis = [](int64_t bits) { return (int)((bits ^ 0x100000) - 0x100000); };
+		x         = axis((key >> 42) & GRID_AXIS_MASK);
+		y         = axis((key >> 21) & GRID_AXIS_MASK);
+		z         = axis(key & GRID_AXIS_MASK);
+	}
+
+	std::vector<EcefPosition>& positions;
+	double cell_size = MIN_GRID_CELL;
+	std::unordered_map<int64_t, std::vector<int>> cells;
+};
+
+// Dimensions from the IHDR chunk, without decoding the image
+static bool read_png_size(std::string path, int& width, int& height) {
+	std::ifstream file(path, std::ios::in | std::ios::binary);
+	unsigned char header[24];
+	if(!file.read((char*)header, sizeof(header))) {
+		return false;
+	}
+	width  = (header[16] << 24) | (header[17] << 16) | (header[18] << 8) | header[19];
+	height = (header[20] << 24) | (header[21] << 16) | (header[22] << 8) | header[23];
+	return true;
+}
+
+SfmPairs sfm_pairs_from_string(std::string mode) {
+	if(mode == "adjacency") {
+		return SfmPairs::ADJACENCY;
+	} else if(mode == "knn") {
+		return SfmPairs::KNN;
+	}
+	return SfmPairs::BOTH;
+}
+
+std::vector<std::pair<int, int>> sfm_match_pairs(
+	std::vector<CatalogRecord>& records, SfmPairs mode, int num_neighbours) {
+	std::set<std::pair<int, int>> pairs;
+	auto add_pair = [&](int a, int b) {
+		if(a != b) {
+			pairs.emplace(std::min(a, b), std::max(a, b));
+		}
+	};
+
+	if(mode != SfmPairs::KNN) {
+		// Links between panoramas as Street View itself connects them
+		std::unordered_map<std::string, int> index;
+		for(int i = 0; i < records.size(); i++) {
+			index[records[i].id] = i;
+		}
+		for(int i = 0; i < records.size(); i++) {
+			for(auto& adjacent : records[i].adjacent) {
+				auto found = index.find(adjacent);
+				if(found != index.end()) {
+					add_pair(i, found->second);
+				}
+			}
+		}
+	}
+
+	if(mode != SfmPairs::ADJACENCY) {
+		// Also catches panoramas of other captures that Street View does not link
+		std::vector<EcefPosition> positions;
+		for(auto& record : records) {
+			positions.push_back(lat_lng_to_ecef(record.lat, record.lng));
+		}
+
+		PositionGrid grid(positions, num_neighbours);
+		for(int i = 0; i < records.size(); i++) {
+			for(int neighbour : grid.Nearest(i, num_neighbours)) {
+				add_pair(i, neighbour);
+			}
+		}
+	}
+
+	return std::vector<std::pair<int, int>>(pairs.begin(), pairs.end());
+}
+
+int export_sfm(std::vector<CatalogRecord>& records, std::string output_dir, SfmPairs mode,
+	int num_neighbours) {
+	// Only panoramas whose image was saved
+	std::vector<CatalogRecord> views;
+	std::vector<std::pair<int, int>> sizes;
+	for(auto& record : records) {
+		int width, height;
+		if(record.path.empty() || !read_png_size(record.path, width, height)) {
+			continue;
+		}
+		views.push_back(record);
+		sizes.push_back(std::make_pair(width, height));
+	}
+	if(views.empty()) {
+		std::cerr << "No panorama images found in the catalog" << std::endl;
+		return 0;
+	}
+
+	// Image paths are relative to the directory of the first one when possible
+	auto root_path = std::filesystem::absolute(views[0].path).parent_path();
+
+	// Same size is the same spherical camera
+	std::map<std::pair<int, int>, int> intrinsic_ids;
+	for(auto& size : sizes) {
+		intrinsic_ids.emplace(size, intrinsic_ids.size());
+	}
+
+	rapidjson::StringBuffer sfm_sb;
+	rapidjson::PrettyWriter<rapidjson::StringBuffer> sfm_writer(sfm_sb);
+	sfm_writer.SetIndent(' ', 4);
+	sfm_writer.StartObject();
+	sfm_writer.Key("sfm_data_version");
+	sfm_writer.String("0.3");
+	sfm_writer.Key("root_path");
+	sfm_writer.String(root_path.string());
+
+	// cereal numbers shared pointers in order of appearance, views first
+	uint32_t pointer_id = 1;
+	sfm_writer.Key("views");
+	sfm_writer.StartArray();
+	for(int i = 0; i < views.size(); i++) {
+		auto& view = views[i];
+		sfm_writer.StartObject();
+		sfm_writer.Key("key");
+		sfm_writer.Uint(i);
+		sfm_writer.Key("value");
+		sfm_writer.StartObject();
+		// ViewPriors is the first polymorphic type
+		sfm_writer.Key("polymorphic_id");
+		if(i == 0) {
+			sfm_writer.Uint(CEREAL_NEW_ID | 1);
+			sfm_writer.Key("polymorphic_name");
+			sfm_writer.String("view_priors");
+		} else {
+			sfm_writer.Uint(1);
+		}
+		sfm_writer.Key("ptr_wrapper");
+		sfm_writer.StartObject();
+		sfm_writer.Key("id");
+		sfm_writer.Uint(CEREAL_NEW_ID | pointer_id++);
+		sfm_writer.Key("data");
+		sfm_writer.StartObject();
+		sfm_writer.Key("local_path");
+		sfm_writer.String("");
+		sfm_writer.Key("filename");
+		sfm_writer.String(
+			std::filesystem::absolute(view.path).lexically_relative(root_path).string());
+		sfm_writer.Key("width");
+		sfm_writer.Int(sizes[i].first);
+		sfm_writer.Key("height");
+		sfm_writer.Int(sizes[i].second);
+		sfm_writer.Key("id_view");
+		sfm_writer.Uint(i);
+		sfm_writer.Key("id_intrinsic");
+		sfm_writer.Uint(intrinsic_ids[sizes[i]]);
+		sfm_writer.Key("id_pose");
+		sfm_writer.Uint(i);
+
+		auto center = lat_lng_to_ecef(view.lat, view.lng);
+		sfm_writer.Key("use_pose_center_prior");
+		sfm_writer.Bool(true);
+		sfm_writer.Key("center_weight");
+		sfm_writer.StartArray();
+		for(int axis = 0; axis < 3; axis++) {
+			sfm_writer.Double(1.0);
+		}
+		sfm_writer.EndArray();
+		sfm_writer.Key("center");
+		sfm_writer.StartArray();
+		sfm_writer.Double(center.x);
+		sfm_writer.Double(center.y);
+		sfm_writer.Double(center.z);
+		sfm_writer.EndArray();
+
+		sfm_writer.EndObject();
+		sfm_writer.EndObject();
+		sfm_writer.EndObject();
+		sfm_writer.EndObject();
+	}
+	sfm_writer.EndArray();
+
+	sfm_writer.Key("intrinsics");
+	sfm_writer.StartArray();
+	bool first_intrinsic = true;
+	for(auto& [size, intrinsic_id] : intrinsic_ids) {
+		sfm_writer.StartObject();
+		sfm_writer.Key("key");
+		sfm_writer.Uint(intrinsic_id);
+		sfm_writer.Key("value");
+		sfm_writer.StartObject();
+		// Equirectangular panoramas, openMVG camera model 7
+		sfm_writer.Key("polymorphic_id");
+		if(first_intrinsic) {
+			sfm_writer.Uint(CEREAL_NEW_ID | 2);
+			sfm_writer.Key("polymorphic_name");
+			sfm_writer.String("spherical");
+			first_intrinsic = false;
+		} else {
+			sfm_writer.Uint(2);
+		}
+		sfm_writer.Key("ptr_wrapper");
+		sfm_writer.StartObject();
+		sfm_writer.Key("id");
+		sfm_writer.Uint(CEREAL_NEW_ID | pointer_id++);
+		sfm_writer.Key("data");
+		sfm_writer.StartObject();
+		sfm_writer.Key("width");
+		sfm_writer.Int(size.first);
+		sfm_writer.Key("height");
+		sfm_writer.Int(size.second);
+		sfm_writer.EndObject();
+		sfm_writer.EndObject();
+		sfm_writer.EndObject();
+		sfm_writer.EndObject();
+	}
+	sfm_writer.EndArray();
+
+	// Poses and structure are what the reconstruction computes
+	for(auto key : { "extrinsics", "structure", "control_points" }) {
+		sfm_writer.Key(key);
+		sfm_writer.StartArray();
+		sfm_writer.EndArray();
+	}
+	sfm_writer.EndObject();
+
+	std::filesystem::create_directories(output_dir);
+	std::ofstream sfm_file(std::filesystem::path(output_dir) / "sfm_data.json", std::ios::out);
+	sfm_file.write(sfm_sb.GetString(), sfm_sb.GetLength());
+	sfm_file.close();
+
+	// One pair per line, read by openMVG_main_ComputeMatches -p
+	std::ofstream pairs_file(
+		std::filesystem::path(output_dir) / "matching_pairs.txt", std::ios::out);
+	auto pairs = sfm_match_pairs(views, mode, num_neighbours);
+	for(auto [a, b] : pairs) {
+		pairs_file << a << ' ' << b << '\n';
+	}
+	pairs_file.close();
+
+	fmt::print("Exported {} views and {} pairs to {}\n", views.size(), pairs.size(), output_dir);
+	return views.size();
+}
\ No newline at end of file
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "catalog.hpp"
+
+enum class SfmPairs {
+	ADJACENCY,
+	KNN,
+	BOTH,
+};
+
+// View indices to match, each pair once with the lower index first
+std::vector<std::pair<int, int>> sfm_match_pairs(
+	std::vector<CatalogRecord>& records, SfmPairs mode, int num_neighbours);
+
+// Writes sfm_data.json with one spherical intrinsic per image size and a GPS center prior per
+// view, and matching_pairs.txt, so openMVG can skip SfMInit_ImageListing and matching every
+// image against every other. Panoramas without an image are left out. Returns the number of
+// views
+int export_sfm(std::vector<CatalogRecord>& records, std::string output_dir, SfmPairs mode,
+	int num_neighbours);
+SfmPairs sfm_pairs_from_string(std::string mode);
\ No newline at end of file
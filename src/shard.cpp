@@ -0,0 +1,433 @@
+#include "shard.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define GEOHASH_ALPHABET "0123456789bcdefghjkmnpqrstuvwxyz"
+// Well below the default coordinator timeout of 120 seconds
+#define HEARTBEAT_SECONDS 10
+
+std::string geohash_encode(double lat, double lng, int precision) {
+	double lat_range[2] = { -90.0, 90.0 };
+	double lng_range[2] = { -180.0, 180.0 };
+	std::string geohash;
+	bool even_bit = true;
+	int bit       = 0;
+	int character = 0;
+	while(geohash.size() < precision) {
+		// Bits alternate between longitude and latitude, starting with longitude
+		double* range = even_bit ? lng_range : lat_range;
+		double value  = even_bit ? lng : lat;
+		double mid    = (range[0] + range[1]) / 2;
+		character <<= 1;
+		if(value >= mid) {
+			character |= 1;
+			range[0] = mid;
+		} else {
+			range[1] = mid;
+		}
+		even_bit = !even_bit;
+
+		if(++bit == 5) {
+			geohash.push_back(GEOHASH_ALPHABET[character]);
+			bit       = 0;
+			character = 0;
+		}
+	}
+	return geohash;
+}
+
+Area geohash_area(std::string geohash) {
+	double lat_range[2] = { -90.0, 90.0 };
+	double lng_range[2] = { -180.0, 180.0 };
+	bool even_bit       = true;
+	for(char c : geohash) {
+		int character = std::string(GEOHASH_ALPHABET).find(c);
+		for(int bit = 4; bit >= 0; bit--) {
+			double* range = even_bit ? lng_range : lat_range;
+			double mid    = (range[0] + range[1]) / 2;
+			if((character >> bit) & 1) {
+				range[0] = mid;
+			} else {
+				range[1] = mid;
+			}
+			even_bit = !even_bit;
+		}
+	}
+
+	Area area;
+	area.min_lat = lat_range[0];
+	area.max_lat = lat_range[1];
+	area.min_lng = lng_range[0];
+	area.max_lng = lng_range[1];
+	return area;
+}
+
+std::vector<std::string> geohash_cover(Area& area, int precision) {
+	// Step by the size of one geohash cell and collect every cell touching the area
+	auto cell       = geohash_area(geohash_encode(area.min_lat, area.min_lng, precision));
+	double lat_step = cell.max_lat - cell.min_lat;
+	double lng_step = cell.max_lng - cell.min_lng;
+
+	std::vector<std::string> shards;
+	std::unordered_set<std::string> seen;
+	for(double lat = cell.min_lat + lat_step / 2; lat - lat_step / 2 < area.max_lat;
+		lat += lat_step) {
+		for(double lng = cell.min_lng + lng_step / 2; lng - lng_step / 2 < area.max_lng;
+			lng += lng_step) {
+			auto geohash = geohash_encode(lat, lng, precision);
+			auto bounds  = geohash_area(geohash);
+			if(!seen.count(geohash)
+				&& area.IntersectsCell(
+					bounds.min_lat, bounds.min_lng, bounds.max_lat, bounds.max_lng)) {
+				seen.emplace(geohash);
+				shards.push_back(geohash);
+			}
+		}
+	}
+	return shards;
+}
+
+ShardCoordinator::ShardCoordinator(std::vector<std::string> shards, Area area, int timeout_seconds)
+	: area(area)
+	, timeout(timeout_seconds)
+	, num_shards(shards.size())
+	, queued_shards(shards.begin(), shards.end()) { }
+
+ShardCoordinator::~ShardCoordinator() {
+	for(auto& [fd, worker] : workers) {
+		close(fd);
+	}
+	if(listen_fd != -1) {
+		close(listen_fd);
+	}
+}
+
+bool ShardCoordinator::Listen(std::string bind_address, int port) {
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	sockaddr_in address {};
+	address.sin_family = AF_INET;
+	address.sin_port   = htons(port);
+	if(inet_pton(AF_INET, bind_address.c_str(), &address.sin_addr) != 1) {
+		std::cerr << "Invalid bind address " << bind_address << std::endl;
+		return false;
+	}
+	if(bind(listen_fd, (sockaddr*)&address, sizeof(address)) != 0
+		|| listen(listen_fd, 64) != 0) {
+		std::cerr << "Could not listen on " << bind_address << ":" << port << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void ShardCoordinator::Run() {
+	while(finished_shards.size() < num_shards) {
+		std::vector<pollfd> fds { { .fd = listen_fd, .events = POLLIN } };
+		for(auto& [fd, worker] : workers) {
+			fds.push_back({ .fd = fd, .events = POLLIN });
+		}
+		poll(fds.data(), fds.size(), 1000);
+
+		if(fds[0].revents & POLLIN) {
+			int fd = accept(listen_fd, nullptr, nullptr);
+			if(fd != -1) {
+				workers[fd] = Worker {
+					.fd        = fd,
+					.last_seen = std::chrono::steady_clock::now(),
+				};
+			}
+		}
+
+		for(int i = 1; i < fds.size(); i++) {
+			if(!workers.count(fds[i].fd)) {
+				continue;
+			}
+			auto& worker = workers[fds[i].fd];
+
+			if(fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				if(!ReadLines(worker)) {
+					DropWorker(worker);
+				}
+			} else if(std::chrono::steady_clock::now() - worker.last_seen > timeout) {
+				fmt::print("Worker {} timed out\n", worker.id);
+				DropWorker(worker);
+			}
+		}
+	}
+
+	// Tell everyone still connected
+	for(auto& [fd, worker] : workers) {
+		SendLine(worker, "DONE");
+	}
+	fmt::print("All {} shards finished, {} panoramas\n", num_shards, num_panoramas);
+
+	// Workers close their catalogs before disconnecting, merging earlier would miss records or
+	// find a binary catalog without its footer
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	while(!workers.empty() && std::chrono::steady_clock::now() < deadline) {
+		std::vector<pollfd> fds;
+		for(auto& [fd, worker] : workers) {
+			fds.push_back({ .fd = fd, .events = POLLIN });
+		}
+		poll(fds.data(), fds.size(), 1000);
+		for(auto& worker_fd : fds) {
+			if(worker_fd.revents & (POLLIN | POLLHUP | POLLERR)) {
+				auto& worker = workers[worker_fd.fd];
+				if(!ReadLines(worker)) {
+					close(worker_fd.fd);
+					workers.erase(worker_fd.fd);
+				}
+			}
+		}
+	}
+	for(auto& [fd, worker] : workers) {
+		fmt::print("Worker {} did not disconnect, its catalog may be incomplete\n", worker.id);
+	}
+}
+
+bool ShardCoordinator::ReadLines(Worker& worker) {
+	char buf[4096];
+	auto len = read(worker.fd, buf, sizeof(buf));
+	if(len <= 0) {
+		return false;
+	}
+	worker.buffer.append(buf, len);
+	worker.last_seen = std::chrono::steady_clock::now();
+
+	size_t newline;
+	while((newline = worker.buffer.find('\n')) != std::string::npos) {
+		auto line = worker.buffer.substr(0, newline);
+		worker.buffer.erase(0, newline + 1);
+		HandleLine(worker, line);
+	}
+	return true;
+}
+
+void ShardCoordinator::HandleLine(Worker& worker, std::string line) {
+	std::stringstream line_stream(line);
+	std::string command;
+	line_stream >> command;
+
+	if(command == "HELLO") {
+		std::string catalog_path;
+		line_stream >> worker.id >> catalog_path;
+		if(std::find(worker_catalogs.begin(), worker_catalogs.end(), catalog_path)
+			== worker_catalogs.end()) {
+			worker_catalogs.push_back(catalog_path);
+		}
+		SendLine(worker, format_area(area));
+		fmt::print("Worker {} connected\n", worker.id);
+	} else if(command == "NEXT") {
+		if(!queued_shards.empty()) {
+			auto shard = queued_shards.front();
+			queued_shards.pop_front();
+			worker.shards.emplace(shard);
+			SendLine(worker, "SHARD " + shard);
+		} else if(finished_shards.size() < num_shards) {
+			// Shards are still running elsewhere and may be reassigned
+			SendLine(worker, "WAIT");
+		} else {
+			SendLine(worker, "DONE");
+		}
+	} else if(command == "FINISHED") {
+		std::string shard;
+		int shard_panoramas = 0;
+		line_stream >> shard >> shard_panoramas;
+		worker.shards.erase(shard);
+		if(finished_shards.emplace(shard).second) {
+			num_panoramas += shard_panoramas;
+		}
+		fmt::print("Shards finished: {}/{} Panoramas: {} Workers: {}\n", finished_shards.size(),
+			num_shards, num_panoramas, workers.size());
+	}
+	// PROGRESS only refreshes last_seen
+}
+
+void ShardCoordinator::DropWorker(Worker& worker) {
+	// Put its unfinished shards back at the front of the queue
+	for(auto& shard : worker.shards) {
+		if(!finished_shards.count(shard)) {
+			queued_shards.push_front(shard);
+		}
+	}
+	fmt::print("Worker {} left, {} shards reassigned\n", worker.id, worker.shards.size());
+	// Erasing destroys worker
+	int fd = worker.fd;
+	close(fd);
+	workers.erase(fd);
+}
+
+void ShardCoordinator::SendLine(Worker& worker, std::string line) {
+	line += '\n';
+	send(worker.fd, line.data(), line.size(), MSG_NOSIGNAL);
+}
+
+ShardClient::~ShardClient() {
+	progress_m.lock();
+	run_heartbeat = false;
+	progress_m.unlock();
+	progress_cv.notify_all();
+	if(heartbeat_thread.joinable()) {
+		heartbeat_thread.join();
+	}
+	if(fd != -1) {
+		close(fd);
+	}
+}
+
+bool ShardClient::Connect(std::string address, std::string worker_id, std::string catalog_path) {
+	// host:port
+	auto colon = address.rfind(':');
+	if(colon == std::string::npos) {
+		std::cerr << "Coordinator address must be host:port" << std::endl;
+		return false;
+	}
+	auto host = address.substr(0, colon);
+	auto port = address.substr(colon + 1);
+
+	addrinfo hints {};
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* results;
+	if(getaddrinfo(host.c_str(), port.c_str(), &hints, &results) != 0) {
+		std::cerr << "Could not resolve " << host << std::endl;
+		return false;
+	}
+	for(auto result = results; result; result = result->ai_next) {
+		fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+		if(fd != -1 && connect(fd, result->ai_addr, result->ai_addrlen) == 0) {
+			break;
+		}
+		if(fd != -1) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(results);
+	if(fd == -1) {
+		std::cerr << "Could not connect to coordinator " << address << std::endl;
+		return false;
+	}
+
+	if(!SendLine(fmt::format("HELLO {} {}", worker_id, catalog_path))) {
+		return false;
+	}
+	auto parsed_area = parse_area(ReadLine());
+	if(!parsed_area) {
+		std::cerr << "Coordinator did not send a valid area" << std::endl;
+		return false;
+	}
+	area = *parsed_area;
+	heartbeat_thread = std::thread(&ShardClient::HeartbeatThread, this);
+	return true;
+}
+
+std::string ShardClient::NextShard() {
+	while(true) {
+		if(!SendLine("NEXT")) {
+			return "";
+		}
+		auto line = ReadLine();
+		if(line.rfind("SHARD ", 0) == 0) {
+			return line.substr(6);
+		} else if(line == "WAIT") {
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+		} else {
+			// DONE or the coordinator went away
+			return "";
+		}
+	}
+}
+
+void ShardClient::Progress(std::string shard, int num_panoramas) {
+	// Sent by the heartbeat
+	std::scoped_lock lock { progress_m };
+	progress_shard     = shard;
+	progress_panoramas = num_panoramas;
+}
+
+void ShardClient::Finished(std::string shard, int num_panoramas) {
+	SendLine(fmt::format("FINISHED {} {}", shard, num_panoramas));
+}
+
+void ShardClient::HeartbeatThread() {
+	std::unique_lock lock { progress_m };
+	while(true) {
+		progress_cv.wait_for(
+			lock, std::chrono::seconds(HEARTBEAT_SECONDS), [this] { return !run_heartbeat; });
+		if(!run_heartbeat) {
+			break;
+		}
+		auto line = fmt::format("PROGRESS {} {}", progress_shard, progress_panoramas);
+		lock.unlock();
+		SendLine(line);
+		lock.lock();
+	}
+}
+
+bool ShardClient::SendLine(std::string line) {
+	// The heartbeat sends from its own thread
+	std::scoped_lock lock { send_m };
+	line += '\n';
+	return send(fd, line.data(), line.size(), MSG_NOSIGNAL) == line.size();
+}
+
+std::string ShardClient::ReadLine() {
+	size_t newline;
+	while((newline = buffer.find('\n')) == std::string::npos) {
+		char buf[4096];
+		auto len = read(fd, buf, sizeof(buf));
+		if(len <= 0) {
+			return "";
+		}
+		buffer.append(buf, len);
+	}
+	auto line = buffer.substr(0, newline);
+	buffer.erase(0, newline + 1);
+	return line;
+}
+
+int merge_catalogs(
+	std::vector<std::string> catalog_paths, std::string merged_path, CatalogFormat format) {
+	// Opening the merged catalog empties it, it must not be one of the inputs
+	for(auto& path : catalog_paths) {
+		if(std::filesystem::weakly_canonical(path)
+			== std::filesystem::weakly_canonical(merged_path)) {
+			std::cerr << "Worker catalog " << path << " is the merged catalog" << std::endl;
+			return 0;
+		}
+	}
+
+	CatalogWriter merged;
+	if(!merged.Open(merged_path, format)) {
+		std::cerr << "Could not open catalog " << merged_path << std::endl;
+		return 0;
+	}
+
+	// Panoramas near shard edges can be found by both neighbours, keep the first copy
+	std::unordered_set<std::string> seen_ids;
+	for(auto& path : catalog_paths) {
+		for(auto& record : read_catalog(path)) {
+			if(seen_ids.emplace(record.id).second) {
+				merged.Append(record);
+			}
+		}
+	}
+	merged.Close();
+	return seen_ids.size();
+}
\ No newline at end of file
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "area.hpp"
+#include "catalog.hpp"
+
+std::string geohash_encode(double lat, double lng, int precision);
+Area geohash_area(std::string geohash);
+std::vector<std::string> geohash_cover(Area& area, int precision);
+
+// Hands out geohash shards to workers connected over TCP. The line protocol is
+//   worker: HELLO <worker id> <catalog path>, NEXT, PROGRESS <shard> <n>, FINISHED <shard> <n>
+//   coordinator: the area after HELLO (see format_area), SHARD <shard>, WAIT (retry later),
+//   DONE (every shard finished)
+// Shards cover the area but reach past its edges, workers only keep panoramas inside it
+// A worker that disconnects or stays silent for longer than the timeout loses its shards. Once
+// every shard is finished, workers close their catalogs and disconnect before Run returns
+class ShardCoordinator {
+public:
+	ShardCoordinator(std::vector<std::string> shards, Area area, int timeout_seconds);
+	~ShardCoordinator();
+
+	bool Listen(std::string bind_address, int port);
+	void Run();
+	std::vector<std::string> GetWorkerCatalogs() {
+		return worker_catalogs;
+	}
+
+private:
+	struct Worker {
+		int fd;
+		std::string id;
+		std::string buffer;
+		std::unordered_set<std::string> shards;
+		std::chrono::steady_clock::time_point last_seen;
+	};
+
+	// False once the worker disconnected
+	bool ReadLines(Worker& worker);
+	void HandleLine(Worker& worker, std::string line);
+	void DropWorker(Worker& worker);
+	void SendLine(Worker& worker, std::string line);
+
+	int listen_fd = -1;
+	Area area;
+	std::chrono::seconds timeout;
+	int num_shards;
+	std::deque<std::string> queued_shards;
+	std::unordered_set<std::string> finished_shards;
+	std::unordered_map<int, Worker> workers;
+	std::vector<std::string> worker_catalogs;
+	int num_panoramas = 0;
+};
+
+class ShardClient {
+public:
+	~ShardClient();
+
+	// Also starts sending the latest progress every few seconds, so a worker busy sweeping or
+	// downloading a large shard isn't mistaken for a dead one
+	bool Connect(std::string address, std::string worker_id, std::string catalog_path);
+	// Sent by the coordinator on connecting
+	Area& GetArea() {
+		return area;
+	}
+	// Empty once every shard is finished
+	std::string NextShard();
+	void Progress(std::string shard, int num_panoramas);
+	// The shard's panoramas and catalog records must already be written
+	void Finished(std::string shard, int num_panoramas);
+
+private:
+	bool SendLine(std::string line);
+	std::string ReadLine();
+	void HeartbeatThread();
+
+	int fd = -1;
+	std::string buffer;
+	std::mutex send_m;
+	Area area;
+
+	std::string progress_shard;
+	int progress_panoramas = 0;
+	bool run_heartbeat     = true;
+	std::mutex progress_m;
+	std::condition_variable progress_cv;
+	std::thread heartbeat_thread;
+};
+
+int merge_catalogs(
+	std::vector<std::string> catalog_paths, std::string merged_path, CatalogFormat format);
\ No newline at end of file
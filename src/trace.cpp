@@ -0,0 +1,170 @@
+#include "trace.hpp"
+
+#include <fmt/format.h>
+
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Events a thread buffers before writing them out, about a megabyte
+#define TRACE_FLUSH_EVENTS 4096
+
+struct TraceEvent {
+	const char* category;
+	std::string name;
+	std::string args;
+	int64_t start_us;
+	int64_t duration_us;
+};
+
+struct TraceThreadBuffer {
+	int tid;
+	// Only contended while trace_finish collects
+	std::mutex events_m;
+	std::vector<TraceEvent> events;
+};
+
+static std::atomic<bool> tracing = false;
+static std::chrono::steady_clock::time_point trace_epoch;
+static std::mutex trace_file_m;
+static std::ofstream trace_file;
+static bool trace_first_event = true;
+static std::mutex buffers_m;
+static std::vector<std::shared_ptr<TraceThreadBuffer>> buffers;
+
+static TraceThreadBuffer& get_thread_buffer() {
+	thread_local std::shared_ptr<TraceThreadBuffer> buffer = [] {
+		std::scoped_lock lock { buffers_m };
+		auto new_buffer = std::make_shared<TraceThreadBuffer>();
+		new_buffer->tid = buffers.size() + 1;
+		new_buffer->events.reserve(TRACE_FLUSH_EVENTS);
+		buffers.push_back(new_buffer);
+		return new_buffer;
+	}();
+	return *buffer;
+}
+
+static std::string escape_json(std::string str) {
+	std::string escaped;
+	for(char c : str) {
+		if(c == '"' || c == '\\') {
+			escaped.push_back('\\');
+		}
+		if((unsigned char)c >= 0x20) {
+			escaped.push_back(c);
+		}
+	}
+	return escaped;
+}
+
+static void write_events(int tid, std::vector<TraceEvent>& events) {
+	std::scoped_lock lock { trace_file_m };
+	if(!trace_file.is_open()) {
+		return;
+	}
+	for(auto& event : events) {
+		trace_file << (trace_first_event ? "" : ",\n")
+				   << fmt::format(
+						  "{{\"name\":\"{}\",\"cat\":\"{}\",\"ph\":\"X\",\"ts\":{},\"dur\":{},"
+						  "\"pid\":1,\"tid\":{},\"args\":{{{}}}}}",
+						  escape_json(event.name), event.category, event.start_us,
+						  event.duration_us, tid, event.args);
+		trace_first_event = false;
+	}
+}
+
+void trace_start(std::string path) {
+	trace_file.open(path, std::ios::out | std::ios::trunc);
+	if(!trace_file.is_open()) {
+		std::cerr << "Could not write trace " << path << std::endl;
+		return;
+	}
+	trace_file << "{\"traceEvents\":[\n";
+
+	trace_epoch = std::chrono::steady_clock::now();
+	tracing     = true;
+}
+
+bool trace_enabled() {
+	return tracing;
+}
+
+void trace_finish() {
+	if(!tracing) {
+		return;
+	}
+	tracing = false;
+
+	std::scoped_lock lock { buffers_m };
+	for(auto& buffer : buffers) {
+		std::scoped_lock events_lock { buffer->events_m };
+		write_events(buffer->tid, buffer->events);
+		buffer->events.clear();
+	}
+
+	std::scoped_lock file_lock { trace_file_m };
+	trace_file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+	trace_file.close();
+}
+
+TraceScope::~TraceScope() {
+	trace_finish();
+}
+
+TraceSpan::TraceSpan(const char* category, std::string name)
+	: enabled(tracing)
+	, category(category) {
+	if(enabled) {
+		this->name = std::move(name);
+		start      = std::chrono::steady_clock::now();
+	}
+}
+
+TraceSpan::TraceSpan(
+	const char* category, std::string name, std::chrono::steady_clock::time_point start)
+	: TraceSpan(category, std::move(name)) {
+	this->start = start;
+}
+
+TraceSpan::~TraceSpan() {
+	if(!enabled || !tracing) {
+		return;
+	}
+
+	auto end     = std::chrono::steady_clock::now();
+	auto& buffer = get_thread_buffer();
+	std::unique_lock lock { buffer.events_m };
+	buffer.events.push_back(TraceEvent {
+		.category = category,
+		.name     = std::move(name),
+		.args     = std::move(args),
+		.start_us = std::chrono::duration_cast<std::chrono::microseconds>(start - trace_epoch)
+						.count(),
+		.duration_us
+		= std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(),
+	});
+
+	// Long runs would otherwise hold every span in memory until trace_finish
+	if(buffer.events.size() >= TRACE_FLUSH_EVENTS) {
+		std::vector<TraceEvent> events;
+		events.reserve(TRACE_FLUSH_EVENTS);
+		events.swap(buffer.events);
+		lock.unlock();
+		write_events(buffer.tid, events);
+	}
+}
+
+void TraceSpan::Arg(const char* key, std::string value) {
+	if(enabled) {
+		args += fmt::format("{}\"{}\":\"{}\"", args.empty() ? "" : ",", key, escape_json(value));
+	}
+}
+
+void TraceSpan::Arg(const char* key, int64_t value) {
+	if(enabled) {
+		args += fmt::format("{}\"{}\":{}", args.empty() ? "" : ",", key, value);
+	}
+}
\ No newline at end of file
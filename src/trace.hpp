@@ -0,0 +1,36 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Chrome trace event output, open the file in Perfetto or chrome://tracing. Spans are kept
+// in a buffer per thread and written out whenever a buffer fills up, trace_finish writes the
+// rest and closes the file
+void trace_start(std::string path);
+void trace_finish();
+bool trace_enabled();
+
+// Finishes the trace when it goes out of scope, so every way out of main writes a valid file
+class TraceScope {
+public:
+	~TraceScope();
+};
+
+class TraceSpan {
+public:
+	TraceSpan(const char* category, std::string name);
+	// Begins at start instead, for work that started before the span could be created
+	TraceSpan(const char* category, std::string name, std::chrono::steady_clock::time_point start);
+	~TraceSpan();
+
+	void Arg(const char* key, std::string value);
+	void Arg(const char* key, int64_t value);
+
+private:
+	bool enabled;
+	const char* category;
+	std::string name;
+	std::string args;
+	std::chrono::steady_clock::time_point start;
+};
\ No newline at end of file
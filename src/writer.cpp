@@ -0,0 +1,274 @@
+#include "writer.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "budget.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+#define RING_ENTRIES 256
+// Encoded panoramas wait in memory until written, producers block past this
+#define MAX_QUEUED_BYTES ((size_t)512 << 20)
+// Smaller files, like JSON, always go through the page cache
+#define DIRECT_MIN_BYTES ((size_t)1 << 20)
+#define DIRECT_ALIGNMENT 4096
+
+OutputWriter::OutputWriter(int num_threads) {
+#ifdef HAVE_LIBURING
+	// Fails on old kernels or when io_uring is blocked, like in some containers
+	if(io_uring_queue_init(RING_ENTRIES, &ring, 0) == 0) {
+		use_ring = true;
+		threads.push_back(std::thread(&OutputWriter::RingThread, this));
+		return;
+	}
+#endif
+	for(int i = 0; i < num_threads; i++) {
+		threads.push_back(std::thread(&OutputWriter::WriteThread, this));
+	}
+}
+
+OutputWriter::~OutputWriter() {
+	Flush();
+	jobs_m.lock();
+	running = false;
+	jobs_m.unlock();
+	jobs_cv.notify_all();
+	for(auto& thread : threads) {
+		thread.join();
+	}
+#ifdef HAVE_LIBURING
+	if(use_ring) {
+		io_uring_queue_exit(&ring);
+	}
+#endif
+}
+
+void OutputWriter::Write(std::string path, sk_sp<SkData> data) {
+	std::unique_lock lock { jobs_m };
+	idle_cv.wait(lock, [this] { return queued_bytes < MAX_QUEUED_BYTES; });
+	queued_bytes += data->size();
+	// Already allocated, counted so new panoramas wait while writes fall behind
+	get_memory_budget().ForceReserve(data->size());
+	jobs.push_back(Job { .path = path, .data = data });
+	get_metrics().Gauge("write_queue_depth").Set(jobs.size());
+	jobs_cv.notify_one();
+}
+
+void OutputWriter::Write(std::string path, const char* data, size_t size) {
+	Write(path, SkData::MakeWithCopy(data, size));
+}
+
+void OutputWriter::Flush() {
+	std::unique_lock lock { jobs_m };
+	idle_cv.wait(lock, [this] { return jobs.empty() && busy == 0; });
+}
+
+bool OutputWriter::EnsureDirectory(std::string& path) {
+	auto parent = std::filesystem::path(path).parent_path();
+	if(parent.empty()) {
+		return true;
+	}
+
+	std::scoped_lock lock { directories_m };
+	if(directories.count(parent.string())) {
+		return true;
+	}
+	std::error_code error;
+	std::filesystem::create_directories(parent, error);
+	if(error) {
+		std::cerr << "Could not create " << parent << ": " << error.message() << std::endl;
+		return false;
+	}
+	directories.insert(parent.string());
+	return true;
+}
+
+bool OutputWriter::Open(PendingFile& file) {
+	auto& data  = file.job.data;
+	file.start  = std::chrono::steady_clock::now();
+	file.direct = false;
+	file.fd     = -1;
+	if(!EnsureDirectory(file.job.path)) {
+		return false;
+	}
+
+#ifdef O_DIRECT
+	if(direct && data->size() >= DIRECT_MIN_BYTES) {
+		file.fd     = open(file.job.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+		file.direct = file.fd != -1;
+	}
+#endif
+	if(file.fd == -1) {
+		// Not every filesystem supports O_DIRECT, tmpfs for example
+		file.fd = open(file.job.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if(file.fd == -1) {
+		std::cerr << "Could not open " << file.job.path << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	file.write_data = data->data();
+	file.write_size = data->size();
+	if(file.direct) {
+		// Offset, length and memory all have to be aligned, the padding is truncated afterwards
+		file.write_size = (data->size() + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+		if(posix_memalign(&file.buffer, DIRECT_ALIGNMENT, file.write_size) != 0) {
+			file.buffer = nullptr;
+			return false;
+		}
+		memcpy(file.buffer, data->data(), data->size());
+		memset((char*)file.buffer + data->size(), 0, file.write_size - data->size());
+		file.write_data = file.buffer;
+	}
+	return true;
+}
+
+void OutputWriter::Finish(PendingFile& file) {
+	size_t size = file.job.data->size();
+	// From Open, with io_uring the write itself happens in between on the ring
+	TraceSpan write_span("io", "write", file.start);
+	write_span.Arg("bytes", size);
+	if(file.fd != -1) {
+		if(file.direct && !file.failed) {
+			// fsync of the padded write doesn't cover the new size, sync again after
+			if(ftruncate(file.fd, size) != 0 || (sync && fsync(file.fd) != 0)) {
+				file.failed = true;
+			}
+		}
+		close(file.fd);
+	}
+	free(file.buffer);
+
+	if(file.failed) {
+		std::cerr << "Could not write " << file.job.path << std::endl;
+		get_metrics().Counter("write_errors").Add();
+	} else {
+		get_metrics().Histogram("write_us").Record(
+			std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - file.start)
+				.count());
+		get_metrics().Counter("bytes_written").Add(size);
+	}
+
+	get_memory_budget().Release(size);
+	jobs_m.lock();
+	queued_bytes -= size;
+	busy--;
+	jobs_m.unlock();
+	idle_cv.notify_all();
+}
+
+void OutputWriter::WriteThread() {
+	while(true) {
+		std::unique_lock lock { jobs_m };
+		jobs_cv.wait(lock, [this] { return !running || !jobs.empty(); });
+		if(jobs.empty()) {
+			break;
+		}
+		PendingFile file { .job = std::move(jobs.front()) };
+		jobs.pop_front();
+		busy++;
+		get_metrics().Gauge("write_queue_depth").Set(jobs.size());
+		lock.unlock();
+
+		if(Open(file)) {
+			size_t written = 0;
+			while(written < file.write_size) {
+				ssize_t result = write(file.fd, (const char*)file.write_data + written,
+					file.write_size - written);
+				if(result == -1 && errno == EINTR) {
+					continue;
+				} else if(result <= 0) {
+					file.failed = true;
+					break;
+				}
+				written += result;
+			}
+			if(!file.failed && sync && !file.direct && fsync(file.fd) != 0) {
+				file.failed = true;
+			}
+		} else {
+			file.failed = true;
+		}
+		Finish(file);
+	}
+}
+
+#ifdef HAVE_LIBURING
+void OutputWriter::RingThread() {
+	int in_flight = 0;
+	while(true) {
+		// Everything queued since the last submission goes out together
+		std::vector<Job> batch;
+		std::unique_lock lock { jobs_m };
+		if(in_flight == 0) {
+			jobs_cv.wait(lock, [this] { return !running || !jobs.empty(); });
+			if(jobs.empty()) {
+				break;
+			}
+		}
+		// Each file takes at most 2 entries, a write and an fsync
+		while(!jobs.empty() && in_flight + batch.size() < RING_ENTRIES / 2) {
+			batch.push_back(std::move(jobs.front()));
+			jobs.pop_front();
+		}
+		busy += batch.size();
+		get_metrics().Gauge("write_queue_depth").Set(jobs.size());
+		lock.unlock();
+
+		for(auto& job : batch) {
+			auto file = new PendingFile { .job = std::move(job) };
+			if(!Open(*file)) {
+				file->failed = true;
+				Finish(*file);
+				delete file;
+				continue;
+			}
+
+			auto write_sqe = io_uring_get_sqe(&ring);
+			io_uring_prep_write(write_sqe, file->fd, file->write_data, file->write_size, 0);
+			io_uring_sqe_set_data(write_sqe, file);
+			file->remaining_completions = 1;
+			if(sync && !file->direct) {
+				// Only runs if the write succeeded, otherwise completes as cancelled
+				write_sqe->flags |= IOSQE_IO_LINK;
+				auto fsync_sqe = io_uring_get_sqe(&ring);
+				io_uring_prep_fsync(fsync_sqe, file->fd, 0);
+				io_uring_sqe_set_data(fsync_sqe, file);
+				file->remaining_completions = 2;
+			}
+			in_flight++;
+		}
+
+		// Without anything new to submit, sleep until a write completes
+		io_uring_submit_and_wait(&ring, batch.empty() && in_flight > 0 ? 1 : 0);
+
+		io_uring_cqe* cqe;
+		while(io_uring_peek_cqe(&ring, &cqe) == 0) {
+			auto file = (PendingFile*)io_uring_cqe_get_data(cqe);
+			if(!file->write_done) {
+				// Linked requests complete in order, the write is always first
+				file->write_done = true;
+				if(cqe->res != (int)file->write_size) {
+					file->failed = true;
+				}
+			} else if(cqe->res < 0) {
+				file->failed = true;
+			}
+			io_uring_cqe_seen(&ring, cqe);
+
+			if(--file->remaining_completions == 0) {
+				Finish(*file);
+				delete file;
+				in_flight--;
+			}
+		}
+	}
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <core/SkData.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// Writes output files off the threads that produce them. With liburing on Linux one thread
+// batches every queued write and fsync into a single io_uring submission, otherwise, or if the
+// ring can't be created, a few threads do plain POSIX writes. Parent directories are created
+// once and remembered
+class OutputWriter {
+public:
+	OutputWriter(int num_threads);
+	// Waits for everything queued to be written
+	~OutputWriter();
+
+	// fsync every file before it counts as written
+	void SetSync(bool sync) {
+		this->sync = sync;
+	}
+	// Bypass the page cache for payloads of at least DIRECT_MIN_BYTES
+	void SetDirect(bool direct) {
+		this->direct = direct;
+	}
+
+	// Blocks while too much is queued already
+	void Write(std::string path, sk_sp<SkData> data);
+	void Write(std::string path, const char* data, size_t size);
+	void Flush();
+
+private:
+	struct Job {
+		std::string path;
+		sk_sp<SkData> data;
+	};
+
+	// An open file whose write is in flight
+	struct PendingFile {
+		Job job;
+		int fd      = -1;
+		bool direct = false;
+		// Aligned and padded copy of the data for O_DIRECT
+		void* buffer = nullptr;
+		const void* write_data;
+		size_t write_size;
+		bool write_done           = false;
+		int remaining_completions = 0;
+		bool failed               = false;
+		std::chrono::steady_clock::time_point start;
+	};
+
+	bool EnsureDirectory(std::string& path);
+	// Opens the file and prepares an aligned buffer if it is written with O_DIRECT
+	bool Open(PendingFile& file);
+	// Truncates padding written with O_DIRECT, closes the file and records metrics
+	void Finish(PendingFile& file);
+	void WriteThread();
+#ifdef HAVE_LIBURING
+	void RingThread();
+#endif
+
+	bool sync   = false;
+	bool direct = false;
+
+	std::deque<Job> jobs;
+	size_t queued_bytes = 0;
+	int busy            = 0;
+	bool running        = true;
+	std::mutex jobs_m;
+	std::condition_variable jobs_cv;
+	std::condition_variable idle_cv;
+
+	std::unordered_set<std::string> directories;
+	std::mutex directories_m;
+
+#ifdef HAVE_LIBURING
+	io_uring ring;
+	bool use_ring = false;
+#endif
+	std::vector<std::thread> threads;
+};
\ No newline at end of file
@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+# Local stand-in for Google's servers to check how the client paces requests, use it with
+#   ./streetview_client --endpoint http://localhost:8080 download ...
+# Nothing is forwarded, every endpoint the client uses gets a canned response: a client ID on
+# the main page, --panoramas panoramas in a row for every preview, photometa linking each to
+# its neighbours and the same gray PNG for every tile. Responses are slowed down or refused:
+#   --max-in-flight N    answer 429 with Retry-After once more than N requests are in flight
+#   --throttle-rate P    answer 429 to a random fraction P of requests
+#   --delay-ms D         add D milliseconds to every response
+#   --queue-delay-ms Q   add Q milliseconds for every other request in flight, like a server
+#                        queueing work, so latency grows with concurrency
+#   --slow-rate P        make a random fraction P of tiles take --slow-ms longer, for hedging
+# Once a second it prints requests, 429s and the most requests in flight at once. A well
+# behaved client settles below --max-in-flight and stops getting 429s after a few seconds.
+import argparse
+import json
+import random
+import re
+import struct
+import threading
+import time
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+CLIENT_ID = "standinclientid"
+# Google prefixes JSON responses with this to stop them being run as scripts
+JSON_PREFIX = ")]}'\n"
+TILE_SIZE = 512
+# 13312 wide at zoom 5 like most Street View panoramas
+FULL_WIDTH = 13312
+FULL_HEIGHT = 6656
+# Between neighbouring panoramas, about 11 meters
+PANORAMA_SPACING = 0.0001
+
+parser = argparse.ArgumentParser(description="Throttling stand-in for the Street View endpoints")
+parser.add_argument("--port", type=int, default=8080)
+parser.add_argument("--panoramas", type=int, default=50, help="Panoramas returned by a preview")
+parser.add_argument("--max-in-flight", type=int, default=0, help="0 for no limit")
+parser.add_argument("--throttle-rate", type=float, default=0.0)
+parser.add_argument("--retry-after", type=int, default=1, help="Seconds sent with every 429")
+parser.add_argument("--delay-ms", type=float, default=0.0)
+parser.add_argument("--queue-delay-ms", type=float, default=0.0)
+parser.add_argument("--slow-rate", type=float, default=0.0)
+parser.add_argument("--slow-ms", type=float, default=2000.0)
+args = parser.parse_args()
+
+lock = threading.Lock()
+in_flight = 0
+stats = {"requests": 0, "throttled": 0, "max_in_flight": 0}
+totals = {"requests": 0, "throttled": 0, "max_in_flight": 0}
+
+
+def make_tile():
+    def chunk(kind, data):
+        body = kind + data
+        return struct.pack(">I", len(data)) + body + struct.pack(">I", zlib.crc32(body))
+
+    # 8 bit grayscale, every row starts with filter type 0
+    row = b"\x00" + b"\x80" * TILE_SIZE
+    return (b"\x89PNG\r\n\x1a\n"
+            + chunk(b"IHDR", struct.pack(">IIBBBBB", TILE_SIZE, TILE_SIZE, 8, 0, 0, 0, 0))
+            + chunk(b"IDAT", zlib.compress(row * TILE_SIZE))
+            + chunk(b"IEND", b""))
+
+
+TILE = make_tile()
+
+
+def panorama_id(index):
+    # 22 characters like real IDs, shorter ones are not treated as Street View
+    return "standin{:015d}".format(index)
+
+
+def panorama_index(panorama):
+    match = re.fullmatch(r"standin(\d{15})", panorama)
+    return int(match.group(1)) if match else None
+
+
+def position(index):
+    return 42.36, -71.06 + index * PANORAMA_SPACING
+
+
+def preview():
+    previews = [[panorama_id(index)] for index in range(args.panoramas)]
+    return JSON_PREFIX + json.dumps([previews])
+
+
+def photometa(index):
+    lat, lng = position(index)
+    links = []
+    for neighbour in (index - 1, index, index + 1):
+        if 0 <= neighbour < args.panoramas:
+            neighbour_lat, neighbour_lng = position(neighbour)
+            links.append([[2, panorama_id(neighbour)], None,
+                          [[None, None, neighbour_lat, neighbour_lng], None, [90.0, 90.0, 0.0]]])
+    panorama = [
+        None,
+        [2, panorama_id(index)],
+        # Full size as height, width, then per zoom sizes, left empty, and the tile size
+        [None, None, [FULL_HEIGHT, FULL_WIDTH], [[], [TILE_SIZE, TILE_SIZE]]],
+        [None, None, ["Stand-in Street", "Stand-in City"]],
+        None,
+        [[None, [[None, None, lat, lng], None, [90.0, 90.0, 0.0]], None, [links]]],
+        [None, None, None, None, None, None, None, [2020, index % 12 + 1]],
+    ]
+    return JSON_PREFIX + json.dumps([None, [panorama]])
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_GET(self):
+        global in_flight
+        with lock:
+            in_flight += 1
+            current = in_flight
+            stats["requests"] += 1
+            stats["max_in_flight"] = max(stats["max_in_flight"], current)
+        try:
+            over_limit = args.max_in_flight and current > args.max_in_flight
+            if over_limit or random.random() < args.throttle_rate:
+                with lock:
+                    stats["throttled"] += 1
+                self.send_response(429)
+                self.send_header("Retry-After", str(args.retry_after))
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+
+            delay_ms = args.delay_ms + args.queue_delay_ms * (current - 1)
+            if self.path.startswith("/v1/tile") and random.random() < args.slow_rate:
+                delay_ms += args.slow_ms
+            time.sleep(delay_ms / 1000.0)
+            self.respond()
+        finally:
+            with lock:
+                in_flight -= 1
+
+    def respond(self):
+        url = urlparse(self.path)
+        status, content_type, body = 404, "text/plain", b""
+        if url.path == "/v1/tile":
+            query = parse_qs(url.query)
+            if panorama_index(query.get("panoid", [""])[0]) is not None:
+                status, content_type, body = 200, "image/png", TILE
+        elif url.path.endswith("/listentityphotos"):
+            status, content_type, body = 200, "application/json", preview().encode()
+        elif url.path.startswith("/maps/photometa/"):
+            # The ID follows the request type in the pb parameter
+            match = re.search(r"!1e2!2s([^!&]+)", url.query)
+            index = panorama_index(match.group(1)) if match else None
+            if index is not None and index < args.panoramas:
+                status, content_type, body = 200, "application/json", photometa(index).encode()
+        elif url.path.startswith("/maps"):
+            page = '<script>var x=[["a"],null,0,"{}"]</script>'.format(CLIENT_ID)
+            status, content_type, body = 200, "text/html", page.encode()
+
+        self.send_response(status)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *log_args):
+        pass
+
+
+def report():
+    while True:
+        time.sleep(1)
+        with lock:
+            line = dict(stats)
+            for key in ("requests", "throttled"):
+                totals[key] += stats[key]
+                stats[key] = 0
+            totals["max_in_flight"] = max(totals["max_in_flight"], stats["max_in_flight"])
+            stats["max_in_flight"] = in_flight
+        print("{requests} requests/s, {throttled} throttled, {max_in_flight} max in flight"
+              .format(**line), flush=True)
+
+
+threading.Thread(target=report, daemon=True).start()
+server = ThreadingHTTPServer(("127.0.0.1", args.port), Handler)
+print("Listening on http://127.0.0.1:{}".format(args.port), flush=True)
+try:
+    server.serve_forever()
+except KeyboardInterrupt:
+    print("{requests} requests, {throttled} throttled, {max_in_flight} max in flight".format(**totals))